@@ -25,6 +25,8 @@ struct outer_cache_fns {
 	void (*inv_range)(unsigned long, unsigned long);
 	void (*clean_range)(unsigned long, unsigned long);
 	void (*flush_range)(unsigned long, unsigned long);
+	void (*clean_all)(void);
+	void (*flush_all)(void);
 	void (*shutdown)(void);
 	void (*restart)(void);
 #ifdef CONFIG_OUTER_CACHE_SYNC
@@ -52,6 +54,26 @@ static inline void outer_flush_range(unsigned long start, unsigned long end)
 		outer_cache.flush_range(start, end);
 }
 
+/*
+ * Whole-cache maintenance, for when a range is large enough that walking
+ * it line by line costs more. Returns false if the outer cache can't do
+ * it, in which case the caller should fall back to the range operation.
+ */
+static inline bool outer_clean_all(void)
+{
+	if (!outer_cache.clean_all)
+		return false;
+	outer_cache.clean_all();
+	return true;
+}
+static inline bool outer_flush_all(void)
+{
+	if (!outer_cache.flush_all)
+		return false;
+	outer_cache.flush_all();
+	return true;
+}
+
 static inline void outer_shutdown(void)
 {
 	if (outer_cache.shutdown)
@@ -72,6 +94,10 @@ static inline void outer_clean_range(unsigned long start, unsigned long end)
 { }
 static inline void outer_flush_range(unsigned long start, unsigned long end)
 { }
+static inline bool outer_clean_all(void)
+{ return true; }
+static inline bool outer_flush_all(void)
+{ return true; }
 static inline void outer_shutdown(void)
 { }
 static inline void outer_restart(void)
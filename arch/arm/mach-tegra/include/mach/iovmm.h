@@ -50,6 +50,13 @@ struct tegra_iovmm_device {
  * <linux/mm_types.h> - it defines a virtual address space within which
  * tegra_iovmm_areas can be created.
  */
+/* free address space is managed as a binary buddy system: a free block of
+ * order n is 2^n pages long and aligned to 2^n pages from the domain base.
+ * allocations are carved out of the smallest sufficient free block and the
+ * unused tail is immediately returned to the free lists, so only address
+ * space that is actually mapped is held. */
+#define TEGRA_IOVMM_MAX_ORDER	16
+
 struct tegra_iovmm_domain {
 	atomic_t		clients;
 	atomic_t		locks;
@@ -58,7 +65,17 @@ struct tegra_iovmm_domain {
 	wait_queue_head_t	delay_lock;  /* when lock_client fails */
 	struct rw_semaphore	map_lock;
 	struct rb_root		all_blocks;  /* ordered by address */
-	struct rb_root		free_blocks; /* ordered by size */
+	struct list_head	free_area[TEGRA_IOVMM_MAX_ORDER];
+	unsigned int		nr_free_area[TEGRA_IOVMM_MAX_ORDER];
+	struct list_head	spare_blocks; /* preallocated for split/free */
+	unsigned int		nr_spare;
+	tegra_iovmm_addr_t	base;
+	/* allocator statistics, protected by block_lock */
+	unsigned long		nr_allocs;
+	unsigned long		nr_alloc_fails;
+	unsigned long		nr_frees;
+	unsigned long		nr_splits;
+	unsigned long		nr_merges;
 	struct tegra_iovmm_device *dev;
 };
 
@@ -21,6 +21,7 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/log2.h>
 #include <linux/spinlock.h>
 #include <linux/proc_fs.h>
 #include <linux/sched.h>
@@ -29,17 +30,23 @@
 
 #include <mach/iovmm.h>
 
-/* after the best-fit block is located, the remaining pages not needed for
- * the allocation will be split into a new free block if the number of
- * remaining pages is >= MIN_SPLIT_PAGE.
- */
-#define MIN_SPLIT_PAGE (4)
-#define MIN_SPLIT_BYTES(_d) (MIN_SPLIT_PAGE<<(_d)->dev->pgsize_bits)
+/* blocks are preallocated into a per-domain spare pool before the block
+ * lock is taken, so that splitting and merging never allocate under it.
+ * an allocation creates at most one free block per order (splitting the
+ * buddy down and trimming the unused tail never both produce the same
+ * order), and a free decomposes the released range into at most two
+ * blocks per order. */
+#define IOVMM_SPARE_BLOCKS (2*TEGRA_IOVMM_MAX_ORDER)
 
 #define iovmm_start(_b) ((_b)->vm_area.iovm_start)
 #define iovmm_length(_b) ((_b)->vm_area.iovm_length)
 #define iovmm_end(_b) (iovmm_start(_b) + iovmm_length(_b))
 
+/* conversion between addresses and page offsets from the domain base */
+#define iovmm_pfn(_d, _a) (((_a) - (_d)->base) >> (_d)->dev->pgsize_bits)
+#define iovmm_addr(_d, _p) \
+	((_d)->base + ((tegra_iovmm_addr_t)(_p) << (_d)->dev->pgsize_bits))
+
 /* flags for the block */
 #define BK_free		0 /* indicates free mappings */
 #define BK_map_dirty	1 /* used by demand-loaded mappings */
@@ -55,7 +62,8 @@ struct tegra_iovmm_block {
 	atomic_t		ref;
 	unsigned long		flags;
 	unsigned long		poison;
-	struct rb_node		free_node;
+	unsigned int		order;     /* valid while BK_free is set */
+	struct list_head	free_list; /* in free_area[order] or spares */
 	struct rb_node		all_node;
 };
 
@@ -74,6 +82,8 @@ static struct kmem_cache *iovmm_cache;
 
 int nvmap_get_unpinned_iovmm_memory(int *total_unpinned_mem,
 	int *largest_unpinned_mem);
+int nvmap_get_iovmm_reclaim_stats(unsigned long *reused,
+	unsigned long *evicted);
 
 static tegra_iovmm_addr_t iovmm_align_up(struct tegra_iovmm_device *dev,
 	tegra_iovmm_addr_t addr)
@@ -128,9 +138,12 @@ static int tegra_iovmm_read_proc(char *page, char **start, off_t off,
 	int count, int *eof, void *data)
 {
 	struct iovmm_share_group *grp;
+	struct tegra_iovmm_domain *domain;
 	tegra_iovmm_addr_t max_free, total_free, total;
 	unsigned int num, num_free;
 	unsigned int total_unpinned, largest_unpinned;
+	unsigned long reused, evicted;
+	int i;
 
 	int len = 0;
 
@@ -157,6 +170,19 @@ static int tegra_iovmm_read_proc(char *page, char **start, off_t off,
 				"largest=%uKiB, pinned:total=%uKiB\n",
 				total_unpinned, largest_unpinned,
 				(total - total_free - total_unpinned));
+			nvmap_get_iovmm_reclaim_stats(&reused, &evicted);
+			len += iovmprint("\t\treclaim: reused=%lu "
+				"evicted=%lu\n", reused, evicted);
+			domain = grp->domain;
+			len += iovmprint("\t\tbuddy: allocs=%lu fails=%lu "
+				"frees=%lu splits=%lu merges=%lu\n",
+				domain->nr_allocs, domain->nr_alloc_fails,
+				domain->nr_frees, domain->nr_splits,
+				domain->nr_merges);
+			len += iovmprint("\t\tfree blocks by order:");
+			for (i=0; i<TEGRA_IOVMM_MAX_ORDER; i++)
+				len += iovmprint(" %u", domain->nr_free_area[i]);
+			len += iovmprint("\n");
 		}
 	}
 	mutex_unlock(&iovmm_list_lock);
@@ -175,187 +201,254 @@ static void iovmm_block_put(struct tegra_iovmm_block *b)
 	}
 }
 
-static void iovmm_free_block(struct tegra_iovmm_domain *domain,
+static void iovmm_insert_block(struct tegra_iovmm_domain *domain,
 	struct tegra_iovmm_block *block)
 {
-	struct tegra_iovmm_block *pred = NULL; /* address-order predecessor */
-	struct tegra_iovmm_block *succ = NULL; /* address-order successor */
-	struct rb_node **p;
-	struct rb_node *parent = NULL, *temp;
-	int pred_free = 0, succ_free = 0;
-
-	iovmm_block_put(block);
-
-	spin_lock(&domain->block_lock);
-	temp = rb_prev(&block->all_node);
-	if (temp)
-		pred = rb_entry(temp, struct tegra_iovmm_block, all_node);
-	temp = rb_next(&block->all_node);
-	if (temp)
-		succ = rb_entry(temp, struct tegra_iovmm_block, all_node);
-
-	if (pred) pred_free = test_bit(BK_free, &pred->flags);
-	if (succ) succ_free = test_bit(BK_free, &succ->flags);
-
-	if (pred_free && succ_free) {
-		iovmm_length(pred) += iovmm_length(block);
-		iovmm_length(pred) += iovmm_length(succ);
-		rb_erase(&block->all_node, &domain->all_blocks);
-		rb_erase(&succ->all_node, &domain->all_blocks);
-		rb_erase(&succ->free_node, &domain->free_blocks);
-		rb_erase(&pred->free_node, &domain->free_blocks);
-		iovmm_block_put(block);
-		iovmm_block_put(succ);
-		block = pred;
-	} else if (pred_free) {
-		iovmm_length(pred) += iovmm_length(block);
-		rb_erase(&block->all_node, &domain->all_blocks);
-		rb_erase(&pred->free_node, &domain->free_blocks);
-		iovmm_block_put(block);
-		block = pred;
-	} else if (succ_free) {
-		iovmm_length(block) += iovmm_length(succ);
-		rb_erase(&succ->all_node, &domain->all_blocks);
-		rb_erase(&succ->free_node, &domain->free_blocks);
-		iovmm_block_put(succ);
-	}
+	struct rb_node **p = &domain->all_blocks.rb_node;
+	struct rb_node *parent = NULL;
+	struct tegra_iovmm_block *b;
 
-	p = &domain->free_blocks.rb_node;
 	while (*p) {
-		struct tegra_iovmm_block *b;
 		parent = *p;
-		b = rb_entry(parent, struct tegra_iovmm_block, free_node);
-		if (iovmm_length(block) >= iovmm_length(b))
+		b = rb_entry(parent, struct tegra_iovmm_block, all_node);
+		if (iovmm_start(block) >= iovmm_start(b))
 			p = &parent->rb_right;
 		else
 			p = &parent->rb_left;
 	}
-	rb_link_node(&block->free_node, parent, p);
-	rb_insert_color(&block->free_node, &domain->free_blocks);
-	set_bit(BK_free, &block->flags);
-	spin_unlock(&domain->block_lock);
+	rb_link_node(&block->all_node, parent, p);
+	rb_insert_color(&block->all_node, &domain->all_blocks);
 }
 
-/* if the best-fit block is larger than the requested size, a remainder
- * block will be created and inserted into the free list in its place.
- * since all free blocks are stored in two trees the new block needs to be
- * linked into both. */
-static void iovmm_split_free_block(struct tegra_iovmm_domain *domain,
-	struct tegra_iovmm_block *block, unsigned long size)
+static struct tegra_iovmm_block *iovmm_lookup_block(
+	struct tegra_iovmm_domain *domain, tegra_iovmm_addr_t addr)
 {
-	struct rb_node **p;
-	struct rb_node *parent = NULL;
-	struct tegra_iovmm_block *rem;
+	struct rb_node *n = domain->all_blocks.rb_node;
 	struct tegra_iovmm_block *b;
 
-	rem = kmem_cache_zalloc(iovmm_cache, GFP_KERNEL);
-	if (!rem) return;
+	while (n) {
+		b = rb_entry(n, struct tegra_iovmm_block, all_node);
+		if (addr == iovmm_start(b))
+			return b;
+		if (addr > iovmm_start(b))
+			n = n->rb_right;
+		else
+			n = n->rb_left;
+	}
+	return NULL;
+}
+
+/* acquires the block lock with at least IOVMM_SPARE_BLOCKS blocks in the
+ * domain's spare pool; the lock is not held if an error is returned */
+static int iovmm_lock_reserve(struct tegra_iovmm_domain *domain, gfp_t gfp)
+{
+	struct tegra_iovmm_block *b;
 
 	spin_lock(&domain->block_lock);
-	p = &domain->free_blocks.rb_node;
+	while (domain->nr_spare < IOVMM_SPARE_BLOCKS) {
+		spin_unlock(&domain->block_lock);
+		b = kmem_cache_zalloc(iovmm_cache, gfp);
+		if (!b) return -ENOMEM;
+		spin_lock(&domain->block_lock);
+		list_add(&b->free_list, &domain->spare_blocks);
+		domain->nr_spare++;
+	}
+	return 0;
+}
 
-	iovmm_start(rem) = iovmm_start(block) + size;
-	iovmm_length(rem) = iovmm_length(block) - size;
-	atomic_set(&rem->ref, 1);
-	iovmm_length(block) = size;
+/* blocks absorbed by a buddy merge are returned to the spare pool rather
+ * than the slab, since the next split will need them again. free blocks
+ * are never returned by tegra_iovmm_find_area_get, so the domain holds
+ * the only reference. */
+static void iovmm_recycle_block(struct tegra_iovmm_domain *domain,
+	struct tegra_iovmm_block *b)
+{
+	if (domain->nr_spare < IOVMM_SPARE_BLOCKS) {
+		memset(b, 0, sizeof(*b));
+		list_add(&b->free_list, &domain->spare_blocks);
+		domain->nr_spare++;
+	} else
+		iovmm_block_put(b);
+}
 
-	while (*p) {
-		parent = *p;
-		b = rb_entry(parent, struct tegra_iovmm_block, free_node);
-		if (iovmm_length(rem) >= iovmm_length(b))
-			p = &parent->rb_right;
-		else
-			p = &parent->rb_left;
+/* creates a free block of 2^order pages at page offset pfn from the spare
+ * pool. called with block_lock held */
+static void iovmm_add_free_block(struct tegra_iovmm_domain *domain,
+	unsigned long pfn, unsigned int order)
+{
+	struct tegra_iovmm_block *b;
+
+	BUG_ON(list_empty(&domain->spare_blocks));
+	b = list_first_entry(&domain->spare_blocks,
+		struct tegra_iovmm_block, free_list);
+	list_del(&b->free_list);
+	domain->nr_spare--;
+
+	atomic_set(&b->ref, 1);
+	b->flags = 0;
+	set_bit(BK_free, &b->flags);
+	b->order = order;
+	iovmm_start(b) = iovmm_addr(domain, pfn);
+	iovmm_length(b) = (tegra_iovmm_addr_t)1 <<
+		(order + domain->dev->pgsize_bits);
+	list_add_tail(&b->free_list, &domain->free_area[order]);
+	domain->nr_free_area[order]++;
+	iovmm_insert_block(domain, b);
+}
+
+/* returns the order of the largest buddy-aligned block which starts at
+ * page offset pfn and does not extend past end */
+static unsigned int iovmm_chunk_order(unsigned long pfn, unsigned long end)
+{
+	unsigned int order = ilog2(end - pfn);
+
+	if (pfn)
+		order = min_t(unsigned int, order, __ffs(pfn));
+	return min_t(unsigned int, order, TEGRA_IOVMM_MAX_ORDER-1);
+}
+
+/* returns 2^order pages at page offset pfn to the free lists, merging with
+ * the buddy for as long as it is free and of the same order. called with
+ * block_lock held */
+static void iovmm_free_range(struct tegra_iovmm_domain *domain,
+	unsigned long pfn, unsigned int order)
+{
+	struct tegra_iovmm_block *buddy;
+
+	while (order < TEGRA_IOVMM_MAX_ORDER-1) {
+		buddy = iovmm_lookup_block(domain,
+			iovmm_addr(domain, pfn ^ (1UL << order)));
+		if (!buddy || !test_bit(BK_free, &buddy->flags) ||
+		    buddy->order != order)
+			break;
+		list_del(&buddy->free_list);
+		domain->nr_free_area[order]--;
+		rb_erase(&buddy->all_node, &domain->all_blocks);
+		iovmm_recycle_block(domain, buddy);
+		domain->nr_merges++;
+		pfn &= ~(1UL << order);
+		order++;
 	}
-	set_bit(BK_free, &rem->flags);
-	rb_link_node(&rem->free_node, parent, p);
-	rb_insert_color(&rem->free_node, &domain->free_blocks);
+	iovmm_add_free_block(domain, pfn, order);
+}
 
-	p = &domain->all_blocks.rb_node;
-	parent = NULL;
-	while (*p) {
-		parent = *p;
-		b = rb_entry(parent, struct tegra_iovmm_block, all_node);
-		if (iovmm_start(rem) >= iovmm_start(b))
-			p = &parent->rb_right;
-		else
-			p = &parent->rb_left;
+static void iovmm_free_block(struct tegra_iovmm_domain *domain,
+	struct tegra_iovmm_block *block)
+{
+	unsigned long pfn, end;
+	unsigned int order;
+
+	iovmm_block_put(block);
+
+	/* a free must not fail, and needs no more than the reserve */
+	iovmm_lock_reserve(domain, GFP_KERNEL | __GFP_NOFAIL);
+	pfn = iovmm_pfn(domain, iovmm_start(block));
+	end = iovmm_pfn(domain, iovmm_end(block));
+	rb_erase(&block->all_node, &domain->all_blocks);
+	iovmm_block_put(block);
+
+	while (pfn < end) {
+		order = iovmm_chunk_order(pfn, end);
+		iovmm_free_range(domain, pfn, order);
+		pfn += 1UL << order;
 	}
-	rb_link_node(&rem->all_node, parent, p);
-	rb_insert_color(&rem->all_node, &domain->all_blocks);
+	domain->nr_frees++;
+	spin_unlock(&domain->block_lock);
 }
 
+/* allocations are satisfied from the smallest free block of at least the
+ * rounded-up power-of-two size, splitting it down to that order. the
+ * pages past the requested size are then handed back as smaller free
+ * blocks, which cannot merge with anything since their buddies lie
+ * within the allocation. */
 static struct tegra_iovmm_block *iovmm_alloc_block(
 	struct tegra_iovmm_domain *domain, unsigned long size)
 {
-	struct rb_node *n;
-	struct tegra_iovmm_block *b, *best;
-        static int splitting = 0;
+	struct tegra_iovmm_block *b;
+	unsigned long pfn, pages, end;
+	unsigned int order, o;
 
 	BUG_ON(!size);
 	size = iovmm_align_up(domain->dev, size);
-        for (;;) {
-		spin_lock(&domain->block_lock);
-		if (!splitting)
-			break;
-		spin_unlock(&domain->block_lock);
-		schedule();
-	}
-	n = domain->free_blocks.rb_node;
-	best = NULL;
-	while (n) {
-		b = rb_entry(n, struct tegra_iovmm_block, free_node);
-		if (iovmm_length(b) < size) n = n->rb_right;
-		else if (iovmm_length(b) == size) {
-			best = b;
+	pages = size >> domain->dev->pgsize_bits;
+	order = order_base_2(pages);
+	if (order >= TEGRA_IOVMM_MAX_ORDER)
+		return NULL;
+
+	if (iovmm_lock_reserve(domain, GFP_KERNEL))
+		return NULL;
+
+	for (o=order; o<TEGRA_IOVMM_MAX_ORDER; o++)
+		if (!list_empty(&domain->free_area[o]))
 			break;
-		} else {
-			best = b;
-			n = n->rb_left;
-		}
-	}
-	if (!best) {
+	if (o == TEGRA_IOVMM_MAX_ORDER) {
+		domain->nr_alloc_fails++;
 		spin_unlock(&domain->block_lock);
 		return NULL;
 	}
-	rb_erase(&best->free_node, &domain->free_blocks);
-	clear_bit(BK_free, &best->flags);
-	atomic_inc(&best->ref);
-	if (iovmm_length(best) >= size+MIN_SPLIT_BYTES(domain)) {
-		splitting = 1;
-		spin_unlock(&domain->block_lock);
-		iovmm_split_free_block(domain, best, size);
-		splitting = 0;
+
+	b = list_first_entry(&domain->free_area[o],
+		struct tegra_iovmm_block, free_list);
+	list_del(&b->free_list);
+	domain->nr_free_area[o]--;
+	clear_bit(BK_free, &b->flags);
+	pfn = iovmm_pfn(domain, iovmm_start(b));
+
+	while (o > order) {
+		o--;
+		iovmm_add_free_block(domain, pfn + (1UL << o), o);
+		domain->nr_splits++;
+	}
+
+	end = pfn + (1UL << order);
+	pfn += pages;
+	while (pfn < end) {
+		o = iovmm_chunk_order(pfn, end);
+		iovmm_add_free_block(domain, pfn, o);
+		pfn += 1UL << o;
 	}
 
+	iovmm_length(b) = size;
+	atomic_inc(&b->ref);
+	domain->nr_allocs++;
 	spin_unlock(&domain->block_lock);
 
-	return best;
+	return b;
 }
 
 int tegra_iovmm_domain_init(struct tegra_iovmm_domain *domain,
 	struct tegra_iovmm_device *dev, tegra_iovmm_addr_t start,
 	tegra_iovmm_addr_t end)
 {
-	struct tegra_iovmm_block *b;
-
-	b = kmem_cache_zalloc(iovmm_cache, GFP_KERNEL);
-	if (!b) return -ENOMEM;
+	unsigned long pfn, pages;
+	unsigned int order;
+	int i;
 
 	domain->dev = dev;
 	atomic_set(&domain->clients, 0);
 	atomic_set(&domain->locks, 0);
-	atomic_set(&b->ref, 1);
 	spin_lock_init(&domain->block_lock);
 	init_rwsem(&domain->map_lock);
 	init_waitqueue_head(&domain->delay_lock);
-	iovmm_start(b) = iovmm_align_up(dev, start);
-	iovmm_length(b) = iovmm_align_down(dev, end) - iovmm_start(b);
-	set_bit(BK_free, &b->flags);
-	rb_link_node(&b->free_node, NULL, &domain->free_blocks.rb_node);
-	rb_insert_color(&b->free_node, &domain->free_blocks);
-	rb_link_node(&b->all_node, NULL, &domain->all_blocks.rb_node);
-	rb_insert_color(&b->all_node, &domain->all_blocks);
+	domain->all_blocks = RB_ROOT;
+	for (i=0; i<TEGRA_IOVMM_MAX_ORDER; i++) {
+		INIT_LIST_HEAD(&domain->free_area[i]);
+		domain->nr_free_area[i] = 0;
+	}
+	INIT_LIST_HEAD(&domain->spare_blocks);
+	domain->nr_spare = 0;
+
+	/* the aperture need not be a power of two in size; seed the free
+	 * lists with the largest aligned blocks that cover it */
+	domain->base = iovmm_align_up(dev, start);
+	pages = iovmm_pfn(domain, iovmm_align_down(dev, end));
+	for (pfn=0; pfn<pages; pfn+=1UL<<order) {
+		if (iovmm_lock_reserve(domain, GFP_KERNEL))
+			return -ENOMEM;
+		order = iovmm_chunk_order(pfn, pages);
+		iovmm_add_free_block(domain, pfn, order);
+		spin_unlock(&domain->block_lock);
+	}
 	return 0;
 }
 
@@ -21,11 +21,13 @@
 #include <linux/io.h>
 
 #include <asm/cacheflush.h>
+#include <asm/sizes.h>
 #include <asm/hardware/cache-l2x0.h>
 
 #define CACHE_LINE_SIZE		32
 
 static void __iomem *l2x0_base;
+static unsigned int l2x0_ways, l2x0_sets;
 bool l2x0_disabled;
 
 #ifdef CONFIG_CACHE_PL310
@@ -161,6 +163,48 @@ static inline void l2x0_flush_all(void)
 	l2x0_unlock(&l2x0_lock, flags);
 }
 
+/*
+ * Clean (or clean+invalidate) the whole cache one set/way at a time.
+ * Unlike the background by-way operations these are the same kind of
+ * atomic maintenance operation as the by-PA ones, so they may run
+ * concurrently with range operations on other CPUs.
+ */
+static void l2x0_op_all_by_index(unsigned long reg)
+{
+	void __iomem *base = l2x0_base;
+	unsigned long flags;
+	unsigned int way, set;
+
+	l2x0_lock(&l2x0_lock, flags);
+	for (way = 0; way < l2x0_ways; way++) {
+		for (set = 0; set < l2x0_sets; set++) {
+			cache_wait(base + reg, 1);
+			writel_relaxed((way << 28) | (set * CACHE_LINE_SIZE),
+				       base + reg);
+		}
+
+		if (way + 1 < l2x0_ways) {
+			l2x0_unlock(&l2x0_lock, flags);
+			l2x0_lock(&l2x0_lock, flags);
+		}
+	}
+	cache_wait(base + reg, 1);
+	cache_sync();
+	l2x0_unlock(&l2x0_lock, flags);
+}
+
+static void l2x0_clean_all(void)
+{
+	l2x0_op_all_by_index(L2X0_CLEAN_LINE_IDX);
+}
+
+static void l2x0_flush_all_by_index(void)
+{
+	debug_writel(0x03);
+	l2x0_op_all_by_index(L2X0_CLEAN_INV_LINE_IDX);
+	debug_writel(0x00);
+}
+
 static void l2x0_inv_range(unsigned long start, unsigned long end)
 {
 	void __iomem *base = l2x0_base;
@@ -318,6 +362,8 @@ static void l2x0_restart(void)
 
 void __init l2x0_init(void __iomem *base, __u32 aux_val, __u32 aux_mask)
 {
+	u32 aux;
+
 	if (l2x0_disabled) {
 		pr_info(L2CC_TYPE " cache controller disabled\n");
 		return;
@@ -327,9 +373,16 @@ void __init l2x0_init(void __iomem *base, __u32 aux_val, __u32 aux_mask)
 
 	l2x0_enable(aux_val, aux_mask);
 
+	/* way size field: 1 = 16KB, doubling with each step */
+	aux = readl_relaxed(l2x0_base + L2X0_AUX_CTRL);
+	l2x0_ways = (aux & (1 << 16)) ? 16 : 8;
+	l2x0_sets = (SZ_8K << max(1U, (aux >> 17) & 0x7)) / CACHE_LINE_SIZE;
+
 	outer_cache.inv_range = l2x0_inv_range;
 	outer_cache.clean_range = l2x0_clean_range;
 	outer_cache.flush_range = l2x0_flush_range;
+	outer_cache.clean_all = l2x0_clean_all;
+	outer_cache.flush_all = l2x0_flush_all_by_index;
 	outer_cache.sync = l2x0_cache_sync;
 	outer_cache.shutdown = l2x0_shutdown;
 	outer_cache.restart = l2x0_restart;
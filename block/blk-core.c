@@ -26,6 +26,7 @@
 #include <linux/swap.h>
 #include <linux/writeback.h>
 #include <linux/task_io_accounting_ops.h>
+#include <linux/uid_stat.h>
 #include <linux/fault-inject.h>
 
 #define CREATE_TRACE_POINTS
@@ -1568,6 +1569,7 @@ void submit_bio(int rw, struct bio *bio)
 			task_io_account_read(bio->bi_size);
 			count_vm_events(PGPGIN, count);
 		}
+		uid_stat_blk_io(rw, bio->bi_size);
 
 		if (unlikely(block_dump)) {
 			char b[BDEVNAME_SIZE];
@@ -16,38 +16,68 @@
 #include <asm/atomic.h>
 
 #include <linux/err.h>
+#include <linux/hash.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <linux/module.h>
 #include <linux/proc_fs.h>
+#include <linux/rculist.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/stat.h>
+#include <linux/uaccess.h>
 #include <linux/uid_stat.h>
+#include <linux/workqueue.h>
+
+#define UID_HASH_BITS	6
+#define UID_HASH_SIZE	(1 << UID_HASH_BITS)
 
 static DEFINE_SPINLOCK(uid_lock);
 static LIST_HEAD(uid_list);
+static struct hlist_head uid_hash[UID_HASH_SIZE];
+static LIST_HEAD(uid_pending);
 static struct proc_dir_entry *parent;
 
+static void uid_stat_proc_work(struct work_struct *work);
+static DECLARE_WORK(uid_proc_work, uid_stat_proc_work);
+
+/*
+ * Entries are never freed, so lookups walk the hash under RCU only and
+ * the returned pointer stays valid. uid_lock serializes insertion.
+ */
 struct uid_stat {
 	struct list_head link;
+	struct hlist_node hash;
+	struct list_head pending;
 	uid_t uid;
 	atomic_t tcp_rcv;
 	atomic_t tcp_snd;
+
+	spinlock_t lock;		/* protects the counters below */
+	u64 io_read_bytes;
+	u64 io_write_bytes;
+	u64 io_read_ops;
+	u64 io_write_ops;
+	u64 cpu_user_us;
+	u64 cpu_sys_us;
+	u64 wakeups;
 };
 
 static struct uid_stat *find_uid_stat(uid_t uid) {
-	unsigned long flags;
 	struct uid_stat *entry;
+	struct hlist_node *node;
 
-	spin_lock_irqsave(&uid_lock, flags);
-	list_for_each_entry(entry, &uid_list, link) {
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(entry, node,
+				 &uid_hash[hash_long(uid, UID_HASH_BITS)], hash) {
 		if (entry->uid == uid) {
-			spin_unlock_irqrestore(&uid_lock, flags);
+			rcu_read_unlock();
 			return entry;
 		}
 	}
-	spin_unlock_irqrestore(&uid_lock, flags);
+	rcu_read_unlock();
 	return NULL;
 }
 
@@ -87,66 +117,311 @@ static int tcp_rcv_read_proc(char *page, char **start, off_t off,
 	return len;
 }
 
-/* Create a new entry for tracking the specified uid. */
-static struct uid_stat *create_stat(uid_t uid) {
-	unsigned long flags;
+#define UID_STAT_U64_READ_PROC(field)					\
+static int field##_read_proc(char *page, char **start, off_t off,	\
+				int count, int *eof, void *data)	\
+{									\
+	int len;							\
+	u64 val;							\
+	unsigned long flags;						\
+	char *p = page;							\
+	struct uid_stat *uid_entry = (struct uid_stat *) data;		\
+	if (!data)							\
+		return 0;						\
+									\
+	spin_lock_irqsave(&uid_entry->lock, flags);			\
+	val = uid_entry->field;						\
+	spin_unlock_irqrestore(&uid_entry->lock, flags);		\
+	p += sprintf(p, "%llu\n", (unsigned long long) val);		\
+	len = (p - page) - off;						\
+	*eof = (len <= count) ? 1 : 0;					\
+	*start = page + off;						\
+	return len;							\
+}
+
+UID_STAT_U64_READ_PROC(io_read_bytes)
+UID_STAT_U64_READ_PROC(io_write_bytes)
+UID_STAT_U64_READ_PROC(io_read_ops)
+UID_STAT_U64_READ_PROC(io_write_ops)
+UID_STAT_U64_READ_PROC(cpu_user_us)
+UID_STAT_U64_READ_PROC(cpu_sys_us)
+UID_STAT_U64_READ_PROC(wakeups)
+
+static void create_stat_proc(struct uid_stat *new_uid)
+{
 	char uid_s[32];
-	struct uid_stat *new_uid;
 	struct proc_dir_entry *entry;
 
+	sprintf(uid_s, "%d", new_uid->uid);
+	entry = proc_mkdir(uid_s, parent);
+	if (!entry)
+		return;
+
+	/* Keep reference to uid_stat so we know what uid to read stats from. */
+	create_proc_read_entry("tcp_snd", S_IRUGO, entry , tcp_snd_read_proc,
+		(void *) new_uid);
+
+	create_proc_read_entry("tcp_rcv", S_IRUGO, entry, tcp_rcv_read_proc,
+		(void *) new_uid);
+
+	create_proc_read_entry("io_read_bytes", S_IRUGO, entry,
+		io_read_bytes_read_proc, (void *) new_uid);
+	create_proc_read_entry("io_write_bytes", S_IRUGO, entry,
+		io_write_bytes_read_proc, (void *) new_uid);
+	create_proc_read_entry("io_read_ops", S_IRUGO, entry,
+		io_read_ops_read_proc, (void *) new_uid);
+	create_proc_read_entry("io_write_ops", S_IRUGO, entry,
+		io_write_ops_read_proc, (void *) new_uid);
+	create_proc_read_entry("cpu_user_us", S_IRUGO, entry,
+		cpu_user_us_read_proc, (void *) new_uid);
+	create_proc_read_entry("cpu_sys_us", S_IRUGO, entry,
+		cpu_sys_us_read_proc, (void *) new_uid);
+	create_proc_read_entry("wakeups", S_IRUGO, entry,
+		wakeups_read_proc, (void *) new_uid);
+}
+
+/*
+ * Entries may be created from atomic context (block submission, the
+ * tick), so their proc directories are made from a work item instead.
+ */
+static void uid_stat_proc_work(struct work_struct *work)
+{
+	unsigned long flags;
+	struct uid_stat *entry;
+
+	for (;;) {
+		spin_lock_irqsave(&uid_lock, flags);
+		if (list_empty(&uid_pending)) {
+			spin_unlock_irqrestore(&uid_lock, flags);
+			break;
+		}
+		entry = list_first_entry(&uid_pending, struct uid_stat,
+					 pending);
+		list_del_init(&entry->pending);
+		spin_unlock_irqrestore(&uid_lock, flags);
+
+		create_stat_proc(entry);
+	}
+}
+
+/* Create a new entry for tracking the specified uid. */
+static struct uid_stat *create_stat(uid_t uid, gfp_t gfp) {
+	unsigned long flags;
+	struct uid_stat *new_uid, *entry;
+	struct hlist_head *head = &uid_hash[hash_long(uid, UID_HASH_BITS)];
+	struct hlist_node *node;
+
+	/* Nothing to hang the proc directory off before uid_stat_init. */
+	if (!parent)
+		return NULL;
+
 	/* Create the uid stat struct and append it to the list. */
-	if ((new_uid = kmalloc(sizeof(struct uid_stat), GFP_KERNEL)) == NULL)
+	if ((new_uid = kzalloc(sizeof(struct uid_stat), gfp)) == NULL)
 		return NULL;
 
 	new_uid->uid = uid;
 	/* Counters start at INT_MIN, so we can track 4GB of network traffic. */
 	atomic_set(&new_uid->tcp_rcv, INT_MIN);
 	atomic_set(&new_uid->tcp_snd, INT_MIN);
+	spin_lock_init(&new_uid->lock);
 
 	spin_lock_irqsave(&uid_lock, flags);
-	list_add_tail(&new_uid->link, &uid_list);
+	/* Someone else may have raced us to it. */
+	hlist_for_each_entry(entry, node, head, hash) {
+		if (entry->uid == uid) {
+			spin_unlock_irqrestore(&uid_lock, flags);
+			kfree(new_uid);
+			return entry;
+		}
+	}
+	hlist_add_head_rcu(&new_uid->hash, head);
+	list_add_tail_rcu(&new_uid->link, &uid_list);
+	list_add_tail(&new_uid->pending, &uid_pending);
 	spin_unlock_irqrestore(&uid_lock, flags);
 
-	sprintf(uid_s, "%d", uid);
-	entry = proc_mkdir(uid_s, parent);
+	schedule_work(&uid_proc_work);
 
-	/* Keep reference to uid_stat so we know what uid to read stats from. */
-	create_proc_read_entry("tcp_snd", S_IRUGO, entry , tcp_snd_read_proc,
-		(void *) new_uid);
+	return new_uid;
+}
 
-	create_proc_read_entry("tcp_rcv", S_IRUGO, entry, tcp_rcv_read_proc,
-		(void *) new_uid);
+static struct uid_stat *get_uid_stat(uid_t uid, gfp_t gfp)
+{
+	struct uid_stat *entry;
 
-	return new_uid;
+	entry = find_uid_stat(uid);
+	if (!entry)
+		entry = create_stat(uid, gfp);
+	return entry;
 }
 
 int update_tcp_snd(uid_t uid, int size) {
 	struct uid_stat *entry;
-	if ((entry = find_uid_stat(uid)) == NULL &&
-		((entry = create_stat(uid)) == NULL)) {
-			return -1;
-	}
+	if ((entry = get_uid_stat(uid, GFP_KERNEL)) == NULL)
+		return -1;
 	atomic_add(size, &entry->tcp_snd);
 	return 0;
 }
 
 int update_tcp_rcv(uid_t uid, int size) {
 	struct uid_stat *entry;
-	if ((entry = find_uid_stat(uid)) == NULL &&
-		((entry = create_stat(uid)) == NULL)) {
-			return -1;
-	}
+	if ((entry = get_uid_stat(uid, GFP_KERNEL)) == NULL)
+		return -1;
 	atomic_add(size, &entry->tcp_rcv);
 	return 0;
 }
 
+/*
+ * Block I/O is charged to the submitter at submit_bio() time, so
+ * writeback of dirty pages lands on the flusher thread's uid.
+ */
+void uid_stat_blk_io(int rw, unsigned int bytes)
+{
+	unsigned long flags;
+	struct uid_stat *entry;
+
+	if ((entry = get_uid_stat(current_uid(), GFP_ATOMIC)) == NULL)
+		return;
+
+	spin_lock_irqsave(&entry->lock, flags);
+	if (rw & WRITE) {
+		entry->io_write_bytes += bytes;
+		entry->io_write_ops++;
+	} else {
+		entry->io_read_bytes += bytes;
+		entry->io_read_ops++;
+	}
+	spin_unlock_irqrestore(&entry->lock, flags);
+}
+
+/* Called from the tick with the time just charged to @p. */
+void uid_stat_cpu_time(struct task_struct *p, unsigned long usecs, int user)
+{
+	unsigned long flags;
+	struct uid_stat *entry;
+	uid_t uid;
+
+	rcu_read_lock();
+	uid = task_uid(p);
+	rcu_read_unlock();
+
+	if ((entry = get_uid_stat(uid, GFP_ATOMIC)) == NULL)
+		return;
+
+	spin_lock_irqsave(&entry->lock, flags);
+	if (user)
+		entry->cpu_user_us += usecs;
+	else
+		entry->cpu_sys_us += usecs;
+	spin_unlock_irqrestore(&entry->lock, flags);
+}
+
+/*
+ * Called from try_to_wake_up() with the runqueue locked, so this must
+ * not allocate or kick the proc work; uids nobody has charged yet are
+ * not counted.
+ */
+void uid_stat_wakeup(struct task_struct *p)
+{
+	unsigned long flags;
+	struct uid_stat *entry;
+	uid_t uid;
+
+	rcu_read_lock();
+	uid = task_uid(p);
+	rcu_read_unlock();
+
+	if ((entry = find_uid_stat(uid)) == NULL)
+		return;
+
+	spin_lock_irqsave(&entry->lock, flags);
+	entry->wakeups++;
+	spin_unlock_irqrestore(&entry->lock, flags);
+}
+
+static void uid_stat_fill_record(struct uid_stat *entry,
+				 struct uid_stat_record *rec)
+{
+	unsigned long flags;
+
+	rec->uid = entry->uid;
+	rec->tcp_snd = (u32) (atomic_read(&entry->tcp_snd) + INT_MIN);
+	rec->tcp_rcv = (u32) (atomic_read(&entry->tcp_rcv) + INT_MIN);
+	rec->pad = 0;
+
+	spin_lock_irqsave(&entry->lock, flags);
+	rec->io_read_bytes = entry->io_read_bytes;
+	rec->io_write_bytes = entry->io_write_bytes;
+	rec->io_read_ops = entry->io_read_ops;
+	rec->io_write_ops = entry->io_write_ops;
+	rec->cpu_user_us = entry->cpu_user_us;
+	rec->cpu_sys_us = entry->cpu_sys_us;
+	rec->wakeups = entry->wakeups;
+	spin_unlock_irqrestore(&entry->lock, flags);
+}
+
+/*
+ * /proc/uid_stat/stats: every uid as an array of struct uid_stat_record,
+ * so a collector gets all of them in a read or two instead of opening
+ * a file per uid and counter.
+ */
+static ssize_t uid_stat_records_read(struct file *file, char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct uid_stat_record *recs;
+	struct uid_stat *entry;
+	size_t max, n = 0;
+	u64 skip = *ppos;
+	ssize_t ret;
+
+	if (*ppos < 0 || do_div(skip, sizeof(*recs)) ||
+	    count < sizeof(*recs))
+		return -EINVAL;
+
+	max = min_t(size_t, count, PAGE_SIZE) / sizeof(*recs);
+	recs = kmalloc(max * sizeof(*recs), GFP_KERNEL);
+	if (!recs)
+		return -ENOMEM;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(entry, &uid_list, link) {
+		if (skip) {
+			skip--;
+			continue;
+		}
+		if (n == max)
+			break;
+		uid_stat_fill_record(entry, &recs[n++]);
+	}
+	rcu_read_unlock();
+
+	ret = n * sizeof(*recs);
+	if (ret && copy_to_user(buf, recs, ret))
+		ret = -EFAULT;
+	else
+		*ppos += ret;
+
+	kfree(recs);
+	return ret;
+}
+
+static const struct file_operations uid_stat_records_fops = {
+	.owner	= THIS_MODULE,
+	.read	= uid_stat_records_read,
+};
+
 static int __init uid_stat_init(void)
 {
+	int i;
+
+	for (i = 0; i < UID_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&uid_hash[i]);
+
 	parent = proc_mkdir("uid_stat", NULL);
 	if (!parent) {
 		pr_err("uid_stat: failed to create proc entry\n");
 		return -1;
 	}
+	proc_create("stats", S_IRUGO, parent, &uid_stat_records_fops);
 	return 0;
 }
 
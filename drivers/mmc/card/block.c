@@ -30,6 +30,7 @@
 #include <linux/mutex.h>
 #include <linux/scatterlist.h>
 #include <linux/string_helpers.h>
+#include <linux/delay.h>
 #include <linux/apanic.h>
 
 #include <linux/mmc/card.h>
@@ -149,13 +150,6 @@ static const struct block_device_operations mmc_bdops = {
 	.owner			= THIS_MODULE,
 };
 
-struct mmc_blk_request {
-	struct mmc_request	mrq;
-	struct mmc_command	cmd;
-	struct mmc_command	stop;
-	struct mmc_data		data;
-};
-
 static u32 mmc_sd_num_wr_blocks(struct mmc_card *card)
 {
 	int err;
@@ -272,6 +266,66 @@ mmc_blk_set_blksize(struct mmc_blk_data *md, struct mmc_card *card)
 	return 0;
 }
 
+/*
+ * Bounds of the delay between two CMD13 polls while the card is busy.
+ * The delay doubles on each poll, so short busy periods are caught
+ * quickly and long ones (erases, garbage collection) cost few commands.
+ */
+#define MMC_BLK_BUSY_POLL_MIN_US	32
+#define MMC_BLK_BUSY_POLL_MAX_US	2048
+
+/*
+ * Poll the card with CMD13 until it has left the programming state.
+ */
+static int mmc_blk_wait_for_prog(struct mmc_card *card, struct request *req)
+{
+	struct mmc_command cmd;
+	ktime_t start = mmc_latency_start();
+	unsigned long delay = MMC_BLK_BUSY_POLL_MIN_US;
+	int err;
+
+	for (;;) {
+		cmd.opcode = MMC_SEND_STATUS;
+		cmd.arg = card->rca << 16;
+		cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
+		err = mmc_wait_for_cmd(card->host, &cmd, 5);
+		if (err) {
+			printk(KERN_ERR "%s: error %d requesting status\n",
+			       req->rq_disk->disk_name, err);
+			return err;
+		}
+		/*
+		 * Some cards mishandle the status bits,
+		 * so make sure to check both the busy
+		 * indication and the card state.
+		 */
+		if ((cmd.resp[0] & R1_READY_FOR_DATA) &&
+		    R1_CURRENT_STATE(cmd.resp[0]) != 7)
+			break;
+
+		usleep_range(delay, delay * 2);
+		delay = min_t(unsigned long, delay * 2,
+			      MMC_BLK_BUSY_POLL_MAX_US);
+	}
+
+	mmc_latency_add(card->host, MMC_LAT_BUSY, start);
+
+	return 0;
+}
+
+/*
+ * Whether the card is known to be done programming once @brq has
+ * completed: a host that waits for the end of busy on R1B commands
+ * has already done so for the stop command.
+ */
+static bool mmc_blk_busy_waited(struct mmc_card *card,
+				struct mmc_blk_request *brq)
+{
+	return (card->host->caps & MMC_CAP_WAIT_WHILE_BUSY) &&
+		brq->mrq.stop && !brq->cmd.error && !brq->data.error &&
+		!brq->stop.error;
+}
+
 /*
  * Workaround for Toshiba eMMC performance.  If the request is less than two
  * flash pages in size, then we want to split the write into one or two
@@ -424,12 +478,146 @@ static bool mmc_handle_toshiba_write(struct mmc_queue *mq,
 	return true;
 }
 
+/*
+ * Called by mmc_start_req() once the request has completed. Anything
+ * short of a complete transfer is an error here: the request is then
+ * redone by mmc_blk_issue_sync_rq(), which sorts out the details.
+ */
+static int mmc_blk_err_check(struct mmc_card *card,
+			     struct mmc_async_req *areq)
+{
+	struct mmc_queue_req *mqrq = container_of(areq, struct mmc_queue_req,
+						  mmc_active);
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	int err;
+
+	/*
+	 * We need to wait for the card to leave programming mode
+	 * even when things go wrong.
+	 */
+	if (!mmc_host_is_spi(card->host) && rq_data_dir(req) != READ &&
+	    !mmc_blk_busy_waited(card, brq)) {
+		err = mmc_blk_wait_for_prog(card, req);
+		if (err)
+			return err;
+	}
+
+	if (brq->cmd.error || brq->data.error || brq->stop.error)
+		return -EIO;
+
+	if (brq->data.bytes_xfered != blk_rq_bytes(req))
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Set up the MMC request for (the start of) the block request in
+ * @mqrq. The data is bounced for writes, so the request can be issued
+ * as is.
+ */
+static void mmc_blk_rw_rq_prep(struct mmc_queue_req *mqrq,
+			       struct mmc_card *card, int disable_multi,
+			       struct mmc_queue *mq)
+{
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	u32 readcmd, writecmd;
+
+	memset(brq, 0, sizeof(struct mmc_blk_request));
+	brq->mrq.cmd = &brq->cmd;
+	brq->mrq.data = &brq->data;
+
+	brq->cmd.arg = blk_rq_pos(req);
+	if (!mmc_card_blockaddr(card))
+		brq->cmd.arg <<= 9;
+	brq->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	brq->data.blksz = 512;
+	brq->stop.opcode = MMC_STOP_TRANSMISSION;
+	brq->stop.arg = 0;
+	brq->stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	brq->data.blocks = blk_rq_sectors(req);
+
+	/*
+	 * The block layer doesn't support all sector count
+	 * restrictions, so we need to be prepared for too big
+	 * requests.
+	 */
+	if (brq->data.blocks > card->host->max_blk_count)
+		brq->data.blocks = card->host->max_blk_count;
+
+	/*
+	 * After a read error, we redo the request one sector at a time
+	 * in order to accurately determine which sectors can be read
+	 * successfully.
+	 */
+	if (disable_multi && brq->data.blocks > 1)
+		brq->data.blocks = 1;
+
+	if (brq->data.blocks > 1) {
+		/* SPI multiblock writes terminate using a special
+		 * token, not a STOP_TRANSMISSION request.
+		 */
+		if (!mmc_host_is_spi(card->host)
+				|| rq_data_dir(req) == READ)
+			brq->mrq.stop = &brq->stop;
+		readcmd = MMC_READ_MULTIPLE_BLOCK;
+		writecmd = MMC_WRITE_MULTIPLE_BLOCK;
+	} else {
+		brq->mrq.stop = NULL;
+		readcmd = MMC_READ_SINGLE_BLOCK;
+		writecmd = MMC_WRITE_BLOCK;
+	}
+
+	if (rq_data_dir(req) == READ) {
+		brq->cmd.opcode = readcmd;
+		brq->data.flags |= MMC_DATA_READ;
+	} else {
+		brq->cmd.opcode = writecmd;
+		brq->data.flags |= MMC_DATA_WRITE;
+	}
+
+	if (rq_data_dir(req) == WRITE)
+		mmc_adjust_toshiba_write(card, &brq->mrq);
+
+	mmc_set_data_timeout(&brq->data, card);
+
+	brq->data.sg = mqrq->sg;
+	brq->data.sg_len = mmc_queue_map_sg(mq, mqrq);
+
+	/*
+	 * Adjust the sg list so it is the same size as the
+	 * request.
+	 */
+	if (brq->data.blocks != blk_rq_sectors(req)) {
+		int i, data_size = brq->data.blocks << 9;
+		struct scatterlist *sg;
+
+		for_each_sg(brq->data.sg, sg, brq->data.sg_len, i) {
+			data_size -= sg->length;
+			if (data_size <= 0) {
+				sg->length += data_size;
+				i++;
+				break;
+			}
+		}
+		brq->data.sg_len = i;
+	}
+
+	mqrq->mmc_active.mrq = &brq->mrq;
+	mqrq->mmc_active.err_check = mmc_blk_err_check;
+
+	mmc_queue_bounce_pre(mqrq);
+}
+
 static int mmc_blk_xfer_rq(struct mmc_blk_data *md,
-	struct request *req, unsigned int *bytes_xfered)
+	struct mmc_queue_req *mqrq, unsigned int *bytes_xfered)
 {
 	struct mmc_queue *mq = &md->queue;
 	struct mmc_card *card = mq->card;
-	struct mmc_blk_request brq;
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
 	int ret = 1;
 	int disable_multi = 0;
 	int retry = 0;
@@ -444,109 +632,31 @@ static int mmc_blk_xfer_rq(struct mmc_blk_data *md,
 	BUG_ON(!bytes_xfered);
 
 	do {
-		struct mmc_command cmd;
-		u32 readcmd, writecmd, status = 0;
+		u32 status = 0;
+		bool busy_waited = false;
 
-		memset(&brq, 0, sizeof(struct mmc_blk_request));
-		brq.mrq.cmd = &brq.cmd;
-		brq.mrq.data = &brq.data;
-
-		brq.cmd.arg = blk_rq_pos(req);
-		if (!mmc_card_blockaddr(card))
-			brq.cmd.arg <<= 9;
-		brq.cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-		brq.data.blksz = 512;
-		brq.stop.opcode = MMC_STOP_TRANSMISSION;
-		brq.stop.arg = 0;
-		brq.stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-		brq.data.blocks = blk_rq_sectors(req);
-
-		/*
-		 * The block layer doesn't support all sector count
-		 * restrictions, so we need to be prepared for too big
-		 * requests.
-		 */
-		if (brq.data.blocks > card->host->max_blk_count)
-			brq.data.blocks = card->host->max_blk_count;
-
-		/*
-		 * After a read error, we redo the request one sector at a time
-		 * in order to accurately determine which sectors can be read
-		 * successfully.
-		 */
-		if (disable_multi && brq.data.blocks > 1)
-			brq.data.blocks = 1;
-
-		if (brq.data.blocks > 1) {
-			/* SPI multiblock writes terminate using a special
-			 * token, not a STOP_TRANSMISSION request.
-			 */
-			if (!mmc_host_is_spi(card->host)
-					|| rq_data_dir(req) == READ)
-				brq.mrq.stop = &brq.stop;
-			readcmd = MMC_READ_MULTIPLE_BLOCK;
-			writecmd = MMC_WRITE_MULTIPLE_BLOCK;
-		} else {
-			brq.mrq.stop = NULL;
-			readcmd = MMC_READ_SINGLE_BLOCK;
-			writecmd = MMC_WRITE_BLOCK;
-		}
-
-		if (rq_data_dir(req) == READ) {
-			brq.cmd.opcode = readcmd;
-			brq.data.flags |= MMC_DATA_READ;
-		} else {
-			brq.cmd.opcode = writecmd;
-			brq.data.flags |= MMC_DATA_WRITE;
-		}
-
-		if (rq_data_dir(req) == WRITE)
-			mmc_adjust_toshiba_write(card, &brq.mrq);
-
-		mmc_set_data_timeout(&brq.data, card);
-
-		brq.data.sg = mq->sg;
-		brq.data.sg_len = mmc_queue_map_sg(mq);
-
-		/*
-		 * Adjust the sg list so it is the same size as the
-		 * request.
-		 */
-		if (brq.data.blocks != blk_rq_sectors(req)) {
-			int i, data_size = brq.data.blocks << 9;
-			struct scatterlist *sg;
-
-			for_each_sg(brq.data.sg, sg, brq.data.sg_len, i) {
-				data_size -= sg->length;
-				if (data_size <= 0) {
-					sg->length += data_size;
-					i++;
-					break;
-				}
-			}
-			brq.data.sg_len = i;
-		}
-
-		mmc_queue_bounce_pre(mq);
+		mmc_blk_rw_rq_prep(mqrq, card, disable_multi, mq);
 
 		/*
 		 * Try the workaround first for writes, then fall back.
 		 */
 		if (rq_data_dir(req) != WRITE || disable_multi ||
-		    !mmc_handle_toshiba_write(mq, card, &brq.mrq))
-			mmc_wait_for_req(card->host, &brq.mrq);
+		    !mmc_handle_toshiba_write(mq, card, &brq->mrq)) {
+			mmc_wait_for_req(card->host, &brq->mrq);
+			busy_waited = mmc_blk_busy_waited(card, brq);
+		}
 
-		mmc_queue_bounce_post(mq);
+		mmc_queue_bounce_post(mqrq);
 
 		ret = 0;
-		*bytes_xfered = brq.data.bytes_xfered;
+		*bytes_xfered = brq->data.bytes_xfered;
 		/*
 		 * Check for errors here, but don't jump to cmd_err
 		 * until later as we need to wait for the card to leave
 		 * programming mode even when things go wrong.
 		 */
-		if (brq.cmd.error || brq.data.error || brq.stop.error) {
-			if (brq.data.blocks > 1 && rq_data_dir(req) == READ) {
+		if (brq->cmd.error || brq->data.error || brq->stop.error) {
+			if (brq->data.blocks > 1 && rq_data_dir(req) == READ) {
 				/* Redo read one sector at a time */
 				printk(KERN_WARNING "%s: retrying using single "
 				       "block read\n", req->rq_disk->disk_name);
@@ -562,58 +672,44 @@ static int mmc_blk_xfer_rq(struct mmc_blk_data *md,
 		}
 		retry = 0;
 
-		if (brq.cmd.error) {
-			ret = brq.cmd.error;
+		if (brq->cmd.error) {
+			ret = brq->cmd.error;
 			printk(KERN_ERR "%s: error %d sending read/write "
 			       "command, response %#x, card status %#x\n",
-			       req->rq_disk->disk_name, brq.cmd.error,
-			       brq.cmd.resp[0], status);
+			       req->rq_disk->disk_name, brq->cmd.error,
+			       brq->cmd.resp[0], status);
 		}
 
-		if (brq.data.error) {
-			ret = brq.data.error;
-			if (brq.data.error == -ETIMEDOUT && brq.mrq.stop)
+		if (brq->data.error) {
+			ret = brq->data.error;
+			if (brq->data.error == -ETIMEDOUT && brq->mrq.stop)
 				/* 'Stop' response contains card status */
-				status = brq.mrq.stop->resp[0];
+				status = brq->mrq.stop->resp[0];
 			printk(KERN_ERR "%s: error %d transferring data,"
 			       " sector %u, nr %u, card status %#x\n",
-			       req->rq_disk->disk_name, brq.data.error,
+			       req->rq_disk->disk_name, brq->data.error,
 			       (unsigned)blk_rq_pos(req),
 			       (unsigned)blk_rq_sectors(req), status);
 		}
 
-		if (brq.stop.error) {
-			ret = brq.stop.error;
+		if (brq->stop.error) {
+			ret = brq->stop.error;
 			printk(KERN_ERR "%s: error %d sending stop command, "
 			       "response %#x, card status %#x\n",
-			       req->rq_disk->disk_name, brq.stop.error,
-			       brq.stop.resp[0], status);
+			       req->rq_disk->disk_name, brq->stop.error,
+			       brq->stop.resp[0], status);
 		}
 
 		/*
 		* We need to wait for the card to leave programming mode
 		* even when things go wrong.
 		*/
-		if (!mmc_host_is_spi(card->host) && rq_data_dir(req) != READ) {
-			do {
-				int err;
-				cmd.opcode = MMC_SEND_STATUS;
-				cmd.arg = card->rca << 16;
-				cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
-				err = mmc_wait_for_cmd(card->host, &cmd, 5);
-				if (err) {
-					printk(KERN_ERR "%s: error %d requesting status\n",
-					       req->rq_disk->disk_name, err);
-					ret = err;
-					break;
-				}
-				/*
-				 * Some cards mishandle the status bits,
-				 * so make sure to check both the busy
-				 * indication and the card state.
-				 */
-			} while (!(cmd.resp[0] & R1_READY_FOR_DATA) ||
-				(R1_CURRENT_STATE(cmd.resp[0]) == 7));
+		if (!mmc_host_is_spi(card->host) && rq_data_dir(req) != READ &&
+		    !busy_waited) {
+			int err = mmc_blk_wait_for_prog(card, req);
+
+			if (err)
+				ret = err;
 		}
 
 		/*
@@ -736,23 +832,9 @@ static int mmc_blk_erase_rq(struct mmc_blk_data *md,
 	 * Wait for the card to finish the erase request...
 	 */
 	if (!mmc_host_is_spi(card->host)) {
-		do {
-			cmd.opcode = MMC_SEND_STATUS;
-			cmd.arg = card->rca << 16;
-			cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
-			ret = mmc_wait_for_cmd(card->host, &cmd, 5);
-			if (ret) {
-				printk(KERN_ERR "%s: error %d requesting status\n",
-				       req->rq_disk->disk_name, ret);
-				return ret;
-			}
-			/*
-			 * Some cards mishandle the status bits,
-			 * so make sure to check both the busy
-			 * indication and the card state.
-			 */
-		} while (!(cmd.resp[0] & R1_READY_FOR_DATA) ||
-			(R1_CURRENT_STATE(cmd.resp[0]) == 7));
+		ret = mmc_blk_wait_for_prog(card, req);
+		if (ret)
+			return ret;
 	}
 
 out:
@@ -761,19 +843,22 @@ out:
 	return 0;
 }
 
-static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
+/*
+ * Run the block request in @mqrq to completion, retrying and
+ * reporting errors as needed. The host must be claimed and idle.
+ */
+static int mmc_blk_issue_sync_rq(struct mmc_queue *mq,
+				 struct mmc_queue_req *mqrq)
 {
 	struct mmc_blk_data *md = mq->data;
-	struct mmc_card *card = md->queue.card;
+	struct request *req = mqrq->req;
 	int ret, err, bytes_xfered;
 
-	mmc_claim_host(card->host);
-
 	do {
 		if (blk_discard_rq(req))
 			err = mmc_blk_erase_rq(md, req, &bytes_xfered);
 		else
-			err = mmc_blk_xfer_rq(md, req, &bytes_xfered);
+			err = mmc_blk_xfer_rq(md, mqrq, &bytes_xfered);
 
 		/*
 		 * First handle the sectors that got transferred
@@ -787,8 +872,6 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 		 * ...then check if things went south.
 		 */
 		if (err) {
-			mmc_release_host(card->host);
-
 			/*
 			 * Kill of the rest of the request...
 			 */
@@ -802,11 +885,253 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 		}
 	} while (ret);
 
-	mmc_release_host(card->host);
-
 	return 1;
 }
 
+/*
+ * Whether @req can be issued in one go behind the request in flight.
+ * Anything that may need splitting up or extra commands around the
+ * transfer goes through mmc_blk_issue_sync_rq() instead.
+ */
+static bool mmc_blk_rq_async_ok(struct mmc_queue *mq, struct request *req)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = mq->card;
+
+	if (blk_discard_rq(req))
+		return false;
+
+	if (blk_rq_sectors(req) > card->host->max_blk_count)
+		return false;
+
+	/* mmc_adjust_toshiba_write() and mmc_handle_toshiba_write() */
+	if (rq_data_dir(req) == WRITE && md->bounce &&
+	    blk_rq_sectors(req) <= TOSHIBA_HIGH_THRESHOLD)
+		return false;
+
+#ifdef CONFIG_MMC_BLOCK_DEFERRED_RESUME
+	if (mmc_bus_needs_resume(card->host))
+		return false;
+#endif
+
+	return true;
+}
+
+/*
+ * Start @rqc (if any) and complete the request in flight. The
+ * previous request is checked and cleaned up while @rqc is already
+ * being transferred.
+ */
+static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	struct mmc_queue_req *mq_rq;
+	struct mmc_async_req *areq;
+	int ret = 1, err;
+
+	if (rqc) {
+		mmc_blk_rw_rq_prep(mq->mqrq_cur, card, 0, mq);
+		areq = &mq->mqrq_cur->mmc_active;
+	} else
+		areq = NULL;
+
+	areq = mmc_start_req(card->host, areq, &err);
+	if (!areq)
+		return 1;
+
+	mq_rq = container_of(areq, struct mmc_queue_req, mmc_active);
+
+	if (!err) {
+		mmc_queue_bounce_post(mq_rq);
+
+		spin_lock_irq(&md->lock);
+		ret = __blk_end_request(mq_rq->req, 0,
+					mq_rq->brq.data.bytes_xfered);
+		spin_unlock_irq(&md->lock);
+		return !ret;
+	}
+
+	/*
+	 * The previous request failed and @rqc has not been started.
+	 * Redo the former the slow way, then get the latter going.
+	 */
+	ret = mmc_blk_issue_sync_rq(mq, mq_rq);
+
+	if (rqc)
+		mmc_start_req(card->host, &mq->mqrq_cur->mmc_active, NULL);
+
+	return ret;
+}
+
+/*
+ * Write out the requests packed by mmc_queue_pack() as one eMMC 4.5
+ * packed command: CMD23 with the packed flag, then a single CMD25 whose
+ * first block is the header describing each request. If anything goes
+ * wrong, the requests are redone one by one.
+ */
+static int mmc_blk_issue_packed_rq(struct mmc_queue *mq,
+				   struct mmc_queue_req *mqrq)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req, *first = mqrq->req;
+	struct mmc_command cmd;
+	u32 *hdr = mqrq->packed_cmd_hdr;
+	int i = 1, err, ret = 1;
+
+#ifdef CONFIG_MMC_BLOCK_DEFERRED_RESUME
+	if (mmc_bus_needs_resume(card->host)) {
+		mmc_resume_bus(card->host);
+		mmc_blk_set_blksize(md, card);
+	}
+#endif
+
+	memset(hdr, 0, MMC_PACKED_HDR_WORDS * sizeof(u32));
+	hdr[0] = cpu_to_le32((mqrq->packed_num << 16) |
+			     (MMC_PACKED_CMD_WR << 8) | MMC_PACKED_CMD_VER);
+	list_for_each_entry(req, &mqrq->packed_list, queuelist) {
+		u32 addr = blk_rq_pos(req);
+
+		if (!mmc_card_blockaddr(card))
+			addr <<= 9;
+		hdr[i * 2] = cpu_to_le32(blk_rq_sectors(req));
+		hdr[i * 2 + 1] = cpu_to_le32(addr);
+		i++;
+	}
+
+	cmd.opcode = MMC_SET_BLOCK_COUNT;
+	cmd.arg = mqrq->packed_blocks | MMC_CMD23_ARG_PACKED;
+	cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
+	err = mmc_wait_for_cmd(card->host, &cmd, 0);
+	if (!err) {
+		memset(brq, 0, sizeof(struct mmc_blk_request));
+		brq->mrq.cmd = &brq->cmd;
+		brq->mrq.data = &brq->data;
+
+		brq->cmd.opcode = MMC_WRITE_MULTIPLE_BLOCK;
+		brq->cmd.arg = blk_rq_pos(first);
+		if (!mmc_card_blockaddr(card))
+			brq->cmd.arg <<= 9;
+		brq->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+
+		brq->data.blksz = 512;
+		brq->data.blocks = mqrq->packed_blocks;
+		brq->data.flags |= MMC_DATA_WRITE;
+		brq->data.sg = mqrq->sg;
+		brq->data.sg_len = mmc_queue_map_packed_sg(mq, mqrq);
+		mmc_set_data_timeout(&brq->data, card);
+
+		mmc_wait_for_req(card->host, &brq->mrq);
+
+		err = mmc_blk_wait_for_prog(card, first);
+		if (!err && (brq->cmd.error || brq->data.error ||
+			     brq->data.bytes_xfered !=
+			     mqrq->packed_blocks << 9))
+			err = -EIO;
+	}
+
+	if (!err) {
+		spin_lock_irq(&md->lock);
+		while (!list_empty(&mqrq->packed_list)) {
+			req = list_entry(mqrq->packed_list.next,
+					 struct request, queuelist);
+			list_del_init(&req->queuelist);
+			__blk_end_request_all(req, 0);
+		}
+		spin_unlock_irq(&md->lock);
+
+		return 1;
+	}
+
+	printk(KERN_WARNING "%s: packed write of %u requests failed (%d), "
+	       "retrying them one by one\n", first->rq_disk->disk_name,
+	       mqrq->packed_num, err);
+	mq->packed_stats.fallbacks++;
+
+	while (!list_empty(&mqrq->packed_list)) {
+		req = list_entry(mqrq->packed_list.next, struct request,
+				 queuelist);
+		list_del_init(&req->queuelist);
+
+		mqrq->req = req;
+		if (!mmc_blk_issue_sync_rq(mq, mqrq))
+			ret = 0;
+	}
+	mqrq->packed_num = 0;
+
+	return ret;
+}
+
+static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	int ret;
+
+	/* The host stays claimed for as long as requests keep coming */
+	if (req && !mq->mqrq_prev->req)
+		mmc_claim_host(card->host);
+
+	if (req && mq->mqrq_cur->packed_num) {
+		if (card->host->areq)
+			mmc_blk_issue_rw_rq(mq, NULL);
+		ret = mmc_blk_issue_packed_rq(mq, mq->mqrq_cur);
+	} else if (req && !mmc_blk_rq_async_ok(mq, req)) {
+		if (card->host->areq)
+			mmc_blk_issue_rw_rq(mq, NULL);
+		ret = mmc_blk_issue_sync_rq(mq, mq->mqrq_cur);
+	} else
+		ret = mmc_blk_issue_rw_rq(mq, req);
+
+	if (!req)
+		mmc_release_host(card->host);
+
+	return ret;
+}
+
+static ssize_t mmc_blk_packed_stats_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct mmc_blk_data *md = dev_to_disk(dev)->private_data;
+	struct mmc_packed_stats *stats = &md->queue.packed_stats;
+	static const char *stop_names[MMC_PACKED_STOP_NR] = {
+		"empty", "read", "flags", "blocks", "segs", "entries",
+	};
+	ssize_t len;
+	int i;
+
+	len = sprintf(buf, "max_entries: %u\npacks: %lu\nfallbacks: %lu\n",
+		      md->queue.max_packed, stats->packs, stats->fallbacks);
+
+	len += sprintf(buf + len, "entries:");
+	for (i = 2; i <= MMC_PACKED_MAX_ENTRIES; i++)
+		if (stats->entries[i])
+			len += sprintf(buf + len, " %d:%lu", i,
+				       stats->entries[i]);
+
+	len += sprintf(buf + len, "\nstop:");
+	for (i = 0; i < MMC_PACKED_STOP_NR; i++)
+		len += sprintf(buf + len, " %s:%lu", stop_names[i],
+			       stats->stop[i]);
+	len += sprintf(buf + len, "\n");
+
+	return len;
+}
+
+static ssize_t mmc_blk_packed_stats_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct mmc_blk_data *md = dev_to_disk(dev)->private_data;
+
+	memset(&md->queue.packed_stats, 0, sizeof(md->queue.packed_stats));
+
+	return count;
+}
+
+static DEVICE_ATTR(packed_stats, S_IRUGO | S_IWUSR,
+		   mmc_blk_packed_stats_show, mmc_blk_packed_stats_store);
 
 static inline int mmc_blk_readonly(struct mmc_card *card)
 {
@@ -881,6 +1206,10 @@ static struct mmc_blk_data *mmc_blk_alloc(struct mmc_card *card)
 	md->queue.issue_fn = mmc_blk_issue_rq;
 	md->queue.data = md;
 
+	/* The Toshiba workaround reorders small writes, don't pack them */
+	if (md->bounce)
+		md->queue.max_packed = 0;
+
 	md->disk->major	= MMC_BLOCK_MAJOR;
 	md->disk->first_minor = devidx << MMC_SHIFT;
 	md->disk->fops = &mmc_bdops;
@@ -1002,6 +1331,10 @@ static int mmc_blk_probe(struct mmc_card *card)
 	mmc_set_bus_resume_policy(card->host, 1);
 #endif
 	add_disk(md->disk);
+
+	if (device_create_file(disk_to_dev(md->disk), &dev_attr_packed_stats))
+		printk(KERN_WARNING "%s: unable to create packed_stats\n",
+		       md->disk->disk_name);
 	return 0;
 
  out:
@@ -1016,6 +1349,9 @@ static void mmc_blk_remove(struct mmc_card *card)
 	struct mmc_blk_data *md = mmc_get_drvdata(card);
 
 	if (md) {
+		device_remove_file(disk_to_dev(md->disk),
+				   &dev_attr_packed_stats);
+
 		/* Stop new requests from getting into the queue */
 		del_gendisk(md->disk);
 
@@ -42,6 +42,83 @@ static int mmc_prep_request(struct request_queue *q, struct request *req)
 	return BLKPREP_OK;
 }
 
+static bool mmc_queue_packable(struct request *req)
+{
+	return rq_data_dir(req) == WRITE && !blk_discard_rq(req) &&
+		!blk_barrier_rq(req) && !blk_fua_rq(req);
+}
+
+/*
+ * Pull further writes off the queue to go out together with @req as
+ * one packed command. Must be called with the queue lock held.
+ */
+static void mmc_queue_pack(struct mmc_queue *mq, struct request *req)
+{
+	struct mmc_queue_req *mqrq = mq->mqrq_cur;
+	struct mmc_host *host = mq->card->host;
+	struct mmc_packed_stats *stats = &mq->packed_stats;
+	struct request *next;
+	unsigned int max_blocks, max_segs, blocks, segs, n = 1;
+	enum mmc_packed_stop stop;
+
+	if (!mq->max_packed || !mmc_queue_packable(req))
+		return;
+
+	max_blocks = min(host->max_blk_count, host->max_req_size >> 9);
+	max_segs = min(host->max_hw_segs, host->max_phys_segs);
+
+	/* The header takes up one block and one segment */
+	blocks = blk_rq_sectors(req) + 1;
+	segs = req->nr_phys_segments + 1;
+	if (blocks > max_blocks || segs > max_segs)
+		return;
+
+	do {
+		if (n == mq->max_packed) {
+			stop = MMC_PACKED_STOP_ENTRIES;
+			break;
+		}
+		next = blk_peek_request(mq->queue);
+		if (!next) {
+			stop = MMC_PACKED_STOP_EMPTY;
+			break;
+		}
+		if (rq_data_dir(next) != WRITE) {
+			stop = MMC_PACKED_STOP_DIR;
+			break;
+		}
+		if (!mmc_queue_packable(next)) {
+			stop = MMC_PACKED_STOP_FLAGS;
+			break;
+		}
+		if (blocks + blk_rq_sectors(next) > max_blocks) {
+			stop = MMC_PACKED_STOP_BLOCKS;
+			break;
+		}
+		if (segs + next->nr_phys_segments > max_segs) {
+			stop = MMC_PACKED_STOP_SEGS;
+			break;
+		}
+
+		blk_start_request(next);
+		list_add_tail(&next->queuelist, &mqrq->packed_list);
+		blocks += blk_rq_sectors(next);
+		segs += next->nr_phys_segments;
+		n++;
+	} while (1);
+
+	stats->stop[stop]++;
+	if (n == 1)
+		return;
+
+	list_add(&req->queuelist, &mqrq->packed_list);
+	mqrq->packed_num = n;
+	mqrq->packed_blocks = blocks;
+
+	stats->packs++;
+	stats->entries[n]++;
+}
+
 static int mmc_queue_thread(void *d)
 {
 	struct mmc_queue *mq = d;
@@ -52,15 +129,18 @@ static int mmc_queue_thread(void *d)
 	down(&mq->thread_sem);
 	do {
 		struct request *req = NULL;
+		struct mmc_queue_req *tmp;
 
 		spin_lock_irq(q->queue_lock);
 		set_current_state(TASK_INTERRUPTIBLE);
 		if (!blk_queue_plugged(q))
 			req = blk_fetch_request(q);
-		mq->req = req;
+		mq->mqrq_cur->req = req;
+		if (req)
+			mmc_queue_pack(mq, req);
 		spin_unlock_irq(q->queue_lock);
 
-		if (!req) {
+		if (!req && !mq->mqrq_prev->req) {
 			if (kthread_should_stop()) {
 				set_current_state(TASK_RUNNING);
 				break;
@@ -72,7 +152,19 @@ static int mmc_queue_thread(void *d)
 		}
 		set_current_state(TASK_RUNNING);
 
+		/*
+		 * Issue the new request (if any) and complete the one
+		 * in flight; with no new request this just waits for
+		 * the previous one.
+		 */
 		mq->issue_fn(mq, req);
+
+		mq->mqrq_prev->brq.mrq.data = NULL;
+		mq->mqrq_prev->req = NULL;
+		mq->mqrq_prev->packed_num = 0;
+		tmp = mq->mqrq_prev;
+		mq->mqrq_prev = mq->mqrq_cur;
+		mq->mqrq_cur = tmp;
 	} while (1);
 	up(&mq->thread_sem);
 
@@ -98,10 +190,78 @@ static void mmc_request(struct request_queue *q)
 		return;
 	}
 
-	if (!mq->req)
+	if (!mq->mqrq_cur->req && !mq->mqrq_prev->req)
 		wake_up_process(mq->thread);
 }
 
+static struct scatterlist *mmc_alloc_sg(int sg_len, int *err)
+{
+	struct scatterlist *sg;
+
+	sg = kmalloc(sizeof(struct scatterlist) * sg_len, GFP_KERNEL);
+	if (!sg)
+		*err = -ENOMEM;
+	else {
+		*err = 0;
+		sg_init_table(sg, sg_len);
+	}
+
+	return sg;
+}
+
+static void mmc_free_queue_reqs(struct mmc_queue *mq)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+		struct mmc_queue_req *mqrq = &mq->mqrq[i];
+
+		kfree(mqrq->bounce_sg);
+		mqrq->bounce_sg = NULL;
+
+		kfree(mqrq->sg);
+		mqrq->sg = NULL;
+
+		kfree(mqrq->bounce_buf);
+		mqrq->bounce_buf = NULL;
+
+		kfree(mqrq->packed_cmd_hdr);
+		mqrq->packed_cmd_hdr = NULL;
+	}
+}
+
+/*
+ * Set up for eMMC 4.5 packed writes if the card can do them. Packing
+ * needs a real scatterlist, so it is not done with the bounce buffer.
+ */
+static void mmc_queue_init_packed(struct mmc_queue *mq)
+{
+	struct mmc_card *card = mq->card;
+	int i;
+
+	mq->max_packed = 0;
+
+	if (!mmc_card_mmc(card) || mmc_host_is_spi(card->host) ||
+	    card->ext_csd.max_packed_writes < 2 ||
+	    card->ext_csd.data_sector_size != EXT_CSD_DATA_SECTOR_SIZE_512 ||
+	    mq->mqrq_cur->bounce_buf)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+		mq->mqrq[i].packed_cmd_hdr =
+			kzalloc(MMC_PACKED_HDR_WORDS * sizeof(u32), GFP_KERNEL);
+		if (!mq->mqrq[i].packed_cmd_hdr) {
+			printk(KERN_WARNING "%s: unable to allocate packed "
+				"command header, packing disabled\n",
+				mmc_card_name(card));
+			return;
+		}
+	}
+
+	mq->max_packed = min_t(unsigned int, card->ext_csd.max_packed_writes,
+			       MMC_PACKED_MAX_ENTRIES);
+}
+
 /**
  * mmc_init_queue - initialise a queue structure.
  * @mq: mmc queue
@@ -115,6 +275,7 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 	struct mmc_host *host = card->host;
 	u64 limit = BLK_BOUNCE_HIGH;
 	int ret;
+	int i;
 
 	if (mmc_dev(host)->dma_mask && *mmc_dev(host)->dma_mask)
 		limit = *mmc_dev(host)->dma_mask;
@@ -125,7 +286,12 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 		return -ENOMEM;
 
 	mq->queue->queuedata = mq;
-	mq->req = NULL;
+	memset(&mq->mqrq, 0, sizeof(mq->mqrq));
+	mq->mqrq_cur = &mq->mqrq[0];
+	mq->mqrq_prev = &mq->mqrq[1];
+	for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++)
+		INIT_LIST_HEAD(&mq->mqrq[i].packed_list);
+	memset(&mq->packed_stats, 0, sizeof(mq->packed_stats));
 
 	blk_queue_prep_rq(mq->queue, mmc_prep_request);
 	blk_queue_ordered(mq->queue, QUEUE_ORDERED_DRAIN, NULL);
@@ -161,41 +327,42 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 			bouncesz = host->max_blk_count * 512;
 
 		if (bouncesz > 512) {
-			mq->bounce_buf = kmalloc(bouncesz, GFP_KERNEL);
-			if (!mq->bounce_buf) {
+			for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+				mq->mqrq[i].bounce_buf =
+					kmalloc(bouncesz, GFP_KERNEL);
+				if (!mq->mqrq[i].bounce_buf)
+					break;
+			}
+			if (i < ARRAY_SIZE(mq->mqrq)) {
 				printk(KERN_WARNING "%s: unable to "
 					"allocate bounce buffer\n",
 					mmc_card_name(card));
+				mmc_free_queue_reqs(mq);
 			}
 		}
 
-		if (mq->bounce_buf) {
+		if (mq->mqrq_cur->bounce_buf) {
 			blk_queue_bounce_limit(mq->queue, BLK_BOUNCE_ANY);
 			blk_queue_max_sectors(mq->queue, bouncesz / 512);
 			blk_queue_max_phys_segments(mq->queue, bouncesz / 512);
 			blk_queue_max_hw_segments(mq->queue, bouncesz / 512);
 			blk_queue_max_segment_size(mq->queue, bouncesz);
 
-			mq->sg = kmalloc(sizeof(struct scatterlist),
-				GFP_KERNEL);
-			if (!mq->sg) {
-				ret = -ENOMEM;
-				goto cleanup_queue;
-			}
-			sg_init_table(mq->sg, 1);
+			for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+				mq->mqrq[i].sg = mmc_alloc_sg(1, &ret);
+				if (ret)
+					goto cleanup_queue;
 
-			mq->bounce_sg = kmalloc(sizeof(struct scatterlist) *
-				bouncesz / 512, GFP_KERNEL);
-			if (!mq->bounce_sg) {
-				ret = -ENOMEM;
-				goto cleanup_queue;
+				mq->mqrq[i].bounce_sg =
+					mmc_alloc_sg(bouncesz / 512, &ret);
+				if (ret)
+					goto cleanup_queue;
 			}
-			sg_init_table(mq->bounce_sg, bouncesz / 512);
 		}
 	}
 #endif
 
-	if (!mq->bounce_buf) {
+	if (!mq->mqrq_cur->bounce_buf) {
 		blk_queue_bounce_limit(mq->queue, limit);
 		blk_queue_max_sectors(mq->queue,
 			min(host->max_blk_count, host->max_req_size / 512));
@@ -203,35 +370,27 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card, spinlock_t *lock
 		blk_queue_max_hw_segments(mq->queue, host->max_hw_segs);
 		blk_queue_max_segment_size(mq->queue, host->max_seg_size);
 
-		mq->sg = kmalloc(sizeof(struct scatterlist) *
-			host->max_phys_segs, GFP_KERNEL);
-		if (!mq->sg) {
-			ret = -ENOMEM;
-			goto cleanup_queue;
+		for (i = 0; i < ARRAY_SIZE(mq->mqrq); i++) {
+			mq->mqrq[i].sg = mmc_alloc_sg(host->max_phys_segs,
+						      &ret);
+			if (ret)
+				goto cleanup_queue;
 		}
-		sg_init_table(mq->sg, host->max_phys_segs);
 	}
 
+	mmc_queue_init_packed(mq);
+
 	init_MUTEX(&mq->thread_sem);
 
 	mq->thread = kthread_run(mmc_queue_thread, mq, "mmcqd");
 	if (IS_ERR(mq->thread)) {
 		ret = PTR_ERR(mq->thread);
-		goto free_bounce_sg;
+		goto cleanup_queue;
 	}
 
 	return 0;
- free_bounce_sg:
- 	if (mq->bounce_sg)
- 		kfree(mq->bounce_sg);
- 	mq->bounce_sg = NULL;
  cleanup_queue:
- 	if (mq->sg)
-		kfree(mq->sg);
-	mq->sg = NULL;
-	if (mq->bounce_buf)
-		kfree(mq->bounce_buf);
-	mq->bounce_buf = NULL;
+	mmc_free_queue_reqs(mq);
 	blk_cleanup_queue(mq->queue);
 	return ret;
 }
@@ -253,16 +412,7 @@ void mmc_cleanup_queue(struct mmc_queue *mq)
 	blk_start_queue(q);
 	spin_unlock_irqrestore(q->queue_lock, flags);
 
- 	if (mq->bounce_sg)
- 		kfree(mq->bounce_sg);
- 	mq->bounce_sg = NULL;
-
-	kfree(mq->sg);
-	mq->sg = NULL;
-
-	if (mq->bounce_buf)
-		kfree(mq->bounce_buf);
-	mq->bounce_buf = NULL;
+	mmc_free_queue_reqs(mq);
 
 	mq->card = NULL;
 }
@@ -315,27 +465,27 @@ void mmc_queue_resume(struct mmc_queue *mq)
 /*
  * Prepare the sg list(s) to be handed of to the host driver
  */
-unsigned int mmc_queue_map_sg(struct mmc_queue *mq)
+unsigned int mmc_queue_map_sg(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
 {
 	unsigned int sg_len;
 	size_t buflen;
 	struct scatterlist *sg;
 	int i;
 
-	if (!mq->bounce_buf)
-		return blk_rq_map_sg(mq->queue, mq->req, mq->sg);
+	if (!mqrq->bounce_buf)
+		return blk_rq_map_sg(mq->queue, mqrq->req, mqrq->sg);
 
-	BUG_ON(!mq->bounce_sg);
+	BUG_ON(!mqrq->bounce_sg);
 
-	sg_len = blk_rq_map_sg(mq->queue, mq->req, mq->bounce_sg);
+	sg_len = blk_rq_map_sg(mq->queue, mqrq->req, mqrq->bounce_sg);
 
-	mq->bounce_sg_len = sg_len;
+	mqrq->bounce_sg_len = sg_len;
 
 	buflen = 0;
-	for_each_sg(mq->bounce_sg, sg, sg_len, i)
+	for_each_sg(mqrq->bounce_sg, sg, sg_len, i)
 		buflen += sg->length;
 
-	sg_init_one(mq->sg, mq->bounce_buf, buflen);
+	sg_init_one(mqrq->sg, mqrq->bounce_buf, buflen);
 
 	return 1;
 }
@@ -344,19 +494,19 @@ unsigned int mmc_queue_map_sg(struct mmc_queue *mq)
  * If writing, bounce the data to the buffer before the request
  * is sent to the host driver
  */
-void mmc_queue_bounce_pre(struct mmc_queue *mq)
+void mmc_queue_bounce_pre(struct mmc_queue_req *mqrq)
 {
 	unsigned long flags;
 
-	if (!mq->bounce_buf)
+	if (!mqrq->bounce_buf)
 		return;
 
-	if (rq_data_dir(mq->req) != WRITE)
+	if (rq_data_dir(mqrq->req) != WRITE)
 		return;
 
 	local_irq_save(flags);
-	sg_copy_to_buffer(mq->bounce_sg, mq->bounce_sg_len,
-		mq->bounce_buf, mq->sg[0].length);
+	sg_copy_to_buffer(mqrq->bounce_sg, mqrq->bounce_sg_len,
+		mqrq->bounce_buf, mqrq->sg[0].length);
 	local_irq_restore(flags);
 }
 
@@ -364,19 +514,41 @@ void mmc_queue_bounce_pre(struct mmc_queue *mq)
  * If reading, bounce the data from the buffer after the request
  * has been handled by the host driver
  */
-void mmc_queue_bounce_post(struct mmc_queue *mq)
+void mmc_queue_bounce_post(struct mmc_queue_req *mqrq)
 {
 	unsigned long flags;
 
-	if (!mq->bounce_buf)
+	if (!mqrq->bounce_buf)
 		return;
 
-	if (rq_data_dir(mq->req) != READ)
+	if (rq_data_dir(mqrq->req) != READ)
 		return;
 
 	local_irq_save(flags);
-	sg_copy_from_buffer(mq->bounce_sg, mq->bounce_sg_len,
-		mq->bounce_buf, mq->sg[0].length);
+	sg_copy_from_buffer(mqrq->bounce_sg, mqrq->bounce_sg_len,
+		mqrq->bounce_buf, mqrq->sg[0].length);
 	local_irq_restore(flags);
 }
 
+/*
+ * Map a packed request: the header goes first, followed by the data of
+ * every packed request in order.
+ */
+unsigned int mmc_queue_map_packed_sg(struct mmc_queue *mq,
+				     struct mmc_queue_req *mqrq)
+{
+	struct scatterlist *sg = mqrq->sg;
+	struct request *req;
+	unsigned int sg_len = 1;
+
+	sg_set_buf(sg, mqrq->packed_cmd_hdr,
+		   MMC_PACKED_HDR_WORDS * sizeof(u32));
+
+	list_for_each_entry(req, &mqrq->packed_list, queuelist) {
+		sg_unmark_end(&sg[sg_len - 1]);
+		sg_len += blk_rq_map_sg(mq->queue, req, &sg[sg_len]);
+	}
+	sg_mark_end(&sg[sg_len - 1]);
+
+	return sg_len;
+}
@@ -1,22 +1,69 @@
 #ifndef MMC_QUEUE_H
 #define MMC_QUEUE_H
 
+#include <linux/mmc/mmc.h>
+
 struct request;
 struct task_struct;
 
+struct mmc_blk_request {
+	struct mmc_request	mrq;
+	struct mmc_command	cmd;
+	struct mmc_command	stop;
+	struct mmc_data		data;
+};
+
+/*
+ * One request slot. The queue thread keeps two of them so that the
+ * next request can be prepared while the previous one is on the bus.
+ */
+struct mmc_queue_req {
+	struct request		*req;
+	struct mmc_blk_request	brq;
+	struct scatterlist	*sg;
+	char			*bounce_buf;
+	struct scatterlist	*bounce_sg;
+	unsigned int		bounce_sg_len;
+	struct mmc_async_req	mmc_active;
+
+	/* Writes packed behind 'req' into one transfer, see mmc_queue_pack() */
+	struct list_head	packed_list;
+	unsigned int		packed_num;	/* entries, 0 if not packed */
+	unsigned int		packed_blocks;	/* including the header */
+	u32			*packed_cmd_hdr;
+};
+
+/* Why mmc_queue_pack() stopped adding requests to a pack */
+enum mmc_packed_stop {
+	MMC_PACKED_STOP_EMPTY,		/* no more requests queued */
+	MMC_PACKED_STOP_DIR,		/* next request is a read */
+	MMC_PACKED_STOP_FLAGS,		/* barrier, FUA or discard */
+	MMC_PACKED_STOP_BLOCKS,		/* transfer size limit */
+	MMC_PACKED_STOP_SEGS,		/* scatterlist size limit */
+	MMC_PACKED_STOP_ENTRIES,	/* card's packed entry limit */
+	MMC_PACKED_STOP_NR,
+};
+
+struct mmc_packed_stats {
+	unsigned long		packs;		/* packed transfers */
+	unsigned long		fallbacks;	/* packs redone one by one */
+	unsigned long		entries[MMC_PACKED_MAX_ENTRIES + 1];
+	unsigned long		stop[MMC_PACKED_STOP_NR];
+};
+
 struct mmc_queue {
 	struct mmc_card		*card;
 	struct task_struct	*thread;
 	struct semaphore	thread_sem;
 	unsigned int		flags;
-	struct request		*req;
 	int			(*issue_fn)(struct mmc_queue *, struct request *);
 	void			*data;
 	struct request_queue	*queue;
-	struct scatterlist	*sg;
-	char			*bounce_buf;
-	struct scatterlist	*bounce_sg;
-	unsigned int		bounce_sg_len;
+	struct mmc_queue_req	mqrq[2];
+	struct mmc_queue_req	*mqrq_cur;	/* being prepared */
+	struct mmc_queue_req	*mqrq_prev;	/* in flight */
+	unsigned int		max_packed;	/* 0 if packing is disabled */
+	struct mmc_packed_stats	packed_stats;
 };
 
 extern int mmc_init_queue(struct mmc_queue *, struct mmc_card *, spinlock_t *);
@@ -24,8 +71,11 @@ extern void mmc_cleanup_queue(struct mmc_queue *);
 extern void mmc_queue_suspend(struct mmc_queue *);
 extern void mmc_queue_resume(struct mmc_queue *);
 
-extern unsigned int mmc_queue_map_sg(struct mmc_queue *);
-extern void mmc_queue_bounce_pre(struct mmc_queue *);
-extern void mmc_queue_bounce_post(struct mmc_queue *);
+extern unsigned int mmc_queue_map_sg(struct mmc_queue *,
+				     struct mmc_queue_req *);
+extern void mmc_queue_bounce_pre(struct mmc_queue_req *);
+extern void mmc_queue_bounce_post(struct mmc_queue_req *);
+extern unsigned int mmc_queue_map_packed_sg(struct mmc_queue *,
+					    struct mmc_queue_req *);
 
 #endif
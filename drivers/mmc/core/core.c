@@ -74,6 +74,58 @@ static void mmc_flush_scheduled_work(void)
 	wake_unlock(&mmc_delayed_work_wake_lock);
 }
 
+#ifdef CONFIG_MMC_LATENCY_STATS
+/**
+ *	mmc_latency_add - account a latency sample
+ *	@host: MMC host the sample belongs to
+ *	@type: what was measured
+ *	@start: when the measured operation started
+ *
+ *	Adds the time elapsed since @start to the host's @type histogram.
+ *	Updates are not serialized, the statistics are best effort.
+ */
+void mmc_latency_add(struct mmc_host *host, enum mmc_lat_type type,
+		     ktime_t start)
+{
+	struct mmc_lat_hist *hist = &host->lat_stats.hist[type];
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket;
+
+	if (us < 0)
+		us = 0;
+
+	bucket = fls64(us);
+	if (bucket >= MMC_LAT_BUCKETS)
+		bucket = MMC_LAT_BUCKETS - 1;
+
+	hist->count[bucket]++;
+	hist->total_us += us;
+	if (us > hist->max_us)
+		hist->max_us = us;
+}
+EXPORT_SYMBOL(mmc_latency_add);
+
+static void mmc_latency_req_done(struct mmc_host *host,
+				 struct mmc_request *mrq)
+{
+	struct mmc_latency_stats *stats = &host->lat_stats;
+	enum mmc_lat_type type = MMC_LAT_CMD;
+
+	if (mrq->data)
+		type = (mrq->data->flags & MMC_DATA_READ) ?
+			MMC_LAT_READ : MMC_LAT_WRITE;
+	mmc_latency_add(host, type, stats->start);
+
+	stats->retries[min_t(unsigned int, stats->cur_retries,
+			     MMC_LAT_RETRY_BUCKETS - 1)]++;
+}
+#else
+static inline void mmc_latency_req_done(struct mmc_host *host,
+					struct mmc_request *mrq)
+{
+}
+#endif
+
 /**
  *	mmc_request_done - finish processing an MMC request
  *	@host: MMC host which completed request
@@ -98,10 +150,15 @@ void mmc_request_done(struct mmc_host *host, struct mmc_request *mrq)
 
 		cmd->retries--;
 		cmd->error = 0;
+#ifdef CONFIG_MMC_LATENCY_STATS
+		host->lat_stats.cur_retries++;
+#endif
 		host->ops->request(host, mrq);
 	} else {
 		led_trigger_event(host->led, LED_OFF);
 
+		mmc_latency_req_done(host, mrq);
+
 		pr_debug("%s: req done (CMD%u): %d: %08x %08x %08x %08x\n",
 			mmc_hostname(host), cmd->opcode, err,
 			cmd->resp[0], cmd->resp[1],
@@ -159,6 +216,11 @@ mmc_start_request(struct mmc_host *host, struct mmc_request *mrq)
 
 	led_trigger_event(host->led, LED_FULL);
 
+#ifdef CONFIG_MMC_LATENCY_STATS
+	host->lat_stats.start = ktime_get();
+	host->lat_stats.cur_retries = 0;
+#endif
+
 	mrq->cmd->error = 0;
 	mrq->cmd->mrq = mrq;
 	if (mrq->data) {
@@ -191,6 +253,76 @@ static void mmc_wait_done(struct mmc_request *mrq)
 	complete(mrq->done_data);
 }
 
+static void mmc_pre_req(struct mmc_host *host, struct mmc_request *mrq,
+			bool is_first_req)
+{
+	ktime_t start;
+
+	if (host->ops->pre_req) {
+		start = mmc_latency_start();
+		host->ops->pre_req(host, mrq, is_first_req);
+		mmc_latency_add(host, MMC_LAT_PREP, start);
+	}
+}
+
+static void mmc_post_req(struct mmc_host *host, struct mmc_request *mrq,
+			 int err)
+{
+	if (host->ops->post_req)
+		host->ops->post_req(host, mrq, err);
+}
+
+/**
+ *	mmc_start_req - start a request without waiting for it
+ *	@host: MMC host to start the request on
+ *	@areq: async request to start, or NULL to just finish the
+ *	       one in flight
+ *	@error: set to the result of the completed request's err_check
+ *
+ *	Prepares @areq, then waits for the request in flight (if any)
+ *	to complete and checks it. If that went fine, @areq is started;
+ *	otherwise @areq is left unstarted and the caller must handle the
+ *	error and restart it. Cleanup of the completed request overlaps
+ *	with the transfer of the new one.
+ *
+ *	Returns the completed request, or NULL if none was in flight.
+ */
+struct mmc_async_req *mmc_start_req(struct mmc_host *host,
+				    struct mmc_async_req *areq, int *error)
+{
+	int err = 0;
+	struct mmc_async_req *data = host->areq;
+
+	if (areq)
+		mmc_pre_req(host, areq->mrq, !host->areq);
+
+	if (host->areq) {
+		wait_for_completion(&host->areq->completion);
+		err = host->areq->err_check(host->card, host->areq);
+	}
+
+	if (!err && areq) {
+		init_completion(&areq->completion);
+		areq->mrq->done_data = &areq->completion;
+		areq->mrq->done = mmc_wait_done;
+		mmc_start_request(host, areq->mrq);
+	}
+
+	if (host->areq)
+		mmc_post_req(host, host->areq->mrq, 0);
+
+	/* Undo the preparation of a request we did not start */
+	if (err && areq)
+		mmc_post_req(host, areq->mrq, -EINVAL);
+
+	host->areq = err ? NULL : areq;
+
+	if (error)
+		*error = err;
+	return data;
+}
+EXPORT_SYMBOL(mmc_start_req);
+
 /**
  *	mmc_wait_for_req - start a request and wait for completion
  *	@host: MMC host to start command
@@ -206,6 +338,9 @@ void mmc_wait_for_req(struct mmc_host *host, struct mmc_request *mrq)
 
 	mrq->done_data = &complete;
 	mrq->done = mmc_wait_done;
+	/* Not prepared through pre_req, whatever the caller left there */
+	if (mrq->data)
+		mrq->data->host_cookie = 0;
 
 	mmc_start_request(host, mrq);
 
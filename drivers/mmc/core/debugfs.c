@@ -9,6 +9,7 @@
  */
 #include <linux/debugfs.h>
 #include <linux/fs.h>
+#include <linux/math64.h>
 #include <linux/seq_file.h>
 #include <linux/stat.h>
 
@@ -133,6 +134,83 @@ static const struct file_operations mmc_ios_fops = {
 	.release	= single_release,
 };
 
+#ifdef CONFIG_MMC_LATENCY_STATS
+static int mmc_latency_show(struct seq_file *s, void *data)
+{
+	struct mmc_host *host = s->private;
+	struct mmc_latency_stats *stats = &host->lat_stats;
+	static const char *type_str[MMC_LAT_NR] = {
+		[MMC_LAT_READ]	= "read",
+		[MMC_LAT_WRITE]	= "write",
+		[MMC_LAT_CMD]	= "cmd",
+		[MMC_LAT_BUSY]	= "busy",
+		[MMC_LAT_PREP]	= "prep",
+	};
+	unsigned long samples;
+	int i, t;
+
+	seq_printf(s, "%-10s", "usecs");
+	for (t = 0; t < MMC_LAT_NR; t++)
+		seq_printf(s, " %10s", type_str[t]);
+	seq_printf(s, "\n");
+
+	for (i = 0; i < MMC_LAT_BUCKETS; i++) {
+		seq_printf(s, "%-10lu", i ? 1UL << (i - 1) : 0);
+		for (t = 0; t < MMC_LAT_NR; t++)
+			seq_printf(s, " %10lu", stats->hist[t].count[i]);
+		seq_printf(s, "\n");
+	}
+
+	seq_printf(s, "%-10s", "avg");
+	for (t = 0; t < MMC_LAT_NR; t++) {
+		samples = 0;
+		for (i = 0; i < MMC_LAT_BUCKETS; i++)
+			samples += stats->hist[t].count[i];
+		seq_printf(s, " %10llu", samples ?
+			   div_u64(stats->hist[t].total_us, samples) : 0);
+	}
+	seq_printf(s, "\n%-10s", "max");
+	for (t = 0; t < MMC_LAT_NR; t++)
+		seq_printf(s, " %10lu", stats->hist[t].max_us);
+	seq_printf(s, "\n");
+
+	seq_printf(s, "retries:");
+	for (i = 0; i < MMC_LAT_RETRY_BUCKETS; i++)
+		seq_printf(s, " %d%s:%lu", i,
+			   i == MMC_LAT_RETRY_BUCKETS - 1 ? "+" : "",
+			   stats->retries[i]);
+	seq_printf(s, "\n");
+
+	return 0;
+}
+
+static int mmc_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc_latency_show, inode->i_private);
+}
+
+/* Any write clears the statistics */
+static ssize_t mmc_latency_write(struct file *file, const char __user *ubuf,
+				 size_t cnt, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct mmc_host *host = s->private;
+
+	memset(host->lat_stats.hist, 0, sizeof(host->lat_stats.hist));
+	memset(host->lat_stats.retries, 0, sizeof(host->lat_stats.retries));
+
+	return cnt;
+}
+
+static const struct file_operations mmc_latency_fops = {
+	.open		= mmc_latency_open,
+	.read		= seq_read,
+	.write		= mmc_latency_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
 void mmc_add_host_debugfs(struct mmc_host *host)
 {
 	struct dentry *root;
@@ -151,6 +229,12 @@ void mmc_add_host_debugfs(struct mmc_host *host)
 	if (!debugfs_create_file("ios", S_IRUSR, root, host, &mmc_ios_fops))
 		goto err_ios;
 
+#ifdef CONFIG_MMC_LATENCY_STATS
+	if (!debugfs_create_file("latency", S_IRUSR | S_IWUSR, root, host,
+				 &mmc_latency_fops))
+		goto err_ios;
+#endif
+
 	return;
 
 err_ios:
@@ -232,7 +232,7 @@ static int mmc_read_ext_csd(struct mmc_card *card)
 	}
 
 	card->ext_csd.rev = ext_csd[EXT_CSD_REV];
-	if (card->ext_csd.rev > 5) {
+	if (card->ext_csd.rev > 6) {
 		printk(KERN_ERR "%s: unrecognised EXT_CSD revision %d\n",
 			mmc_hostname(card->host), card->ext_csd.rev);
 		err = -EINVAL;
@@ -291,6 +291,13 @@ static int mmc_read_ext_csd(struct mmc_card *card)
 
 		card->ext_csd.rel_wr_sec_c = ext_csd[EXT_CSD_REL_WR_SEC_C];
 	}
+
+	if (card->ext_csd.rev >= 6) {
+		card->ext_csd.data_sector_size =
+			ext_csd[EXT_CSD_DATA_SECTOR_SIZE];
+		card->ext_csd.max_packed_writes =
+			ext_csd[EXT_CSD_MAX_PACKED_WRITES];
+	}
 out:
 	kfree(ext_csd);
 
@@ -382,6 +382,57 @@ static void sdhci_kunmap_atomic(void *buffer, unsigned long *flags)
 	local_irq_restore(*flags);
 }
 
+/*
+ * Map the data for DMA unless sdhci_pre_req() already did so, in which
+ * case data->host_cookie holds the mapped entry count.
+ */
+static int sdhci_pre_dma_transfer(struct sdhci_host *host,
+	struct mmc_data *data)
+{
+	int sg_count;
+
+	if (data->host_cookie)
+		return data->host_cookie;
+
+	sg_count = dma_map_sg(mmc_dev(host->mmc), data->sg, data->sg_len,
+		(data->flags & MMC_DATA_READ) ?
+			DMA_FROM_DEVICE : DMA_TO_DEVICE);
+	if (sg_count == 0)
+		return -EINVAL;
+
+	return sg_count;
+}
+
+static void sdhci_post_dma_transfer(struct sdhci_host *host,
+	struct mmc_data *data)
+{
+	if (data->host_cookie)
+		return;
+
+	dma_unmap_sg(mmc_dev(host->mmc), data->sg, data->sg_len,
+		(data->flags & MMC_DATA_READ) ?
+			DMA_FROM_DEVICE : DMA_TO_DEVICE);
+}
+
+static u8 *sdhci_adma_write_desc(u8 *desc, dma_addr_t addr, int len)
+{
+	desc[7] = (addr >> 24) & 0xff;
+	desc[6] = (addr >> 16) & 0xff;
+	desc[5] = (addr >> 8) & 0xff;
+	desc[4] = (addr >> 0) & 0xff;
+
+	/* A length of 0 means 64 KiB */
+	BUG_ON(len > SDHCI_ADMA_MAX_LEN);
+
+	desc[3] = (len >> 8) & 0xff;
+	desc[2] = (len >> 0) & 0xff;
+
+	desc[1] = 0x00;
+	desc[0] = 0x21; /* tran, valid */
+
+	return desc + SDHCI_ADMA_DESC_LEN;
+}
+
 static int sdhci_adma_table_pre(struct sdhci_host *host,
 	struct mmc_data *data)
 {
@@ -391,7 +442,7 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 	u8 *align;
 	dma_addr_t addr;
 	dma_addr_t align_addr;
-	int len, offset;
+	int len, offset, chunk, max_len;
 
 	struct scatterlist *sg;
 	int i;
@@ -414,14 +465,13 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 	 */
 
 	host->align_addr = dma_map_single(mmc_dev(host->mmc),
-		host->align_buffer, 128 * 4, direction);
+		host->align_buffer, SDHCI_ALIGN_BUF_SZ, direction);
 	if (dma_mapping_error(mmc_dev(host->mmc), host->align_addr))
 		goto fail;
 	BUG_ON(host->align_addr & 0x3);
 
-	host->sg_count = dma_map_sg(mmc_dev(host->mmc),
-		data->sg, data->sg_len, direction);
-	if (host->sg_count == 0)
+	host->sg_count = sdhci_pre_dma_transfer(host, data);
+	if (host->sg_count < 0)
 		goto unmap_align;
 
 	desc = host->adma_desc;
@@ -429,6 +479,10 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 
 	align_addr = host->align_addr;
 
+	max_len = SDHCI_ADMA_MAX_LEN;
+	if (host->quirks & SDHCI_QUIRK_NO_64KB_ADMA)
+		max_len = SDHCI_ADMA_MIN_CHUNK;
+
 	for_each_sg(data->sg, sg, host->sg_count, i) {
 		addr = sg_dma_address(sg);
 		len = sg_dma_len(sg);
@@ -449,67 +503,32 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 				sdhci_kunmap_atomic(buffer, &flags);
 			}
 
-			desc[7] = (align_addr >> 24) & 0xff;
-			desc[6] = (align_addr >> 16) & 0xff;
-			desc[5] = (align_addr >> 8) & 0xff;
-			desc[4] = (align_addr >> 0) & 0xff;
-
-			BUG_ON(offset > 65536);
-
-			desc[3] = (offset >> 8) & 0xff;
-			desc[2] = (offset >> 0) & 0xff;
-
-			desc[1] = 0x00;
-			desc[0] = 0x21; /* tran, valid */
+			desc = sdhci_adma_write_desc(desc, align_addr, offset);
 
 			align += 4;
 			align_addr += 4;
 
-			desc += 8;
-
 			addr += offset;
 			len -= offset;
 		}
 
-		if ((len == 0x10000) &&
-		    (host->quirks & SDHCI_QUIRK_NO_64KB_ADMA)) {
-			len = 1 << 15;
-
-			desc[7] = (addr >> 24) & 0xff;
-			desc[6] = (addr >> 16) & 0xff;
-			desc[5] = (addr >> 8) & 0xff;
-			desc[4] = (addr >> 0) & 0xff;
-
-			desc[3] = (len >> 8) & 0xff;
-			desc[2] = (len >> 0) & 0xff;
-
-			desc[1] = 0x00;
-			desc[0] = 0x21; /* tran, valid */
-
-			desc += 8;
-			addr += len;
+		/*
+		 * Segments may be larger than a single descriptor can
+		 * describe; chain as many as needed.
+		 */
+		while (len) {
+			chunk = min(len, max_len);
+			desc = sdhci_adma_write_desc(desc, addr, chunk);
+			addr += chunk;
+			len -= chunk;
 		}
 
-		desc[7] = (addr >> 24) & 0xff;
-		desc[6] = (addr >> 16) & 0xff;
-		desc[5] = (addr >> 8) & 0xff;
-		desc[4] = (addr >> 0) & 0xff;
-
-		BUG_ON(len > 65536);
-
-		desc[3] = (len >> 8) & 0xff;
-		desc[2] = (len >> 0) & 0xff;
-
-		desc[1] = 0x00;
-		desc[0] = 0x21; /* tran, valid */
-
-		desc += 8;
-
 		/*
 		 * If this triggers then we have a calculation bug
 		 * somewhere. :/
 		 */
-		WARN_ON((desc - host->adma_desc) > (128 * 2 + 1) * 4);
+		WARN_ON((desc - host->adma_desc) > SDHCI_ADMA_TABLE_SZ -
+			SDHCI_ADMA_DESC_LEN);
 	}
 
 	/*
@@ -531,11 +550,11 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 	 */
 	if (data->flags & MMC_DATA_WRITE) {
 		dma_sync_single_for_device(mmc_dev(host->mmc),
-			host->align_addr, 128 * 4, direction);
+			host->align_addr, SDHCI_ALIGN_BUF_SZ, direction);
 	}
 
 	host->adma_addr = dma_map_single(mmc_dev(host->mmc),
-		host->adma_desc, (128 * 2 + 1) * 4, DMA_TO_DEVICE);
+		host->adma_desc, SDHCI_ADMA_TABLE_SZ, DMA_TO_DEVICE);
 	if (dma_mapping_error(mmc_dev(host->mmc), host->adma_addr))
 		goto unmap_entries;
 	BUG_ON(host->adma_addr & 0x3);
@@ -543,11 +562,10 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 	return 0;
 
 unmap_entries:
-	dma_unmap_sg(mmc_dev(host->mmc), data->sg,
-		data->sg_len, direction);
+	sdhci_post_dma_transfer(host, data);
 unmap_align:
 	dma_unmap_single(mmc_dev(host->mmc), host->align_addr,
-		128 * 4, direction);
+		SDHCI_ALIGN_BUF_SZ, direction);
 fail:
 	return -EINVAL;
 }
@@ -569,10 +587,10 @@ static void sdhci_adma_table_post(struct sdhci_host *host,
 		direction = DMA_TO_DEVICE;
 
 	dma_unmap_single(mmc_dev(host->mmc), host->adma_addr,
-		(128 * 2 + 1) * 4, DMA_TO_DEVICE);
+		SDHCI_ADMA_TABLE_SZ, DMA_TO_DEVICE);
 
 	dma_unmap_single(mmc_dev(host->mmc), host->align_addr,
-		128 * 4, direction);
+		SDHCI_ALIGN_BUF_SZ, direction);
 
 	if (data->flags & MMC_DATA_READ) {
 		dma_sync_sg_for_cpu(mmc_dev(host->mmc), data->sg,
@@ -594,8 +612,7 @@ static void sdhci_adma_table_post(struct sdhci_host *host,
 		}
 	}
 
-	dma_unmap_sg(mmc_dev(host->mmc), data->sg,
-		data->sg_len, direction);
+	sdhci_post_dma_transfer(host, data);
 }
 
 static u8 sdhci_calc_timeout(struct sdhci_host *host, struct mmc_data *data)
@@ -670,7 +687,7 @@ static void sdhci_prepare_data(struct sdhci_host *host, struct mmc_data *data)
 		return;
 
 	/* Sanity checks */
-	BUG_ON(data->blksz * data->blocks > 524288);
+	BUG_ON(data->blksz * data->blocks > SDHCI_MAX_REQ_SIZE);
 	BUG_ON(data->blksz > host->mmc->max_blk_size);
 	BUG_ON(data->blocks > 65535);
 
@@ -764,12 +781,8 @@ static void sdhci_prepare_data(struct sdhci_host *host, struct mmc_data *data)
 		} else {
 			int sg_cnt;
 
-			sg_cnt = dma_map_sg(mmc_dev(host->mmc),
-					data->sg, data->sg_len,
-					(data->flags & MMC_DATA_READ) ?
-						DMA_FROM_DEVICE :
-						DMA_TO_DEVICE);
-			if (sg_cnt == 0) {
+			sg_cnt = sdhci_pre_dma_transfer(host, data);
+			if (sg_cnt < 0) {
 				/*
 				 * This only happens when someone fed
 				 * us an invalid request.
@@ -784,6 +797,17 @@ static void sdhci_prepare_data(struct sdhci_host *host, struct mmc_data *data)
 		}
 	}
 
+	/*
+	 * A request mapped ahead of time by sdhci_pre_req() may still end
+	 * up being done by PIO; give the buffers back to the CPU first.
+	 */
+	if (!(host->flags & SDHCI_REQ_USE_DMA) && data->host_cookie) {
+		dma_unmap_sg(mmc_dev(host->mmc), data->sg, data->sg_len,
+			(data->flags & MMC_DATA_READ) ?
+				DMA_FROM_DEVICE : DMA_TO_DEVICE);
+		data->host_cookie = 0;
+	}
+
 	/*
 	 * Always adjust the DMA selection as some controllers
 	 * (e.g. JMicron) can't do PIO properly when the selection
@@ -852,11 +876,8 @@ static void sdhci_finish_data(struct sdhci_host *host)
 	if (host->flags & SDHCI_REQ_USE_DMA) {
 		if (host->flags & SDHCI_USE_ADMA)
 			sdhci_adma_table_post(host, data);
-		else {
-			dma_unmap_sg(mmc_dev(host->mmc), data->sg,
-				data->sg_len, (data->flags & MMC_DATA_READ) ?
-					DMA_FROM_DEVICE : DMA_TO_DEVICE);
-		}
+		else
+			sdhci_post_dma_transfer(host, data);
 	}
 
 	/*
@@ -925,6 +946,14 @@ static void sdhci_send_command(struct sdhci_host *host, struct mmc_command *cmd)
 
 	sdhci_prepare_data(host, cmd->data);
 
+	/*
+	 * The end of busy is signalled through the data complete
+	 * interrupt and bounded by the data timeout, which may still be
+	 * set up for a short transfer. Give the card as long as we can.
+	 */
+	if (!cmd->data && (cmd->flags & MMC_RSP_BUSY))
+		sdhci_writeb(host, 0xE, SDHCI_TIMEOUT_CONTROL);
+
 #ifdef CONFIG_EMBEDDED_MMC_START_OFFSET
 	if (cmd->data ||
 	   (cmd->opcode == MMC_ERASE_GROUP_START) ||
@@ -1361,8 +1390,48 @@ static unsigned int sdhci_get_host_offset(struct mmc_host *mmc) {
 }
 #endif
 
+/*
+ * Map the next request for DMA while the current one is still on the
+ * bus, so that cache maintenance is off the critical path.
+ */
+static void sdhci_pre_req(struct mmc_host *mmc, struct mmc_request *mrq,
+	bool is_first_req)
+{
+	struct sdhci_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+	int sg_count;
+
+	if (!data)
+		return;
+
+	data->host_cookie = 0;
+	if (!(host->flags & (SDHCI_USE_SDMA | SDHCI_USE_ADMA)))
+		return;
+
+	sg_count = sdhci_pre_dma_transfer(host, data);
+	if (sg_count > 0)
+		data->host_cookie = sg_count;
+}
+
+static void sdhci_post_req(struct mmc_host *mmc, struct mmc_request *mrq,
+	int err)
+{
+	struct sdhci_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+
+	if (!data || !data->host_cookie)
+		return;
+
+	dma_unmap_sg(mmc_dev(host->mmc), data->sg, data->sg_len,
+		(data->flags & MMC_DATA_READ) ?
+			DMA_FROM_DEVICE : DMA_TO_DEVICE);
+	data->host_cookie = 0;
+}
+
 static const struct mmc_host_ops sdhci_ops = {
 	.request	= sdhci_request,
+	.pre_req	= sdhci_pre_req,
+	.post_req	= sdhci_post_req,
 	.set_ios	= sdhci_set_ios,
 	.get_ro		= sdhci_get_ro,
 	.enable		= sdhci_enable,
@@ -1606,6 +1675,11 @@ static void sdhci_data_irq(struct sdhci_host *host, u32 intmask)
 				sdhci_finish_command(host);
 				return;
 			}
+			if (intmask & SDHCI_INT_DATA_TIMEOUT) {
+				host->cmd->error = -ETIMEDOUT;
+				tasklet_schedule(&host->finish_tasklet);
+				return;
+			}
 		}
 
 		printk(KERN_ERR "%s: Got data interrupt 0x%08x even "
@@ -1886,12 +1960,12 @@ int sdhci_add_host(struct sdhci_host *host)
 
 	if (host->flags & SDHCI_USE_ADMA) {
 		/*
-		 * We need to allocate descriptors for all sg entries
-		 * (128) and potentially one alignment transfer for
-		 * each of those entries.
+		 * We need to allocate descriptors for all sg entries,
+		 * potentially one alignment transfer for each of those
+		 * entries, and the extra ones for segments over 64 KiB.
 		 */
-		host->adma_desc = kmalloc((128 * 2 + 1) * 4, GFP_KERNEL);
-		host->align_buffer = kmalloc(128 * 4, GFP_KERNEL);
+		host->adma_desc = kmalloc(SDHCI_ADMA_TABLE_SZ, GFP_KERNEL);
+		host->align_buffer = kmalloc(SDHCI_ALIGN_BUF_SZ, GFP_KERNEL);
 		if (!host->adma_desc || !host->align_buffer) {
 			kfree(host->adma_desc);
 			kfree(host->align_buffer);
@@ -1976,6 +2050,10 @@ int sdhci_add_host(struct sdhci_host *host)
 	if (host->data_width >= 8)
 		mmc->caps |= MMC_CAP_8_BIT_DATA;
 
+	/* R1B commands complete on the end-of-busy interrupt */
+	if (!(host->quirks & SDHCI_QUIRK_NO_BUSY_IRQ))
+		mmc->caps |= MMC_CAP_WAIT_WHILE_BUSY;
+
 #ifdef CONFIG_MACH_MOT
 	if (!mmc->ocr_avail) {
 		if (caps & SDHCI_CAN_VDD_330)
@@ -2008,28 +2086,25 @@ int sdhci_add_host(struct sdhci_host *host)
 	 * can do scatter/gather or not.
 	 */
 	if (host->flags & SDHCI_USE_ADMA)
-		mmc->max_hw_segs = 128;
+		mmc->max_hw_segs = SDHCI_MAX_SEGS;
 	else if (host->flags & SDHCI_USE_SDMA)
 		mmc->max_hw_segs = 1;
 	else /* PIO */
-		mmc->max_hw_segs = 128;
-	mmc->max_phys_segs = 128;
+		mmc->max_hw_segs = SDHCI_MAX_SEGS;
+	mmc->max_phys_segs = SDHCI_MAX_SEGS;
 
 	/*
 	 * Maximum number of sectors in one transfer. Limited by DMA boundary
 	 * size (512KiB).
 	 */
-	mmc->max_req_size = 524288;
+	mmc->max_req_size = SDHCI_MAX_REQ_SIZE;
 
 	/*
 	 * Maximum segment size. Could be one segment with the maximum number
-	 * of bytes. When doing hardware scatter/gather, each entry cannot
-	 * be larger than 64 KiB though.
+	 * of bytes. ADMA segments over 64 KiB are split over several
+	 * descriptors by sdhci_adma_table_pre().
 	 */
-	if (host->flags & SDHCI_USE_ADMA)
-		mmc->max_seg_size = 65536;
-	else
-		mmc->max_seg_size = mmc->max_req_size;
+	mmc->max_seg_size = mmc->max_req_size;
 
 	/*
 	 * Maximum block size. This varies from controller to controller and
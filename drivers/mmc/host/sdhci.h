@@ -177,6 +177,22 @@
 #define   SDHCI_SPEC_100	0
 #define   SDHCI_SPEC_200	1
 
+#define SDHCI_MAX_SEGS		128
+#define SDHCI_MAX_REQ_SIZE	524288
+
+/*
+ * A single ADMA2 descriptor moves at most 64 KiB, so larger segments are
+ * split over several. Each segment may also need a descriptor for its
+ * unaligned head, and the table ends with a terminating entry.
+ */
+#define SDHCI_ADMA_DESC_LEN	8
+#define SDHCI_ADMA_MAX_LEN	65536
+#define SDHCI_ADMA_MIN_CHUNK	(SDHCI_ADMA_MAX_LEN / 2)
+#define SDHCI_ADMA_TABLE_SZ	((SDHCI_MAX_SEGS * 2 + \
+				  SDHCI_MAX_REQ_SIZE / SDHCI_ADMA_MIN_CHUNK + 1) * \
+				 SDHCI_ADMA_DESC_LEN)
+#define SDHCI_ALIGN_BUF_SZ	(SDHCI_MAX_SEGS * 4)
+
 struct sdhci_ops;
 
 struct sdhci_host {
@@ -19,6 +19,7 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -36,13 +37,16 @@
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+static DEFINE_MUTEX(binder_main_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 static DEFINE_MUTEX(binder_mmap_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
+static DEFINE_MUTEX(binder_warm_lock);
+static LIST_HEAD(binder_warm_procs);
+static atomic_t binder_warm_pages_total = ATOMIC_INIT(0);
 
 static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
@@ -81,6 +85,20 @@ BINDER_DEBUG_ENTRY(proc);
 
 #define BINDER_SMALL_BUF_SIZE (PAGE_SIZE * 64)
 
+/*
+ * Freed buffers with less than BINDER_CACHE_MAX_SIZE bytes of capacity
+ * are parked on per-proc size-class lists instead of being merged back
+ * into the free_buffers rbtree.  Class i holds buffers with at least
+ * binder_cache_class_size[i] bytes of capacity.
+ */
+#define BINDER_CACHE_CLASSES		6
+#define BINDER_CACHE_MAX_SIZE		512
+#define BINDER_CACHE_CLASS_DEPTH	8
+
+static const size_t binder_cache_class_size[BINDER_CACHE_CLASSES] = {
+	0, 16, 32, 64, 128, 256
+};
+
 enum {
 	BINDER_DEBUG_USER_ERROR             = 1U << 0,
 	BINDER_DEBUG_FAILED_TRANSACTION     = 1U << 1,
@@ -106,6 +124,14 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+/*
+ * Number of unused buffer pages each proc keeps mapped for reuse.  They
+ * are populated at mmap time and handed back in batches by
+ * binder_warm_shrink under memory pressure.  0 restores synchronous
+ * page allocation and freeing.
+ */
+static int binder_warm_pages_max = 8;
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -146,23 +172,79 @@ enum binder_stat_types {
 	BINDER_STAT_COUNT
 };
 
+/* atomic, since some commands are handled without binder_main_lock */
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
+}
+
+struct binder_lock_stats {
+	int acquired;
+	int contended;
+};
+
+static struct binder_lock_stats binder_main_lock_stats;
+static atomic_t binder_alloc_lock_contended = ATOMIC_INIT(0);
+static atomic_t binder_ref_fast_count = ATOMIC_INIT(0);
+static atomic_t binder_transaction_fast_count = ATOMIC_INIT(0);
+
+/*
+ * binder_main_lock protects the object graph (threads, nodes and refs).
+ * Each binder_proc additionally has an alloc_lock that covers its buffer
+ * allocator and page array, so that allocating, filling and freeing
+ * buffers in one process does not hold up transactions between unrelated
+ * processes, and a todo_lock for its work lists and transaction stacks.
+ * Lock order is binder_main_lock -> proc->alloc_lock -> mm->mmap_sem and
+ * binder_main_lock -> proc->inner_lock -> node->lock -> proc->todo_lock.
+ */
+static inline void binder_lock(void)
+{
+	if (!mutex_trylock(&binder_main_lock)) {
+		mutex_lock(&binder_main_lock);
+		binder_main_lock_stats.contended++;
+	}
+	binder_main_lock_stats.acquired++;
+}
+
+static inline void binder_unlock(void)
+{
+	mutex_unlock(&binder_main_lock);
+}
+
+/*
+ * Latency histogram with log2 microsecond buckets: bucket 0 counts
+ * samples below 1us and bucket n samples in [2^(n-1), 2^n) us.  The
+ * last bucket also absorbs everything slower.
+ */
+#define BINDER_LATENCY_BUCKETS 24
+
+struct binder_latency_hist {
+	u32 count[BINDER_LATENCY_BUCKETS];
+	u32 total;
+};
+
+static void binder_latency_add(struct binder_latency_hist *hist, s64 us)
+{
+	int bucket = us > 0 ? fls64(us) : 0;
+
+	if (bucket >= BINDER_LATENCY_BUCKETS)
+		bucket = BINDER_LATENCY_BUCKETS - 1;
+	hist->count[bucket]++;
+	hist->total++;
 }
 
 struct binder_transaction_log_entry {
@@ -220,6 +302,14 @@ struct binder_node {
 	};
 	struct binder_proc *proc;
 	struct hlist_head refs;
+	/*
+	 * internal_strong_refs is changed under lock as well as
+	 * binder_main_lock, so that BC_ACQUIRE/BC_RELEASE can move it
+	 * between non-zero values holding only lock.  Transitions to and
+	 * from zero still require binder_main_lock.  Nests inside the
+	 * inner_lock of the proc owning the ref being changed.
+	 */
+	spinlock_t lock;
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
@@ -229,9 +319,10 @@ struct binder_node {
 	unsigned pending_strong_ref:1;
 	unsigned has_weak_ref:1;
 	unsigned pending_weak_ref:1;
-	unsigned has_async_transaction:1;
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
+	/* not a bitfield, it changes under proc->todo_lock alone */
+	int has_async_transaction;
 	struct list_head async_todo;
 };
 
@@ -259,12 +350,16 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct rb_node rb_node; /* free entry by size or allocated */
+					/* entry by address */
+		struct list_head cache_entry; /* cached small entry */
+	};
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
-	unsigned debug_id:29;
+	unsigned cached:1;
+	unsigned debug_id:28;
 
 	struct binder_transaction *transaction;
 
@@ -274,6 +369,16 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+/*
+ * Scheduling policy and priority carried from a caller to the binder
+ * thread serving it.  prio is the nice value for SCHED_NORMAL, BATCH
+ * and IDLE, and the rt_priority for SCHED_FIFO and SCHED_RR.
+ */
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -282,6 +387,26 @@ enum binder_deferred_state {
 
 struct binder_proc {
 	struct hlist_node proc_node;
+	/*
+	 * inner_lock protects the threads and refs trees and the strong and
+	 * weak counts of refs.  The trees are only changed with both
+	 * binder_main_lock and inner_lock held, so either is enough to walk
+	 * them.  Ref counts are changed under inner_lock; moving one to or
+	 * from zero also needs binder_main_lock.  binder_get_thread and the
+	 * refcount fast path hold only inner_lock.
+	 */
+	spinlock_t inner_lock;
+	/*
+	 * todo_lock protects todo, the todo lists and transaction stacks of
+	 * the threads, the from pointer of transactions they sent, the
+	 * async_todo lists of the nodes, tmp_ref, and is_dead, which is
+	 * also set under alloc_lock.  binder_transaction_fast queues work
+	 * holding only this lock; everything else that changes the lists
+	 * or stacks holds binder_main_lock as well.  It nests inside all
+	 * other binder locks, and two of them are only taken together by
+	 * binder_todo_lock_pair.
+	 */
+	spinlock_t todo_lock;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
@@ -295,12 +420,23 @@ struct binder_proc {
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
+	struct mutex alloc_lock;
+	struct binder_lock_stats alloc_lock_stats;
 	struct list_head buffers;
 	struct rb_root free_buffers;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
+	struct list_head buffer_cache[BINDER_CACHE_CLASSES];
+	int buffer_cache_count[BINDER_CACHE_CLASSES];
+	int buffer_cache_total;
+	int buffer_cache_hits;
+	int buffer_cache_misses;
 
 	struct page **pages;
+	unsigned long *warm_map;
+	int warm_pages;
+	int warm_reclaimed;
+	struct list_head warm_node;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -311,10 +447,76 @@ struct binder_proc {
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	struct binder_priority default_priority;
 	struct dentry *debugfs_entry;
+	struct binder_latency_hist wakeup_latency;
+	struct binder_latency_hist call_latency;
+	int tmp_ref;
+	unsigned is_dead:1;
 };
 
+static inline void binder_alloc_lock(struct binder_proc *proc)
+{
+	if (!mutex_trylock(&proc->alloc_lock)) {
+		mutex_lock(&proc->alloc_lock);
+		proc->alloc_lock_stats.contended++;
+		atomic_inc(&binder_alloc_lock_contended);
+	}
+	proc->alloc_lock_stats.acquired++;
+}
+
+static inline void binder_alloc_unlock(struct binder_proc *proc)
+{
+	mutex_unlock(&proc->alloc_lock);
+}
+
+/*
+ * A sender holds a temporary reference on the target proc while it
+ * fills a buffer and queues the transaction without binder_main_lock,
+ * and binder_deferred_release holds one while it tears the proc down.
+ * The last holder frees a proc that was released in the meantime.
+ */
+static void binder_proc_inc_tmpref(struct binder_proc *proc)
+{
+	spin_lock(&proc->todo_lock);
+	proc->tmp_ref++;
+	spin_unlock(&proc->todo_lock);
+}
+
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	int free_proc;
+
+	spin_lock(&proc->todo_lock);
+	BUG_ON(proc->tmp_ref <= 0);
+	proc->tmp_ref--;
+	free_proc = proc->is_dead && proc->tmp_ref == 0;
+	spin_unlock(&proc->todo_lock);
+	if (free_proc)
+		kfree(proc);
+}
+
+/* Take the todo_lock of two procs, which may be the same, in address order */
+static void binder_todo_lock_pair(struct binder_proc *a, struct binder_proc *b)
+{
+	if (a == b) {
+		spin_lock(&a->todo_lock);
+		return;
+	}
+	if (a > b)
+		swap(a, b);
+	spin_lock(&a->todo_lock);
+	spin_lock_nested(&b->todo_lock, SINGLE_DEPTH_NESTING);
+}
+
+static void binder_todo_unlock_pair(struct binder_proc *a,
+				    struct binder_proc *b)
+{
+	if (a != b)
+		spin_unlock(&b->todo_lock);
+	spin_unlock(&a->todo_lock);
+}
+
 enum {
 	BINDER_LOOPER_STATE_REGISTERED  = 0x01,
 	BINDER_LOOPER_STATE_ENTERED     = 0x02,
@@ -335,6 +537,7 @@ struct binder_thread {
 	uint32_t return_error2; /* Write failed, return error code in read */
 		/* buffer. Used when sending a reply to a dead process that */
 		/* we are also waiting on */
+	int rt_inherited; /* current RT policy came from a transaction */
 	wait_queue_head_t wait;
 	struct binder_stats stats;
 };
@@ -353,11 +556,15 @@ struct binder_transaction {
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	start_time;
 };
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
@@ -516,6 +723,48 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static inline int binder_is_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static struct binder_priority binder_current_priority(void)
+{
+	struct binder_priority p;
+
+	p.sched_policy = current->policy;
+	if (binder_is_rt_policy(p.sched_policy))
+		p.prio = current->rt_priority;
+	else
+		p.prio = task_nice(current);
+	return p;
+}
+
+static void binder_set_priority(struct binder_priority desired)
+{
+	struct sched_param param;
+
+	if (binder_is_rt_policy(desired.sched_policy)) {
+		if (current->policy == desired.sched_policy &&
+		    current->rt_priority == desired.prio)
+			return;
+		param.sched_priority = desired.prio;
+		if (sched_setscheduler_nocheck(current, desired.sched_policy,
+					       &param))
+			binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+				     "binder: %d: failed to set policy %u "
+				     "prio %d\n", current->pid,
+				     desired.sched_policy, desired.prio);
+		return;
+	}
+	if (current->policy != desired.sched_policy) {
+		param.sched_priority = 0;
+		sched_setscheduler_nocheck(current, desired.sched_policy,
+					   &param);
+	}
+	binder_set_nice(desired.prio);
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -608,6 +857,176 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+/*
+ * Keep the leading pages of a range that is being freed mapped as warm
+ * pages, up to binder_warm_pages_max per proc.  Returns the start of the
+ * part that still has to be unmapped.
+ */
+static void *binder_keep_warm_pages(struct binder_proc *proc,
+				    void *start, void *end)
+{
+	int was_cold = !proc->warm_pages;
+
+	if (proc->warm_map == NULL || proc->is_dead)
+		return start;
+
+	while (start < end && proc->warm_pages < binder_warm_pages_max) {
+		__set_bit((start - proc->buffer) / PAGE_SIZE, proc->warm_map);
+		proc->warm_pages++;
+		atomic_inc(&binder_warm_pages_total);
+		start += PAGE_SIZE;
+	}
+	if (was_cold && proc->warm_pages) {
+		mutex_lock(&binder_warm_lock);
+		if (list_empty(&proc->warm_node))
+			list_add_tail(&proc->warm_node, &binder_warm_procs);
+		mutex_unlock(&binder_warm_lock);
+	}
+	return start;
+}
+
+static void binder_claim_warm_page(struct binder_proc *proc, int index)
+{
+	BUG_ON(proc->warm_map == NULL);
+	BUG_ON(!__test_and_clear_bit(index, proc->warm_map));
+	proc->warm_pages--;
+	atomic_dec(&binder_warm_pages_total);
+}
+
+/*
+ * Unmap and free up to nr_to_scan warm pages, a contiguous run at a
+ * time, under a single mmap_sem hold.  Called with proc->alloc_lock
+ * held; returns the number of pages freed.
+ */
+static int binder_reclaim_warm_pages(struct binder_proc *proc, int nr_to_scan)
+{
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	int npages = proc->buffer_size / PAGE_SIZE;
+	int freed = 0;
+	int i, j, run_end;
+
+	if (!proc->warm_pages || proc->vma == NULL)
+		return 0;
+	mm = get_task_mm(proc->tsk);
+	if (mm == NULL)
+		return 0;
+	if (!down_write_trylock(&mm->mmap_sem)) {
+		mmput(mm);
+		return 0;
+	}
+	vma = proc->vma;
+	if (vma == NULL || vma->vm_mm != mm)
+		goto out;
+
+	i = find_first_bit(proc->warm_map, npages);
+	while (i < npages && freed < nr_to_scan) {
+		void *page_addr = proc->buffer + i * PAGE_SIZE;
+		size_t size;
+
+		run_end = find_next_zero_bit(proc->warm_map, npages, i);
+		if (run_end - i > nr_to_scan - freed)
+			run_end = i + nr_to_scan - freed;
+		size = (run_end - i) * PAGE_SIZE;
+
+		zap_page_range(vma, (uintptr_t)page_addr +
+			proc->user_buffer_offset, size, NULL);
+		unmap_kernel_range((unsigned long)page_addr, size);
+		for (j = i; j < run_end; j++) {
+			__free_page(proc->pages[j]);
+			proc->pages[j] = NULL;
+			__clear_bit(j, proc->warm_map);
+		}
+		freed += run_end - i;
+		i = find_next_bit(proc->warm_map, npages, run_end);
+	}
+	proc->warm_pages -= freed;
+	proc->warm_reclaimed += freed;
+	atomic_sub(freed, &binder_warm_pages_total);
+	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: reclaimed %d warm pages\n", proc->pid, freed);
+out:
+	up_write(&mm->mmap_sem);
+	mmput(mm);
+	return freed;
+}
+
+static int binder_warm_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct binder_proc *proc, *next;
+
+	if (!nr_to_scan)
+		return atomic_read(&binder_warm_pages_total);
+
+	if (!mutex_trylock(&binder_warm_lock))
+		return -1;
+	list_for_each_entry_safe(proc, next, &binder_warm_procs, warm_node) {
+		/* we may be reclaiming on behalf of binder itself */
+		if (!mutex_trylock(&proc->alloc_lock))
+			continue;
+		nr_to_scan -= binder_reclaim_warm_pages(proc, nr_to_scan);
+		if (!proc->warm_pages)
+			list_del_init(&proc->warm_node);
+		mutex_unlock(&proc->alloc_lock);
+		if (nr_to_scan <= 0)
+			break;
+	}
+	mutex_unlock(&binder_warm_lock);
+
+	return atomic_read(&binder_warm_pages_total);
+}
+
+static struct shrinker binder_warm_shrinker = {
+	.shrink = binder_warm_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/*
+ * Trim every proc down to the new warm_pages limit when it is lowered.
+ * proc->alloc_lock nests outside binder_warm_lock, so only trylock it
+ * here and retry procs that were busy (or whose mmap_sem was contended)
+ * on a later pass.
+ */
+static int binder_set_warm_pages(const char *val, struct kernel_param *kp)
+{
+	struct binder_proc *proc, *next;
+	int ret, limit, busy, pass;
+
+	ret = param_set_int(val, kp);
+	if (ret)
+		return ret;
+
+	for (pass = 0; pass < 10; pass++) {
+		busy = 0;
+		limit = max(binder_warm_pages_max, 0);
+		mutex_lock(&binder_warm_lock);
+		list_for_each_entry_safe(proc, next, &binder_warm_procs,
+					 warm_node) {
+			if (proc->warm_pages <= limit)
+				continue;
+			if (!mutex_trylock(&proc->alloc_lock)) {
+				busy = 1;
+				continue;
+			}
+			if (proc->warm_pages > limit)
+				binder_reclaim_warm_pages(proc,
+					proc->warm_pages - limit);
+			if (proc->warm_pages > limit)
+				busy = 1;
+			if (!proc->warm_pages)
+				list_del_init(&proc->warm_node);
+			mutex_unlock(&proc->alloc_lock);
+		}
+		mutex_unlock(&binder_warm_lock);
+		if (!busy)
+			break;
+		schedule_timeout_uninterruptible(HZ / 100 + 1);
+	}
+	return 0;
+}
+module_param_call(warm_pages, binder_set_warm_pages, param_get_int,
+	&binder_warm_pages_max, S_IWUSR | S_IRUGO);
+
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -625,6 +1044,24 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	if (allocate == 0) {
+		start = binder_keep_warm_pages(proc, start, end);
+		if (end <= start)
+			return 0;
+	} else {
+		for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE)
+			if (!proc->pages[(page_addr - proc->buffer) / PAGE_SIZE])
+				break;
+		if (page_addr >= end) {
+			/* the whole range is warm, no page table updates */
+			for (page_addr = start; page_addr < end;
+			     page_addr += PAGE_SIZE)
+				binder_claim_warm_page(proc,
+					(page_addr - proc->buffer) / PAGE_SIZE);
+			return 0;
+		}
+	}
+
 	if (vma)
 		mm = NULL;
 	else
@@ -654,7 +1091,10 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
+		if (*page) {
+			binder_claim_warm_page(proc, page - proc->pages);
+			continue;
+		}
 		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
 		if (*page == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -711,18 +1151,88 @@ err_no_vma:
 	return -ENOMEM;
 }
 
+static void binder_buffer_cache_flush(struct binder_proc *proc);
+
+static struct binder_buffer *binder_buffer_cache_get(struct binder_proc *proc,
+						     size_t size)
+{
+	struct binder_buffer *buffer;
+	int i;
+
+	/*
+	 * Buffers in the request's own class may be smaller than the
+	 * request, so check their real size; any buffer in a higher class
+	 * is large enough.
+	 */
+	for (i = BINDER_CACHE_CLASSES - 1; i > 0; i--)
+		if (size >= binder_cache_class_size[i])
+			break;
+	list_for_each_entry(buffer, &proc->buffer_cache[i], cache_entry)
+		if (binder_buffer_size(proc, buffer) >= size)
+			goto found;
+
+	for (i++; i < BINDER_CACHE_CLASSES; i++) {
+		if (list_empty(&proc->buffer_cache[i]))
+			continue;
+		buffer = list_first_entry(&proc->buffer_cache[i],
+					  struct binder_buffer, cache_entry);
+		goto found;
+	}
+	return NULL;
+
+found:
+	list_del(&buffer->cache_entry);
+	buffer->cached = 0;
+	proc->buffer_cache_count[i]--;
+	proc->buffer_cache_total--;
+	return buffer;
+}
+
+static int binder_buffer_cache_put(struct binder_proc *proc,
+				   struct binder_buffer *buffer,
+				   size_t buffer_size)
+{
+	int i;
+
+	if (proc->is_dead || buffer_size >= BINDER_CACHE_MAX_SIZE)
+		return 0;
+
+	for (i = BINDER_CACHE_CLASSES - 1; i > 0; i--)
+		if (buffer_size >= binder_cache_class_size[i])
+			break;
+	if (proc->buffer_cache_count[i] >= BINDER_CACHE_CLASS_DEPTH)
+		return 0;
+
+	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: cache buffer %p size %zd class %d\n",
+		     proc->pid, buffer, buffer_size, i);
+
+	buffer->cached = 1;
+	list_add(&buffer->cache_entry, &proc->buffer_cache[i]);
+	proc->buffer_cache_count[i]++;
+	proc->buffer_cache_total++;
+	return 1;
+}
+
+/*
+ * binder_alloc_buf, binder_free_buf and binder_buffer_lookup must be
+ * called with proc->alloc_lock held.
+ */
 static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 					      size_t data_size,
 					      size_t offsets_size, int is_async)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
+	struct rb_node *n;
 	struct binder_buffer *buffer;
 	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
+	struct rb_node *best_fit;
 	void *has_page_addr;
 	void *end_page_addr;
 	size_t size;
 
+	if (proc->is_dead)
+		return NULL;
+
 	if (proc->vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
 		       proc->pid);
@@ -746,6 +1256,22 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
+	if (size < BINDER_CACHE_MAX_SIZE) {
+		buffer = binder_buffer_cache_get(proc, size);
+		if (buffer) {
+			proc->buffer_cache_hits++;
+			binder_insert_allocated_buffer(proc, buffer);
+			binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+				     "binder: %d: binder_alloc_buf size %zd "
+				     "got cached %p\n", proc->pid, size, buffer);
+			goto done;
+		}
+		proc->buffer_cache_misses++;
+	}
+
+retry:
+	n = proc->free_buffers.rb_node;
+	best_fit = NULL;
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
@@ -762,6 +1288,10 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		}
 	}
 	if (best_fit == NULL) {
+		if (proc->buffer_cache_total) {
+			binder_buffer_cache_flush(proc);
+			goto retry;
+		}
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
 		return NULL;
@@ -803,9 +1333,13 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got "
 		     "%p\n", proc->pid, size, buffer);
+done:
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
+	buffer->allow_user_free = 0;
+	buffer->transaction = NULL;
+	buffer->target_node = NULL;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
 		binder_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
@@ -874,6 +1408,9 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
+static void __binder_free_buf(struct binder_proc *proc,
+			      struct binder_buffer *buffer, size_t buffer_size);
+
 static void binder_free_buf(struct binder_proc *proc,
 			    struct binder_buffer *buffer)
 {
@@ -884,6 +1421,7 @@ static void binder_free_buf(struct binder_proc *proc,
 	size = ALIGN(buffer->data_size, sizeof(void *)) +
 		ALIGN(buffer->offsets_size, sizeof(void *));
 
+	trace_binder_free_buf(proc, buffer);
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_free_buf %p size %zd buffer"
 		     "_size %zd\n", proc->pid, buffer, size, buffer_size);
@@ -903,11 +1441,23 @@ static void binder_free_buf(struct binder_proc *proc,
 			     proc->free_async_space);
 	}
 
+	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
+	if (binder_buffer_cache_put(proc, buffer, buffer_size))
+		return;
+	__binder_free_buf(proc, buffer, buffer_size);
+}
+
+/*
+ * Return the pages and address space of a buffer that is neither
+ * allocated nor cached to the free_buffers rbtree.
+ */
+static void __binder_free_buf(struct binder_proc *proc,
+			      struct binder_buffer *buffer, size_t buffer_size)
+{
 	binder_update_page_range(proc, 0,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
 		NULL);
-	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
 	buffer->free = 1;
 	if (!list_is_last(&buffer->entry, &proc->buffers)) {
 		struct binder_buffer *next = list_entry(buffer->entry.next,
@@ -929,6 +1479,29 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
+static void binder_buffer_cache_flush(struct binder_proc *proc)
+{
+	struct binder_buffer *buffer;
+	int i;
+
+	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: flush %d cached buffers\n",
+		     proc->pid, proc->buffer_cache_total);
+
+	for (i = 0; i < BINDER_CACHE_CLASSES; i++) {
+		while (!list_empty(&proc->buffer_cache[i])) {
+			buffer = list_first_entry(&proc->buffer_cache[i],
+				struct binder_buffer, cache_entry);
+			list_del(&buffer->cache_entry);
+			buffer->cached = 0;
+			__binder_free_buf(proc, buffer,
+					  binder_buffer_size(proc, buffer));
+		}
+		proc->buffer_cache_count[i] = 0;
+	}
+	proc->buffer_cache_total = 0;
+}
+
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
@@ -978,6 +1551,7 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
+	spin_lock_init(&node->lock);
 	node->work.type = BINDER_WORK_NODE;
 	INIT_LIST_HEAD(&node->work.entry);
 	INIT_LIST_HEAD(&node->async_todo);
@@ -988,25 +1562,31 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
+/* target_list, if given, belongs to a thread of node->proc */
 static int binder_inc_node(struct binder_node *node, int strong, int internal,
 			   struct list_head *target_list)
 {
 	if (strong) {
 		if (internal) {
+			spin_lock(&node->lock);
 			if (target_list == NULL &&
 			    node->internal_strong_refs == 0 &&
 			    !(node == binder_context_mgr_node &&
 			    node->has_strong_ref)) {
+				spin_unlock(&node->lock);
 				printk(KERN_ERR "binder: invalid inc strong "
 					"node for %d\n", node->debug_id);
 				return -EINVAL;
 			}
 			node->internal_strong_refs++;
+			spin_unlock(&node->lock);
 		} else
 			node->local_strong_refs++;
 		if (!node->has_strong_ref && target_list) {
+			spin_lock(&node->proc->todo_lock);
 			list_del_init(&node->work.entry);
 			list_add_tail(&node->work.entry, target_list);
+			spin_unlock(&node->proc->todo_lock);
 		}
 	} else {
 		if (!internal)
@@ -1017,7 +1597,9 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 					"for %d\n", node->debug_id);
 				return -EINVAL;
 			}
+			spin_lock(&node->proc->todo_lock);
 			list_add_tail(&node->work.entry, target_list);
+			spin_unlock(&node->proc->todo_lock);
 		}
 	}
 	return 0;
@@ -1026,9 +1608,11 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 static int binder_dec_node(struct binder_node *node, int strong, int internal)
 {
 	if (strong) {
-		if (internal)
+		if (internal) {
+			spin_lock(&node->lock);
 			node->internal_strong_refs--;
-		else
+			spin_unlock(&node->lock);
+		} else
 			node->local_strong_refs--;
 		if (node->local_strong_refs || node->internal_strong_refs)
 			return 0;
@@ -1039,20 +1623,25 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 			return 0;
 	}
 	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
+		spin_lock(&node->proc->todo_lock);
 		if (list_empty(&node->work.entry)) {
 			list_add_tail(&node->work.entry, &node->proc->todo);
 			wake_up_interruptible(&node->proc->wait);
 		}
+		spin_unlock(&node->proc->todo_lock);
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
 		    !node->local_weak_refs) {
-			list_del_init(&node->work.entry);
 			if (node->proc) {
+				spin_lock(&node->proc->todo_lock);
+				list_del_init(&node->work.entry);
+				spin_unlock(&node->proc->todo_lock);
 				rb_erase(&node->rb_node, &node->proc->nodes);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: refless node %d deleted\n",
 					     node->debug_id);
 			} else {
+				list_del_init(&node->work.entry);
 				hlist_del(&node->dead_node);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: dead node %d deleted\n",
@@ -1112,6 +1701,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	new_ref->debug_id = ++binder_last_id;
 	new_ref->proc = proc;
 	new_ref->node = node;
+	spin_lock(&proc->inner_lock);
 	rb_link_node(&new_ref->rb_node_node, parent, p);
 	rb_insert_color(&new_ref->rb_node_node, &proc->refs_by_node);
 
@@ -1137,6 +1727,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	}
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
+	spin_unlock(&proc->inner_lock);
 	if (node) {
 		hlist_add_head(&new_ref->node_entry, &node->refs);
 
@@ -1160,8 +1751,10 @@ static void binder_delete_ref(struct binder_ref *ref)
 		     "node %d\n", ref->proc->pid, ref->debug_id,
 		     ref->desc, ref->node->debug_id);
 
+	spin_lock(&ref->proc->inner_lock);
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+	spin_unlock(&ref->proc->inner_lock);
 	if (ref->strong)
 		binder_dec_node(ref->node, 1, 1);
 	hlist_del(&ref->node_entry);
@@ -1171,7 +1764,9 @@ static void binder_delete_ref(struct binder_ref *ref)
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
+		spin_lock(&ref->proc->todo_lock);
 		list_del(&ref->death->work.entry);
+		spin_unlock(&ref->proc->todo_lock);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1179,45 +1774,57 @@ static void binder_delete_ref(struct binder_ref *ref)
 	binder_stats_deleted(BINDER_STAT_REF);
 }
 
+/*
+ * Called with binder_main_lock held.  The count is checked and updated,
+ * together with the node when it moves to or from zero, under inner_lock
+ * so that binder_update_ref_fast cannot interleave.
+ */
 static int binder_inc_ref(struct binder_ref *ref, int strong,
 			  struct list_head *target_list)
 {
-	int ret;
+	int ret = 0;
+
+	spin_lock(&ref->proc->inner_lock);
 	if (strong) {
 		if (ref->strong == 0) {
 			ret = binder_inc_node(ref->node, 1, 1, target_list);
 			if (ret)
-				return ret;
+				goto out;
 		}
 		ref->strong++;
 	} else {
 		if (ref->weak == 0) {
 			ret = binder_inc_node(ref->node, 0, 1, target_list);
 			if (ret)
-				return ret;
+				goto out;
 		}
 		ref->weak++;
 	}
-	return 0;
+out:
+	spin_unlock(&ref->proc->inner_lock);
+	return ret;
 }
 
 
 static int binder_dec_ref(struct binder_ref *ref, int strong)
 {
+	int ret = 0;
+
+	spin_lock(&ref->proc->inner_lock);
 	if (strong) {
 		if (ref->strong == 0) {
 			binder_user_error("binder: %d invalid dec strong, "
 					  "ref %d desc %d s %d w %d\n",
 					  ref->proc->pid, ref->debug_id,
 					  ref->desc, ref->strong, ref->weak);
-			return -EINVAL;
+			ret = -EINVAL;
+			goto out;
 		}
 		ref->strong--;
 		if (ref->strong == 0) {
-			int ret;
 			ret = binder_dec_node(ref->node, strong, 1);
 			if (ret)
-				return ret;
+				goto out;
 		}
 	} else {
 		if (ref->weak == 0) {
@@ -1225,15 +1832,104 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 					  "ref %d desc %d s %d w %d\n",
 					  ref->proc->pid, ref->debug_id,
 					  ref->desc, ref->strong, ref->weak);
-			return -EINVAL;
+			ret = -EINVAL;
+			goto out;
 		}
 		ref->weak--;
 	}
-	if (ref->strong == 0 && ref->weak == 0)
+out:
+	spin_unlock(&ref->proc->inner_lock);
+	/* the fast path leaves refs with both counts zero alone */
+	if (!ret && ref->strong == 0 && ref->weak == 0)
 		binder_delete_ref(ref);
-	return 0;
+	return ret;
 }
 
+/*
+ * Handle BC_INCREFS, BC_ACQUIRE, BC_RELEASE and BC_DECREFS without
+ * binder_main_lock when the change neither moves the node's internal
+ * strong count to or from zero nor leaves the ref with both counts zero.
+ * Those cases queue node work or free objects and are left to the locked
+ * path.  Returns nonzero if the command was handled.
+ */
+static int binder_update_ref_fast(struct binder_proc *proc,
+				  struct binder_thread *thread,
+				  uint32_t cmd, uint32_t target)
+{
+	struct binder_ref *ref;
+	struct binder_node *node;
+	int done = 0;
+
+	/* desc 0 may have to be created for the context manager */
+	if (target == 0)
+		return 0;
+
+	spin_lock(&proc->inner_lock);
+	ref = binder_get_ref(proc, target);
+	if (ref == NULL)
+		goto out;
+	node = ref->node;
+	switch (cmd) {
+	case BC_INCREFS:
+		if (ref->weak > 0) {
+			ref->weak++;
+			done = 1;
+		}
+		break;
+	case BC_ACQUIRE:
+		if (ref->strong > 0) {
+			ref->strong++;
+			done = 1;
+			break;
+		}
+		/* with no weak count the ref may be about to be deleted */
+		if (ref->weak == 0)
+			break;
+		spin_lock(&node->lock);
+		if (node->internal_strong_refs > 0) {
+			node->internal_strong_refs++;
+			ref->strong++;
+			done = 1;
+		}
+		spin_unlock(&node->lock);
+		break;
+	case BC_RELEASE:
+		if (ref->strong > 1) {
+			ref->strong--;
+			done = 1;
+			break;
+		}
+		if (ref->strong == 0 || ref->weak == 0)
+			break;
+		spin_lock(&node->lock);
+		if (node->internal_strong_refs > 1) {
+			node->internal_strong_refs--;
+			ref->strong--;
+			done = 1;
+		}
+		spin_unlock(&node->lock);
+		break;
+	case BC_DECREFS:
+		if (ref->weak > 1 || (ref->weak == 1 && ref->strong > 0)) {
+			ref->weak--;
+			done = 1;
+		}
+		break;
+	}
+	if (done) {
+		atomic_inc(&binder_ref_fast_count);
+		binder_debug(BINDER_DEBUG_USER_REFS,
+			     "binder: %d:%d fast refcount %x ref %d desc %d "
+			     "s %d w %d for node %d\n",
+			     proc->pid, thread->pid, cmd, ref->debug_id,
+			     ref->desc, ref->strong, ref->weak, node->debug_id);
+	}
+out:
+	spin_unlock(&proc->inner_lock);
+	return done;
+}
+
+/* Called with target_thread->proc->todo_lock held if target_thread is set */
 static void binder_pop_transaction(struct binder_thread *target_thread,
 				   struct binder_transaction *t)
 {
@@ -1272,7 +1968,9 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 					      t->debug_id, target_thread->proc->pid,
 					      target_thread->pid);
 
+				spin_lock(&target_thread->proc->todo_lock);
 				binder_pop_transaction(target_thread, t);
+				spin_unlock(&target_thread->proc->todo_lock);
 				target_thread->return_error = error_code;
 				wake_up_interruptible(&target_thread->wait);
 			} else {
@@ -1381,9 +2079,152 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
-static void binder_transaction(struct binder_proc *proc,
-			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+/*
+ * Allocate a buffer in target_proc and copy the transaction payload into
+ * it.  Called without binder_main_lock; the caller holds a tmp_ref on
+ * target_proc so that it cannot be freed underneath us.
+ */
+static struct binder_buffer *binder_transaction_get_buf(
+	struct binder_proc *proc, struct binder_thread *thread,
+	struct binder_proc *target_proc,
+	struct binder_transaction_data *tr, int is_async)
+{
+	struct binder_buffer *buffer;
+	void *offp;
+
+	binder_alloc_lock(target_proc);
+	buffer = binder_alloc_buf(target_proc, tr->data_size,
+				  tr->offsets_size, is_async);
+	if (buffer == NULL)
+		goto out;
+
+	offp = buffer->data + ALIGN(tr->data_size, sizeof(void *));
+	if (copy_from_user(buffer->data, tr->data.ptr.buffer, tr->data_size)) {
+		binder_user_error("binder: %d:%d got transaction with invalid "
+			"data ptr\n", proc->pid, thread->pid);
+		goto err_copy_data_failed;
+	}
+	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
+		binder_user_error("binder: %d:%d got transaction with invalid "
+			"offsets ptr\n", proc->pid, thread->pid);
+		goto err_copy_data_failed;
+	}
+	goto out;
+
+err_copy_data_failed:
+	binder_free_buf(target_proc, buffer);
+	buffer = NULL;
+out:
+	binder_alloc_unlock(target_proc);
+	return buffer;
+}
+
+/*
+ * Queue t for its target and the TRANSACTION_COMPLETE for the sender,
+ * and update the transaction stacks.  in_reply_to is set for a reply.
+ * Called with the todo_lock of both procs held.
+ */
+static void binder_transaction_queue(struct binder_proc *proc,
+				     struct binder_thread *thread,
+				     struct binder_transaction *t,
+				     struct binder_work *tcomplete,
+				     struct binder_transaction *in_reply_to,
+				     struct binder_node *target_node)
+{
+	struct binder_thread *target_thread = t->to_thread;
+	struct list_head *target_list;
+	wait_queue_head_t *target_wait;
+
+	if (target_thread) {
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &t->to_proc->todo;
+		target_wait = &t->to_proc->wait;
+	}
+
+	trace_binder_transaction(in_reply_to != NULL, t, target_node);
+	if (in_reply_to) {
+		s64 call_us = ktime_us_delta(t->start_time,
+					     in_reply_to->start_time);
+
+		binder_latency_add(&proc->call_latency, call_us);
+		trace_binder_reply(in_reply_to, call_us);
+		BUG_ON(t->buffer->async_transaction != 0);
+		binder_pop_transaction(target_thread, in_reply_to);
+	} else if (!(t->flags & TF_ONE_WAY)) {
+		BUG_ON(t->buffer->async_transaction != 0);
+		t->need_reply = 1;
+		t->from_parent = thread->transaction_stack;
+		thread->transaction_stack = t;
+	} else {
+		BUG_ON(target_node == NULL);
+		BUG_ON(t->buffer->async_transaction != 1);
+		if (target_node->has_async_transaction) {
+			target_list = &target_node->async_todo;
+			target_wait = NULL;
+		} else
+			target_node->has_async_transaction = 1;
+	}
+	t->work.type = BINDER_WORK_TRANSACTION;
+	list_add_tail(&t->work.entry, target_list);
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	list_add_tail(&tcomplete->entry, &thread->todo);
+	if (target_wait)
+		wake_up_interruptible(target_wait);
+}
+
+/*
+ * Queue a transaction that carries no objects without retaking
+ * binder_main_lock.  There is nothing to translate, so only the target
+ * has to be rechecked, which the todo_locks cover: a proc is marked dead
+ * under its todo_lock before it is torn down, and a thread's stack and
+ * the from pointers to it change under it too.  Returns 0, having
+ * changed nothing, if the caller has to take the locked path instead,
+ * which then reports the error.
+ */
+static int binder_transaction_fast(struct binder_proc *proc,
+				   struct binder_thread *thread,
+				   struct binder_transaction *t,
+				   struct binder_work *tcomplete,
+				   struct binder_transaction *in_reply_to,
+				   struct binder_node *target_node,
+				   struct binder_buffer *buffer)
+{
+	struct binder_proc *target_proc = t->to_proc;
+	int done = 0;
+
+	binder_todo_lock_pair(proc, target_proc);
+	if (target_proc->is_dead)
+		goto out;
+	if (in_reply_to) {
+		if (in_reply_to->from != t->to_thread ||
+		    t->to_thread->transaction_stack != in_reply_to)
+			goto out;
+	} else if (target_node->proc != target_proc)
+		goto out;
+
+	t->buffer = buffer;
+	t->buffer->debug_id = t->debug_id;
+	t->buffer->transaction = t;
+	t->buffer->target_node = target_node;
+	trace_binder_alloc_buf(target_proc, t->buffer);
+	binder_transaction_queue(proc, thread, t, tcomplete, in_reply_to,
+				 target_node);
+	atomic_inc(&binder_transaction_fast_count);
+	done = 1;
+out:
+	binder_todo_unlock_pair(proc, target_proc);
+	return done;
+}
+
+/*
+ * Called with binder_main_lock held.  Returns 1 if the transaction was
+ * queued by binder_transaction_fast, leaving binder_main_lock released.
+ */
+static int binder_transaction(struct binder_proc *proc,
+			      struct binder_thread *thread,
+			      struct binder_transaction_data *tr, int reply)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
@@ -1391,11 +2232,11 @@ static void binder_transaction(struct binder_proc *proc,
 	struct binder_proc *target_proc;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
-	struct list_head *target_list;
-	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
+	struct binder_buffer *buffer;
 	uint32_t return_error;
+	int fast;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
@@ -1414,7 +2255,10 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		binder_set_priority(in_reply_to->saved_priority);
+		if (!binder_is_rt_policy(
+				in_reply_to->saved_priority.sched_policy))
+			thread->rt_inherited = 0;
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1428,7 +2272,9 @@ static void binder_transaction(struct binder_proc *proc,
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
+		spin_lock(&proc->todo_lock);
 		thread->transaction_stack = in_reply_to->to_parent;
+		spin_unlock(&proc->todo_lock);
 		target_thread = in_reply_to->from;
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
@@ -1487,21 +2333,8 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
-			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
-				tmp = tmp->from_parent;
-			}
 		}
 	}
-	if (target_thread) {
-		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1520,6 +2353,7 @@ static void binder_transaction(struct binder_proc *proc,
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
 	t->debug_id = ++binder_last_id;
+	t->start_time = ktime_get();
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1548,34 +2382,92 @@ static void binder_transaction(struct binder_proc *proc,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
-	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
-	if (t->buffer == NULL) {
+	t->priority = binder_current_priority();
+	if (target_thread)
+		e->to_thread = target_thread->pid;
+
+	/*
+	 * Allocating the target buffer may have to populate pages, and the
+	 * payload copy may fault, so do both without binder_main_lock.  Pin
+	 * the target node and proc across the unlocked window.  Without
+	 * objects to translate, and without a transaction stack to search
+	 * for a target thread, the transaction is then queued under the
+	 * todo_locks alone.  Otherwise everything is revalidated once
+	 * binder_main_lock is retaken.
+	 */
+	fast = tr->offsets_size == 0 &&
+		(reply || (tr->flags & TF_ONE_WAY) ||
+		 thread->transaction_stack == NULL);
+	if (target_node)
+		binder_inc_node(target_node, 1, 0, NULL);
+	binder_proc_inc_tmpref(target_proc);
+	binder_unlock();
+	buffer = binder_transaction_get_buf(proc, thread, target_proc, tr,
+		!reply && (tr->flags & TF_ONE_WAY));
+	if (fast && buffer != NULL &&
+	    binder_transaction_fast(proc, thread, t, tcomplete, in_reply_to,
+				    target_node, buffer)) {
+		binder_proc_dec_tmpref(target_proc);
+		return 1;
+	}
+	binder_lock();
+
+	if (target_proc->is_dead) {
+		/* binder_deferred_release already freed the buffer */
+		return_error = BR_DEAD_REPLY;
+		goto err_binder_alloc_buf_failed;
+	}
+	if (buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
+	if (reply) {
+		target_thread = in_reply_to->from;
+		if (target_thread == NULL) {
+			return_error = BR_DEAD_REPLY;
+			goto err_target_gone;
+		}
+		/* the caller may have exited or started a nested
+		 * transaction while the lock was dropped */
+		if (target_thread->transaction_stack != in_reply_to) {
+			binder_user_error("binder: %d:%d reply raced with "
+				"target transaction stack change %d, "
+				"expected %d\n",
+				proc->pid, thread->pid,
+				target_thread->transaction_stack ?
+				target_thread->transaction_stack->debug_id : 0,
+				in_reply_to->debug_id);
+			return_error = BR_FAILED_REPLY;
+			in_reply_to = NULL;
+			target_thread = NULL;
+			goto err_target_gone;
+		}
+	} else {
+		if (target_node->proc != target_proc) {
+			return_error = BR_DEAD_REPLY;
+			goto err_target_gone;
+		}
+		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
+			struct binder_transaction *tmp;
+			tmp = thread->transaction_stack;
+			while (tmp) {
+				if (tmp->from && tmp->from->proc == target_proc)
+					target_thread = tmp->from;
+				tmp = tmp->from_parent;
+			}
+		}
+	}
+	if (target_thread)
+		e->to_thread = target_thread->pid;
+	t->to_thread = target_thread;
+	t->buffer = buffer;
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
+	trace_binder_alloc_buf(target_proc, t->buffer);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
-	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
-	}
 	if (!IS_ALIGNED(tr->offsets_size, sizeof(size_t))) {
 		binder_user_error("binder: %d:%d got transaction with "
 			"invalid offsets size, %zd\n",
@@ -1722,30 +2614,12 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
-	if (reply) {
-		BUG_ON(t->buffer->async_transaction != 0);
-		binder_pop_transaction(target_thread, in_reply_to);
-	} else if (!(t->flags & TF_ONE_WAY)) {
-		BUG_ON(t->buffer->async_transaction != 0);
-		t->need_reply = 1;
-		t->from_parent = thread->transaction_stack;
-		thread->transaction_stack = t;
-	} else {
-		BUG_ON(target_node == NULL);
-		BUG_ON(t->buffer->async_transaction != 1);
-		if (target_node->has_async_transaction) {
-			target_list = &target_node->async_todo;
-			target_wait = NULL;
-		} else
-			target_node->has_async_transaction = 1;
-	}
-	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
-		wake_up_interruptible(target_wait);
-	return;
+	binder_todo_lock_pair(proc, target_proc);
+	binder_transaction_queue(proc, thread, t, tcomplete, in_reply_to,
+				 target_node);
+	binder_todo_unlock_pair(proc, target_proc);
+	binder_proc_dec_tmpref(target_proc);
+	return 0;
 
 err_get_unused_fd_failed:
 err_fget_failed:
@@ -1755,11 +2629,21 @@ err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
-err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
+	binder_alloc_lock(target_proc);
 	binder_free_buf(target_proc, t->buffer);
+	binder_alloc_unlock(target_proc);
+	goto err_put_target_proc;
+err_target_gone:
+	binder_alloc_lock(target_proc);
+	binder_free_buf(target_proc, buffer);
+	binder_alloc_unlock(target_proc);
 err_binder_alloc_buf_failed:
+	if (target_node)
+		binder_dec_node(target_node, 1, 0);
+err_put_target_proc:
+	binder_proc_dec_tmpref(target_proc);
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
@@ -1788,373 +2672,343 @@ err_no_context_mgr_node:
 		binder_send_failed_reply(in_reply_to, return_error);
 	} else
 		thread->return_error = return_error;
+	return 0;
 }
 
-int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
-			void __user *buffer, int size, signed long *consumed)
+/*
+ * Called with binder_main_lock held, *pptr points past the command.
+ * Returns 1 if binder_transaction left binder_main_lock released.
+ */
+static int binder_thread_write_cmd(struct binder_proc *proc,
+				   struct binder_thread *thread,
+				   uint32_t cmd, void __user **pptr)
 {
-	uint32_t cmd;
-	void __user *ptr = buffer + *consumed;
-	void __user *end = buffer + size;
+	void __user *ptr = *pptr;
 
-	while (ptr < end && thread->return_error == BR_OK) {
-		if (get_user(cmd, (uint32_t __user *)ptr))
+	switch (cmd) {
+	case BC_INCREFS:
+	case BC_ACQUIRE:
+	case BC_RELEASE:
+	case BC_DECREFS: {
+		uint32_t target;
+		struct binder_ref *ref;
+		const char *debug_string;
+
+		if (get_user(target, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
-		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+		if (target == 0 && binder_context_mgr_node &&
+		    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
+			ref = binder_get_ref_for_node(proc,
+				       binder_context_mgr_node);
+			if (ref->desc != target) {
+				binder_user_error("binder: %d:"
+					"%d tried to acquire "
+					"reference to desc 0, "
+					"got %d instead\n",
+					proc->pid, thread->pid,
+					ref->desc);
+			}
+		} else
+			ref = binder_get_ref(proc, target);
+		if (ref == NULL) {
+			binder_user_error("binder: %d:%d refcou"
+				"nt change on invalid ref %d\n",
+				proc->pid, thread->pid, target);
+			break;
 		}
 		switch (cmd) {
 		case BC_INCREFS:
+			debug_string = "IncRefs";
+			binder_inc_ref(ref, 0, NULL);
+			break;
 		case BC_ACQUIRE:
+			debug_string = "Acquire";
+			binder_inc_ref(ref, 1, NULL);
+			break;
 		case BC_RELEASE:
-		case BC_DECREFS: {
-			uint32_t target;
-			struct binder_ref *ref;
-			const char *debug_string;
-
-			if (get_user(target, (uint32_t __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(uint32_t);
-			if (target == 0 && binder_context_mgr_node &&
-			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
-				ref = binder_get_ref_for_node(proc,
-					       binder_context_mgr_node);
-				if (ref->desc != target) {
-					binder_user_error("binder: %d:"
-						"%d tried to acquire "
-						"reference to desc 0, "
-						"got %d instead\n",
-						proc->pid, thread->pid,
-						ref->desc);
-				}
-			} else
-				ref = binder_get_ref(proc, target);
-			if (ref == NULL) {
-				binder_user_error("binder: %d:%d refcou"
-					"nt change on invalid ref %d\n",
-					proc->pid, thread->pid, target);
-				break;
-			}
-			switch (cmd) {
-			case BC_INCREFS:
-				debug_string = "IncRefs";
-				binder_inc_ref(ref, 0, NULL);
-				break;
-			case BC_ACQUIRE:
-				debug_string = "Acquire";
-				binder_inc_ref(ref, 1, NULL);
-				break;
-			case BC_RELEASE:
-				debug_string = "Release";
-				binder_dec_ref(ref, 1);
-				break;
-			case BC_DECREFS:
-			default:
-				debug_string = "DecRefs";
-				binder_dec_ref(ref, 0);
-				break;
-			}
-			binder_debug(BINDER_DEBUG_USER_REFS,
-				     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
-				     proc->pid, thread->pid, debug_string, ref->debug_id,
-				     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			debug_string = "Release";
+			binder_dec_ref(ref, 1);
+			break;
+		case BC_DECREFS:
+		default:
+			debug_string = "DecRefs";
+			binder_dec_ref(ref, 0);
 			break;
 		}
-		case BC_INCREFS_DONE:
-		case BC_ACQUIRE_DONE: {
-			void __user *node_ptr;
-			void *cookie;
-			struct binder_node *node;
+		binder_debug(BINDER_DEBUG_USER_REFS,
+			     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
+			     proc->pid, thread->pid, debug_string, ref->debug_id,
+			     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+		break;
+	}
+	case BC_INCREFS_DONE:
+	case BC_ACQUIRE_DONE: {
+		void __user *node_ptr;
+		void *cookie;
+		struct binder_node *node;
 
-			if (get_user(node_ptr, (void * __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(void *);
-			if (get_user(cookie, (void * __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(void *);
-			node = binder_get_node(proc, node_ptr);
-			if (node == NULL) {
+		if (get_user(node_ptr, (void * __user *)ptr))
+			return -EFAULT;
+		ptr += sizeof(void *);
+		if (get_user(cookie, (void * __user *)ptr))
+			return -EFAULT;
+		ptr += sizeof(void *);
+		node = binder_get_node(proc, node_ptr);
+		if (node == NULL) {
+			binder_user_error("binder: %d:%d "
+				"%s u%p no match\n",
+				proc->pid, thread->pid,
+				cmd == BC_INCREFS_DONE ?
+				"BC_INCREFS_DONE" :
+				"BC_ACQUIRE_DONE",
+				node_ptr);
+			break;
+		}
+		if (cookie != node->cookie) {
+			binder_user_error("binder: %d:%d %s u%p node %d"
+				" cookie mismatch %p != %p\n",
+				proc->pid, thread->pid,
+				cmd == BC_INCREFS_DONE ?
+				"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
+				node_ptr, node->debug_id,
+				cookie, node->cookie);
+			break;
+		}
+		if (cmd == BC_ACQUIRE_DONE) {
+			if (node->pending_strong_ref == 0) {
 				binder_user_error("binder: %d:%d "
-					"%s u%p no match\n",
+					"BC_ACQUIRE_DONE node %d has "
+					"no pending acquire request\n",
 					proc->pid, thread->pid,
-					cmd == BC_INCREFS_DONE ?
-					"BC_INCREFS_DONE" :
-					"BC_ACQUIRE_DONE",
-					node_ptr);
+					node->debug_id);
 				break;
 			}
-			if (cookie != node->cookie) {
-				binder_user_error("binder: %d:%d %s u%p node %d"
-					" cookie mismatch %p != %p\n",
+			node->pending_strong_ref = 0;
+		} else {
+			if (node->pending_weak_ref == 0) {
+				binder_user_error("binder: %d:%d "
+					"BC_INCREFS_DONE node %d has "
+					"no pending increfs request\n",
 					proc->pid, thread->pid,
-					cmd == BC_INCREFS_DONE ?
-					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
-					node_ptr, node->debug_id,
-					cookie, node->cookie);
+					node->debug_id);
 				break;
 			}
-			if (cmd == BC_ACQUIRE_DONE) {
-				if (node->pending_strong_ref == 0) {
-					binder_user_error("binder: %d:%d "
-						"BC_ACQUIRE_DONE node %d has "
-						"no pending acquire request\n",
-						proc->pid, thread->pid,
-						node->debug_id);
-					break;
-				}
-				node->pending_strong_ref = 0;
-			} else {
-				if (node->pending_weak_ref == 0) {
-					binder_user_error("binder: %d:%d "
-						"BC_INCREFS_DONE node %d has "
-						"no pending increfs request\n",
-						proc->pid, thread->pid,
-						node->debug_id);
-					break;
-				}
-				node->pending_weak_ref = 0;
-			}
-			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
-			binder_debug(BINDER_DEBUG_USER_REFS,
-				     "binder: %d:%d %s node %d ls %d lw %d\n",
-				     proc->pid, thread->pid,
-				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
-				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			node->pending_weak_ref = 0;
+		}
+		binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
+		binder_debug(BINDER_DEBUG_USER_REFS,
+			     "binder: %d:%d %s node %d ls %d lw %d\n",
+			     proc->pid, thread->pid,
+			     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
+			     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+		break;
+	}
+	case BC_ATTEMPT_ACQUIRE:
+		printk(KERN_ERR "binder: BC_ATTEMPT_ACQUIRE not supported\n");
+		return -EINVAL;
+	case BC_ACQUIRE_RESULT:
+		printk(KERN_ERR "binder: BC_ACQUIRE_RESULT not supported\n");
+		return -EINVAL;
+
+	case BC_FREE_BUFFER: {
+		void __user *data_ptr;
+		struct binder_buffer *buffer;
+
+		if (get_user(data_ptr, (void * __user *)ptr))
+			return -EFAULT;
+		ptr += sizeof(void *);
+
+		binder_alloc_lock(proc);
+		buffer = binder_buffer_lookup(proc, data_ptr);
+		if (buffer == NULL) {
+			binder_alloc_unlock(proc);
+			binder_user_error("binder: %d:%d "
+				"BC_FREE_BUFFER u%p no match\n",
+				proc->pid, thread->pid, data_ptr);
+			break;
+		}
+		if (!buffer->allow_user_free) {
+			binder_alloc_unlock(proc);
+			binder_user_error("binder: %d:%d "
+				"BC_FREE_BUFFER u%p matched "
+				"unreturned buffer\n",
+				proc->pid, thread->pid, data_ptr);
 			break;
 		}
-		case BC_ATTEMPT_ACQUIRE:
-			printk(KERN_ERR "binder: BC_ATTEMPT_ACQUIRE not supported\n");
-			return -EINVAL;
-		case BC_ACQUIRE_RESULT:
-			printk(KERN_ERR "binder: BC_ACQUIRE_RESULT not supported\n");
-			return -EINVAL;
+		/* claim the buffer so a racing free cannot match it */
+		buffer->allow_user_free = 0;
+		binder_alloc_unlock(proc);
+		binder_debug(BINDER_DEBUG_FREE_BUFFER,
+			     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
+			     proc->pid, thread->pid, data_ptr, buffer->debug_id,
+			     buffer->transaction ? "active" : "finished");
+
+		if (buffer->transaction) {
+			buffer->transaction->buffer = NULL;
+			buffer->transaction = NULL;
+		}
+		if (buffer->async_transaction && buffer->target_node) {
+			spin_lock(&proc->todo_lock);
+			BUG_ON(!buffer->target_node->has_async_transaction);
+			if (list_empty(&buffer->target_node->async_todo))
+				buffer->target_node->has_async_transaction = 0;
+			else
+				list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+			spin_unlock(&proc->todo_lock);
+		}
+		binder_transaction_buffer_release(proc, buffer, NULL);
+		binder_unlock();
+		binder_alloc_lock(proc);
+		binder_free_buf(proc, buffer);
+		binder_alloc_unlock(proc);
+		binder_lock();
+		break;
+	}
 
-		case BC_FREE_BUFFER: {
-			void __user *data_ptr;
-			struct binder_buffer *buffer;
+	case BC_TRANSACTION:
+	case BC_REPLY: {
+		struct binder_transaction_data tr;
 
-			if (get_user(data_ptr, (void * __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(void *);
+		if (copy_from_user(&tr, ptr, sizeof(tr)))
+			return -EFAULT;
+		ptr += sizeof(tr);
+		*pptr = ptr;
+		return binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+	}
 
-			buffer = binder_buffer_lookup(proc, data_ptr);
-			if (buffer == NULL) {
-				binder_user_error("binder: %d:%d "
-					"BC_FREE_BUFFER u%p no match\n",
-					proc->pid, thread->pid, data_ptr);
-				break;
-			}
-			if (!buffer->allow_user_free) {
-				binder_user_error("binder: %d:%d "
-					"BC_FREE_BUFFER u%p matched "
-					"unreturned buffer\n",
-					proc->pid, thread->pid, data_ptr);
-				break;
-			}
-			binder_debug(BINDER_DEBUG_FREE_BUFFER,
-				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
-				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
-				     buffer->transaction ? "active" : "finished");
-
-			if (buffer->transaction) {
-				buffer->transaction->buffer = NULL;
-				buffer->transaction = NULL;
-			}
-			if (buffer->async_transaction && buffer->target_node) {
-				BUG_ON(!buffer->target_node->has_async_transaction);
-				if (list_empty(&buffer->target_node->async_todo))
-					buffer->target_node->has_async_transaction = 0;
-				else
-					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
-			}
-			binder_transaction_buffer_release(proc, buffer, NULL);
-			binder_free_buf(proc, buffer);
-			break;
+	case BC_REGISTER_LOOPER:
+		binder_debug(BINDER_DEBUG_THREADS,
+			     "binder: %d:%d BC_REGISTER_LOOPER\n",
+			     proc->pid, thread->pid);
+		if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
+			thread->looper |= BINDER_LOOPER_STATE_INVALID;
+			binder_user_error("binder: %d:%d ERROR:"
+				" BC_REGISTER_LOOPER called "
+				"after BC_ENTER_LOOPER\n",
+				proc->pid, thread->pid);
+		} else if (proc->requested_threads == 0) {
+			thread->looper |= BINDER_LOOPER_STATE_INVALID;
+			binder_user_error("binder: %d:%d ERROR:"
+				" BC_REGISTER_LOOPER called "
+				"without request\n",
+				proc->pid, thread->pid);
+		} else {
+			proc->requested_threads--;
+			proc->requested_threads_started++;
+		}
+		thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+		break;
+	case BC_ENTER_LOOPER:
+		binder_debug(BINDER_DEBUG_THREADS,
+			     "binder: %d:%d BC_ENTER_LOOPER\n",
+			     proc->pid, thread->pid);
+		if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
+			thread->looper |= BINDER_LOOPER_STATE_INVALID;
+			binder_user_error("binder: %d:%d ERROR:"
+				" BC_ENTER_LOOPER called after "
+				"BC_REGISTER_LOOPER\n",
+				proc->pid, thread->pid);
 		}
+		thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+		break;
+	case BC_EXIT_LOOPER:
+		binder_debug(BINDER_DEBUG_THREADS,
+			     "binder: %d:%d BC_EXIT_LOOPER\n",
+			     proc->pid, thread->pid);
+		thread->looper |= BINDER_LOOPER_STATE_EXITED;
+		break;
 
-		case BC_TRANSACTION:
-		case BC_REPLY: {
-			struct binder_transaction_data tr;
+	case BC_REQUEST_DEATH_NOTIFICATION:
+	case BC_CLEAR_DEATH_NOTIFICATION: {
+		uint32_t target;
+		void __user *cookie;
+		struct binder_ref *ref;
+		struct binder_ref_death *death;
 
-			if (copy_from_user(&tr, ptr, sizeof(tr)))
-				return -EFAULT;
-			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+		if (get_user(target, (uint32_t __user *)ptr))
+			return -EFAULT;
+		ptr += sizeof(uint32_t);
+		if (get_user(cookie, (void __user * __user *)ptr))
+			return -EFAULT;
+		ptr += sizeof(void *);
+		ref = binder_get_ref(proc, target);
+		if (ref == NULL) {
+			binder_user_error("binder: %d:%d %s "
+				"invalid ref %d\n",
+				proc->pid, thread->pid,
+				cmd == BC_REQUEST_DEATH_NOTIFICATION ?
+				"BC_REQUEST_DEATH_NOTIFICATION" :
+				"BC_CLEAR_DEATH_NOTIFICATION",
+				target);
 			break;
 		}
 
-		case BC_REGISTER_LOOPER:
-			binder_debug(BINDER_DEBUG_THREADS,
-				     "binder: %d:%d BC_REGISTER_LOOPER\n",
-				     proc->pid, thread->pid);
-			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
-				thread->looper |= BINDER_LOOPER_STATE_INVALID;
-				binder_user_error("binder: %d:%d ERROR:"
-					" BC_REGISTER_LOOPER called "
-					"after BC_ENTER_LOOPER\n",
-					proc->pid, thread->pid);
-			} else if (proc->requested_threads == 0) {
-				thread->looper |= BINDER_LOOPER_STATE_INVALID;
-				binder_user_error("binder: %d:%d ERROR:"
-					" BC_REGISTER_LOOPER called "
-					"without request\n",
-					proc->pid, thread->pid);
-			} else {
-				proc->requested_threads--;
-				proc->requested_threads_started++;
-			}
-			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
-			break;
-		case BC_ENTER_LOOPER:
-			binder_debug(BINDER_DEBUG_THREADS,
-				     "binder: %d:%d BC_ENTER_LOOPER\n",
-				     proc->pid, thread->pid);
-			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
-				thread->looper |= BINDER_LOOPER_STATE_INVALID;
-				binder_user_error("binder: %d:%d ERROR:"
-					" BC_ENTER_LOOPER called after "
-					"BC_REGISTER_LOOPER\n",
+		binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
+			     "binder: %d:%d %s %p ref %d desc %d s %d w %d for node %d\n",
+			     proc->pid, thread->pid,
+			     cmd == BC_REQUEST_DEATH_NOTIFICATION ?
+			     "BC_REQUEST_DEATH_NOTIFICATION" :
+			     "BC_CLEAR_DEATH_NOTIFICATION",
+			     cookie, ref->debug_id, ref->desc,
+			     ref->strong, ref->weak, ref->node->debug_id);
+
+		if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
+			if (ref->death) {
+				binder_user_error("binder: %d:%"
+					"d BC_REQUEST_DEATH_NOTI"
+					"FICATION death notific"
+					"ation already set\n",
 					proc->pid, thread->pid);
+				break;
 			}
-			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
-			break;
-		case BC_EXIT_LOOPER:
-			binder_debug(BINDER_DEBUG_THREADS,
-				     "binder: %d:%d BC_EXIT_LOOPER\n",
-				     proc->pid, thread->pid);
-			thread->looper |= BINDER_LOOPER_STATE_EXITED;
-			break;
-
-		case BC_REQUEST_DEATH_NOTIFICATION:
-		case BC_CLEAR_DEATH_NOTIFICATION: {
-			uint32_t target;
-			void __user *cookie;
-			struct binder_ref *ref;
-			struct binder_ref_death *death;
-
-			if (get_user(target, (uint32_t __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(uint32_t);
-			if (get_user(cookie, (void __user * __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(void *);
-			ref = binder_get_ref(proc, target);
-			if (ref == NULL) {
-				binder_user_error("binder: %d:%d %s "
-					"invalid ref %d\n",
-					proc->pid, thread->pid,
-					cmd == BC_REQUEST_DEATH_NOTIFICATION ?
-					"BC_REQUEST_DEATH_NOTIFICATION" :
-					"BC_CLEAR_DEATH_NOTIFICATION",
-					target);
+			death = kzalloc(sizeof(*death), GFP_KERNEL);
+			if (death == NULL) {
+				thread->return_error = BR_ERROR;
+				binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
+					     "binder: %d:%d "
+					     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
+					     proc->pid, thread->pid);
 				break;
 			}
-
-			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
-				     "binder: %d:%d %s %p ref %d desc %d s %d w %d for node %d\n",
-				     proc->pid, thread->pid,
-				     cmd == BC_REQUEST_DEATH_NOTIFICATION ?
-				     "BC_REQUEST_DEATH_NOTIFICATION" :
-				     "BC_CLEAR_DEATH_NOTIFICATION",
-				     cookie, ref->debug_id, ref->desc,
-				     ref->strong, ref->weak, ref->node->debug_id);
-
-			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
-				if (ref->death) {
-					binder_user_error("binder: %d:%"
-						"d BC_REQUEST_DEATH_NOTI"
-						"FICATION death notific"
-						"ation already set\n",
-						proc->pid, thread->pid);
-					break;
-				}
-				death = kzalloc(sizeof(*death), GFP_KERNEL);
-				if (death == NULL) {
-					thread->return_error = BR_ERROR;
-					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
-						     "binder: %d:%d "
-						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
-						     proc->pid, thread->pid);
-					break;
-				}
-				binder_stats_created(BINDER_STAT_DEATH);
-				INIT_LIST_HEAD(&death->work.entry);
-				death->cookie = cookie;
-				ref->death = death;
-				if (ref->node->proc == NULL) {
-					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
-					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
-						list_add_tail(&ref->death->work.entry, &thread->todo);
-					} else {
-						list_add_tail(&ref->death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
-					}
-				}
-			} else {
-				if (ref->death == NULL) {
-					binder_user_error("binder: %d:%"
-						"d BC_CLEAR_DEATH_NOTIFI"
-						"CATION death notificat"
-						"ion not active\n",
-						proc->pid, thread->pid);
-					break;
-				}
-				death = ref->death;
-				if (death->cookie != cookie) {
-					binder_user_error("binder: %d:%"
-						"d BC_CLEAR_DEATH_NOTIFI"
-						"CATION death notificat"
-						"ion cookie mismatch "
-						"%p != %p\n",
-						proc->pid, thread->pid,
-						death->cookie, cookie);
-					break;
-				}
-				ref->death = NULL;
-				if (list_empty(&death->work.entry)) {
-					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
-					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
-						list_add_tail(&death->work.entry, &thread->todo);
-					} else {
-						list_add_tail(&death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
-					}
+			binder_stats_created(BINDER_STAT_DEATH);
+			INIT_LIST_HEAD(&death->work.entry);
+			death->cookie = cookie;
+			ref->death = death;
+			if (ref->node->proc == NULL) {
+				ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+				spin_lock(&proc->todo_lock);
+				if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
+					list_add_tail(&ref->death->work.entry, &thread->todo);
 				} else {
-					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
-					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
+					list_add_tail(&ref->death->work.entry, &proc->todo);
+					wake_up_interruptible(&proc->wait);
 				}
+				spin_unlock(&proc->todo_lock);
 			}
-		} break;
-		case BC_DEAD_BINDER_DONE: {
-			struct binder_work *w;
-			void __user *cookie;
-			struct binder_ref_death *death = NULL;
-			if (get_user(cookie, (void __user * __user *)ptr))
-				return -EFAULT;
-
-			ptr += sizeof(void *);
-			list_for_each_entry(w, &proc->delivered_death, entry) {
-				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
-				if (tmp_death->cookie == cookie) {
-					death = tmp_death;
-					break;
-				}
+		} else {
+			if (ref->death == NULL) {
+				binder_user_error("binder: %d:%"
+					"d BC_CLEAR_DEATH_NOTIFI"
+					"CATION death notificat"
+					"ion not active\n",
+					proc->pid, thread->pid);
+				break;
 			}
-			binder_debug(BINDER_DEBUG_DEAD_BINDER,
-				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
-				     proc->pid, thread->pid, cookie, death);
-			if (death == NULL) {
-				binder_user_error("binder: %d:%d BC_DEAD"
-					"_BINDER_DONE %p not found\n",
-					proc->pid, thread->pid, cookie);
+			death = ref->death;
+			if (death->cookie != cookie) {
+				binder_user_error("binder: %d:%"
+					"d BC_CLEAR_DEATH_NOTIFI"
+					"CATION death notificat"
+					"ion cookie mismatch "
+					"%p != %p\n",
+					proc->pid, thread->pid,
+					death->cookie, cookie);
 				break;
 			}
-
-			list_del_init(&death->work.entry);
-			if (death->work.type == BINDER_WORK_DEAD_BINDER_AND_CLEAR) {
+			ref->death = NULL;
+			spin_lock(&proc->todo_lock);
+			if (list_empty(&death->work.entry)) {
 				death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 				if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 					list_add_tail(&death->work.entry, &thread->todo);
@@ -2162,14 +3016,103 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_add_tail(&death->work.entry, &proc->todo);
 					wake_up_interruptible(&proc->wait);
 				}
+			} else {
+				BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
+				death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 			}
-		} break;
+			spin_unlock(&proc->todo_lock);
+		}
+	} break;
+	case BC_DEAD_BINDER_DONE: {
+		struct binder_work *w;
+		void __user *cookie;
+		struct binder_ref_death *death = NULL;
+		if (get_user(cookie, (void __user * __user *)ptr))
+			return -EFAULT;
 
-		default:
-			printk(KERN_ERR "binder: %d:%d unknown command %d\n",
-			       proc->pid, thread->pid, cmd);
-			return -EINVAL;
+		ptr += sizeof(void *);
+		list_for_each_entry(w, &proc->delivered_death, entry) {
+			struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
+			if (tmp_death->cookie == cookie) {
+				death = tmp_death;
+				break;
+			}
+		}
+		binder_debug(BINDER_DEBUG_DEAD_BINDER,
+			     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
+			     proc->pid, thread->pid, cookie, death);
+		if (death == NULL) {
+			binder_user_error("binder: %d:%d BC_DEAD"
+				"_BINDER_DONE %p not found\n",
+				proc->pid, thread->pid, cookie);
+			break;
+		}
+
+		spin_lock(&proc->todo_lock);
+		list_del_init(&death->work.entry);
+		if (death->work.type == BINDER_WORK_DEAD_BINDER_AND_CLEAR) {
+			death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
+			if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
+				list_add_tail(&death->work.entry, &thread->todo);
+			} else {
+				list_add_tail(&death->work.entry, &proc->todo);
+				wake_up_interruptible(&proc->wait);
+			}
+		}
+		spin_unlock(&proc->todo_lock);
+	} break;
+
+	default:
+		printk(KERN_ERR "binder: %d:%d unknown command %d\n",
+		       proc->pid, thread->pid, cmd);
+		return -EINVAL;
+	}
+	*pptr = ptr;
+	return 0;
+}
+
+/*
+ * Commands are handled one at a time under binder_main_lock, dropping it
+ * in between, so that fetching them from userspace and the refcount fast
+ * path run without it.  A transaction without objects only holds it to
+ * look up its target.
+ */
+int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
+			void __user *buffer, int size, signed long *consumed)
+{
+	uint32_t cmd;
+	uint32_t target;
+	void __user *ptr = buffer + *consumed;
+	void __user *end = buffer + size;
+	int ret;
+
+	while (ptr < end && thread->return_error == BR_OK) {
+		if (get_user(cmd, (uint32_t __user *)ptr))
+			return -EFAULT;
+		ptr += sizeof(uint32_t);
+		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
+		}
+		if (cmd == BC_INCREFS || cmd == BC_ACQUIRE ||
+		    cmd == BC_RELEASE || cmd == BC_DECREFS) {
+			if (get_user(target, (uint32_t __user *)ptr))
+				return -EFAULT;
+			if (binder_update_ref_fast(proc, thread, cmd, target)) {
+				ptr += sizeof(uint32_t);
+				*consumed = ptr - buffer;
+				continue;
+			}
 		}
+		binder_lock();
+		ret = binder_thread_write_cmd(proc, thread, cmd, &ptr);
+		if (ret > 0)
+			ret = 0;
+		else
+			binder_unlock();
+		if (ret)
+			return ret;
 		*consumed = ptr - buffer;
 	}
 	return 0;
@@ -2179,9 +3122,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2216,8 +3159,10 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	spin_lock(&proc->todo_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
+	spin_unlock(&proc->todo_lock);
 
 	if (thread->return_error != BR_OK && ptr < end) {
 		if (thread->return_error2 != BR_OK) {
@@ -2239,7 +3184,7 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	binder_unlock();
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2250,7 +3195,13 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		/* drop what was inherited, but leave a thread that made
+		 * itself real-time alone */
+		if (thread->rt_inherited ||
+		    !binder_is_rt_policy(current->policy)) {
+			binder_set_priority(proc->default_priority);
+			thread->rt_inherited = 0;
+		}
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
@@ -2263,7 +3214,7 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	binder_lock();
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
@@ -2277,11 +3228,19 @@ retry:
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
 
+		/*
+		 * binder_transaction_fast changes the lists without
+		 * binder_main_lock, but it only ever adds to them.
+		 */
+		spin_lock(&proc->todo_lock);
 		if (!list_empty(&thread->todo))
 			w = list_first_entry(&thread->todo, struct binder_work, entry);
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
 			w = list_first_entry(&proc->todo, struct binder_work, entry);
-		else {
+		else
+			w = NULL;
+		spin_unlock(&proc->todo_lock);
+		if (w == NULL) {
 			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
 				goto retry;
 			break;
@@ -2305,7 +3264,9 @@ retry:
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
 
+			spin_lock(&proc->todo_lock);
 			list_del(&w->entry);
+			spin_unlock(&proc->todo_lock);
 			kfree(w);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
@@ -2352,7 +3313,9 @@ retry:
 					     "binder: %d:%d %s %d u%p c%p\n",
 					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
 			} else {
+				spin_lock(&proc->todo_lock);
 				list_del_init(&w->entry);
+				spin_unlock(&proc->todo_lock);
 				if (!weak && !strong) {
 					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 						     "binder: %d:%d node %d u%p c%p deleted\n",
@@ -2394,12 +3357,16 @@ retry:
 				      "BR_CLEAR_DEATH_NOTIFICATION_DONE",
 				      death->cookie);
 
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
+			spin_lock(&proc->todo_lock);
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
 				list_del(&w->entry);
+			else
+				list_move(&w->entry, &proc->delivered_death);
+			spin_unlock(&proc->todo_lock);
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
 				kfree(death);
 				binder_stats_deleted(BINDER_STAT_DEATH);
-			} else
-				list_move(&w->entry, &proc->delivered_death);
+			}
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
@@ -2409,16 +3376,30 @@ retry:
 			continue;
 
 		BUG_ON(t->buffer == NULL);
+		{
+			s64 wait_us = ktime_us_delta(ktime_get(),
+						     t->start_time);
+
+			binder_latency_add(&proc->wakeup_latency, wait_us);
+			trace_binder_transaction_received(t, wait_us);
+		}
 		if (t->buffer->target_node) {
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
+			t->saved_priority = binder_current_priority();
+			if (binder_is_rt_policy(t->priority.sched_policy) &&
+			    !(t->flags & TF_ONE_WAY)) {
+				if (!binder_is_rt_policy(
+					t->saved_priority.sched_policy))
+					thread->rt_inherited = 1;
+				binder_set_priority(t->priority);
+			} else if (t->priority.prio < target_node->min_priority &&
+				 !(t->flags & TF_ONE_WAY))
+				binder_set_nice(t->priority.prio);
 			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
+				 t->saved_priority.prio >
+				 target_node->min_priority)
 				binder_set_nice(target_node->min_priority);
 			cmd = BR_TRANSACTION;
 		} else {
@@ -2465,13 +3446,16 @@ retry:
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
+		spin_lock(&proc->todo_lock);
 		list_del(&t->work.entry);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
 			thread->transaction_stack = t;
+			spin_unlock(&proc->todo_lock);
 		} else {
+			spin_unlock(&proc->todo_lock);
 			t->buffer->transaction = NULL;
 			kfree(t);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION);
@@ -2497,11 +3481,21 @@ done:
 	return 0;
 }
 
-static void binder_release_work(struct list_head *list)
+/*
+ * Called once nothing can queue more work on list, which is proc->todo
+ * or the todo list of one of its threads.
+ */
+static void binder_release_work(struct binder_proc *proc,
+				struct list_head *list)
 {
 	struct binder_work *w;
-	while (!list_empty(list)) {
-		w = list_first_entry(list, struct binder_work, entry);
+	LIST_HEAD(work);
+
+	spin_lock(&proc->todo_lock);
+	list_splice_init(list, &work);
+	spin_unlock(&proc->todo_lock);
+	while (!list_empty(&work)) {
+		w = list_first_entry(&work, struct binder_work, entry);
 		list_del_init(&w->entry);
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
@@ -2522,9 +3516,15 @@ static void binder_release_work(struct list_head *list)
 
 }
 
-static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+/*
+ * Called with inner_lock held.  Returns the thread for current, or the
+ * insertion point for it in *pp and *pparent.
+ */
+static struct binder_thread *binder_lookup_thread(struct binder_proc *proc,
+						  struct rb_node ***pp,
+						  struct rb_node **pparent)
 {
-	struct binder_thread *thread = NULL;
+	struct binder_thread *thread;
 	struct rb_node *parent = NULL;
 	struct rb_node **p = &proc->threads.rb_node;
 
@@ -2537,23 +3537,46 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		else if (current->pid > thread->pid)
 			p = &(*p)->rb_right;
 		else
-			break;
-	}
-	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
-			return NULL;
-		binder_stats_created(BINDER_STAT_THREAD);
-		thread->proc = proc;
-		thread->pid = current->pid;
-		init_waitqueue_head(&thread->wait);
-		INIT_LIST_HEAD(&thread->todo);
-		rb_link_node(&thread->rb_node, parent, p);
-		rb_insert_color(&thread->rb_node, &proc->threads);
-		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
-		thread->return_error = BR_OK;
-		thread->return_error2 = BR_OK;
+			return thread;
 	}
+	*pp = p;
+	*pparent = parent;
+	return NULL;
+}
+
+/*
+ * Only current ever inserts its own thread, so the lookup can be redone
+ * after allocating without anyone else having added it meanwhile.
+ */
+static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	struct rb_node *parent;
+	struct rb_node **p;
+
+	spin_lock(&proc->inner_lock);
+	thread = binder_lookup_thread(proc, &p, &parent);
+	spin_unlock(&proc->inner_lock);
+	if (thread)
+		return thread;
+
+	thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+	if (thread == NULL)
+		return NULL;
+	binder_stats_created(BINDER_STAT_THREAD);
+	thread->proc = proc;
+	thread->pid = current->pid;
+	init_waitqueue_head(&thread->wait);
+	INIT_LIST_HEAD(&thread->todo);
+	thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
+	thread->return_error = BR_OK;
+	thread->return_error2 = BR_OK;
+
+	spin_lock(&proc->inner_lock);
+	BUG_ON(binder_lookup_thread(proc, &p, &parent));
+	rb_link_node(&thread->rb_node, parent, p);
+	rb_insert_color(&thread->rb_node, &proc->threads);
+	spin_unlock(&proc->inner_lock);
 	return thread;
 }
 
@@ -2564,7 +3587,11 @@ static int binder_free_thread(struct binder_proc *proc,
 	struct binder_transaction *send_reply = NULL;
 	int active_transactions = 0;
 
+	spin_lock(&proc->inner_lock);
 	rb_erase(&thread->rb_node, &proc->threads);
+	spin_unlock(&proc->inner_lock);
+	/* once from is cleared no reply can be queued for us */
+	spin_lock(&proc->todo_lock);
 	t = thread->transaction_stack;
 	if (t && t->to_thread == thread)
 		send_reply = t;
@@ -2590,9 +3617,10 @@ static int binder_free_thread(struct binder_proc *proc,
 		} else
 			BUG();
 	}
+	spin_unlock(&proc->todo_lock);
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
-	binder_release_work(&thread->todo);
+	binder_release_work(proc, &thread->todo);
 	kfree(thread);
 	binder_stats_deleted(BINDER_STAT_THREAD);
 	return active_transactions;
@@ -2605,12 +3633,14 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	binder_lock();
 	thread = binder_get_thread(proc);
 
+	spin_lock(&proc->todo_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->todo_lock);
+	binder_unlock();
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2628,6 +3658,53 @@ static unsigned int binder_poll(struct file *filp,
 	return 0;
 }
 
+static int binder_ioctl_write_read(struct file *filp,
+				   struct binder_thread *thread,
+				   unsigned int size, void __user *ubuf)
+{
+	int ret = 0;
+	struct binder_proc *proc = filp->private_data;
+	struct binder_write_read bwr;
+
+	if (size != sizeof(struct binder_write_read))
+		return -EINVAL;
+	if (copy_from_user(&bwr, ubuf, sizeof(bwr)))
+		return -EFAULT;
+	binder_debug(BINDER_DEBUG_READ_WRITE,
+		     "binder: %d:%d write %ld at %08lx, read %ld at %08lx\n",
+		     proc->pid, thread->pid, bwr.write_size, bwr.write_buffer,
+		     bwr.read_size, bwr.read_buffer);
+
+	if (bwr.write_size > 0) {
+		ret = binder_thread_write(proc, thread, (void __user *)bwr.write_buffer, bwr.write_size, &bwr.write_consumed);
+		if (ret < 0) {
+			bwr.read_consumed = 0;
+			if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
+				ret = -EFAULT;
+			return ret;
+		}
+	}
+	if (bwr.read_size > 0) {
+		binder_lock();
+		ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
+		if (!list_empty(&proc->todo))
+			wake_up_interruptible(&proc->wait);
+		binder_unlock();
+		if (ret < 0) {
+			if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
+				ret = -EFAULT;
+			return ret;
+		}
+	}
+	binder_debug(BINDER_DEBUG_READ_WRITE,
+		     "binder: %d:%d wrote %ld of %ld, read return %ld of %ld\n",
+		     proc->pid, thread->pid, bwr.write_consumed, bwr.write_size,
+		     bwr.read_consumed, bwr.read_size);
+	if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
+		return -EFAULT;
+	return 0;
+}
+
 static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int ret;
@@ -2642,58 +3719,28 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
+		goto err_unlocked;
+	}
+
+	/* BINDER_WRITE_READ takes binder_main_lock as it needs it */
+	if (cmd == BINDER_WRITE_READ) {
+		ret = binder_ioctl_write_read(filp, thread, size, ubuf);
+		/*
+		 * NEED_RETURN is only set on a new thread and by flush, both
+		 * to make the next read return early, so a racing flush seen
+		 * late here does no harm.
+		 */
+		if (!(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN))
+			goto err_unlocked;
+		binder_lock();
 		goto err;
 	}
 
+	binder_lock();
 	switch (cmd) {
-	case BINDER_WRITE_READ: {
-		struct binder_write_read bwr;
-		if (size != sizeof(struct binder_write_read)) {
-			ret = -EINVAL;
-			goto err;
-		}
-		if (copy_from_user(&bwr, ubuf, sizeof(bwr))) {
-			ret = -EFAULT;
-			goto err;
-		}
-		binder_debug(BINDER_DEBUG_READ_WRITE,
-			     "binder: %d:%d write %ld at %08lx, read %ld at %08lx\n",
-			     proc->pid, thread->pid, bwr.write_size, bwr.write_buffer,
-			     bwr.read_size, bwr.read_buffer);
-
-		if (bwr.write_size > 0) {
-			ret = binder_thread_write(proc, thread, (void __user *)bwr.write_buffer, bwr.write_size, &bwr.write_consumed);
-			if (ret < 0) {
-				bwr.read_consumed = 0;
-				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
-					ret = -EFAULT;
-				goto err;
-			}
-		}
-		if (bwr.read_size > 0) {
-			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
-			if (!list_empty(&proc->todo))
-				wake_up_interruptible(&proc->wait);
-			if (ret < 0) {
-				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
-					ret = -EFAULT;
-				goto err;
-			}
-		}
-		binder_debug(BINDER_DEBUG_READ_WRITE,
-			     "binder: %d:%d wrote %ld of %ld, read return %ld of %ld\n",
-			     proc->pid, thread->pid, bwr.write_consumed, bwr.write_size,
-			     bwr.read_consumed, bwr.read_size);
-		if (copy_to_user(ubuf, &bwr, sizeof(bwr))) {
-			ret = -EFAULT;
-			goto err;
-		}
-		break;
-	}
 	case BINDER_SET_MAX_THREADS:
 		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
 			ret = -EINVAL;
@@ -2751,7 +3798,8 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 err:
 	if (thread)
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+	binder_unlock();
+err_unlocked:
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2785,6 +3833,23 @@ static struct vm_operations_struct binder_vm_ops = {
 	.close = binder_vma_close,
 };
 
+static void binder_prefault_warm_pages(struct binder_proc *proc,
+				       struct vm_area_struct *vma)
+{
+	size_t count;
+	void *start = proc->buffer + PAGE_SIZE;
+	void *end;
+
+	if (binder_warm_pages_max <= 0)
+		return;
+	count = min_t(size_t, binder_warm_pages_max,
+		      proc->buffer_size / PAGE_SIZE - 1);
+	end = start + count * PAGE_SIZE;
+	if (!count || binder_update_page_range(proc, 1, start, end, vma))
+		return;
+	binder_keep_warm_pages(proc, start, end);
+}
+
 static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	int ret;
@@ -2841,6 +3906,13 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	proc->warm_map = kzalloc(BITS_TO_LONGS(proc->buffer_size / PAGE_SIZE) *
+				 sizeof(long), GFP_KERNEL);
+	if (proc->warm_map == NULL) {
+		ret = -ENOMEM;
+		failure_string = "alloc warm map";
+		goto err_alloc_warm_map_failed;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2856,6 +3928,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	buffer->free = 1;
 	binder_insert_free_buffer(proc, buffer);
 	proc->free_async_space = proc->buffer_size / 2;
+	binder_prefault_warm_pages(proc, vma);
 	barrier();
 	proc->files = get_files_struct(proc->tsk);
 	proc->vma = vma;
@@ -2865,6 +3938,9 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 
 err_alloc_small_buf_failed:
+	kfree(proc->warm_map);
+	proc->warm_map = NULL;
+err_alloc_warm_map_failed:
 	kfree(proc->pages);
 	proc->pages = NULL;
 err_alloc_pages_failed:
@@ -2883,6 +3959,7 @@ err_bad_arg:
 static int binder_open(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc;
+	int i;
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE, "binder_open: %d:%d\n",
 		     current->group_leader->pid, current->pid);
@@ -2894,14 +3971,24 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	spin_lock_init(&proc->inner_lock);
+	spin_lock_init(&proc->todo_lock);
+	mutex_init(&proc->alloc_lock);
+	for (i = 0; i < BINDER_CACHE_CLASSES; i++)
+		INIT_LIST_HEAD(&proc->buffer_cache[i]);
+	INIT_LIST_HEAD(&proc->warm_node);
+	/* looper threads fall back to this between transactions once an
+	 * inherited real-time policy is dropped; keep just the opener's nice
+	 * value even if it was opened from an RT thread */
+	proc->default_priority.sched_policy = SCHED_NORMAL;
+	proc->default_priority.prio = task_nice(current);
+	binder_lock();
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	binder_unlock();
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -2926,6 +4013,8 @@ static void binder_deferred_flush(struct binder_proc *proc)
 {
 	struct rb_node *n;
 	int wake_count = 0;
+
+	spin_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2934,6 +4023,7 @@ static void binder_deferred_flush(struct binder_proc *proc)
 			wake_count++;
 		}
 	}
+	spin_unlock(&proc->inner_lock);
 	wake_up_interruptible_all(&proc->wait);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
@@ -2960,6 +4050,22 @@ static void binder_deferred_release(struct binder_proc *proc)
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
 
+	/*
+	 * Hold a tmp_ref of our own so that a sender dropping the last one
+	 * while we tear the proc down leaves freeing it to us.  Once is_dead
+	 * is set, binder_transaction_fast no longer queues work for us.
+	 */
+	binder_alloc_lock(proc);
+	spin_lock(&proc->todo_lock);
+	proc->tmp_ref++;
+	proc->is_dead = 1;
+	spin_unlock(&proc->todo_lock);
+	mutex_lock(&binder_warm_lock);
+	list_del_init(&proc->warm_node);
+	mutex_unlock(&binder_warm_lock);
+	atomic_sub(proc->warm_pages, &binder_warm_pages_total);
+	binder_alloc_unlock(proc);
+
 	hlist_del(&proc->proc_node);
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
@@ -2999,12 +4105,14 @@ static void binder_deferred_release(struct binder_proc *proc)
 				incoming_refs++;
 				if (ref->death) {
 					death++;
+					spin_lock(&ref->proc->todo_lock);
 					if (list_empty(&ref->death->work.entry)) {
 						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
 						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
 						wake_up_interruptible(&ref->proc->wait);
 					} else
 						BUG();
+					spin_unlock(&ref->proc->todo_lock);
 				}
 			}
 			binder_debug(BINDER_DEBUG_DEAD_BINDER,
@@ -3020,9 +4128,10 @@ static void binder_deferred_release(struct binder_proc *proc)
 		outgoing_refs++;
 		binder_delete_ref(ref);
 	}
-	binder_release_work(&proc->todo);
+	binder_release_work(proc, &proc->todo);
 	buffers = 0;
 
+	binder_alloc_lock(proc);
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
 							rb_node);
@@ -3059,8 +4168,10 @@ static void binder_deferred_release(struct binder_proc *proc)
 			}
 		}
 		kfree(proc->pages);
+		kfree(proc->warm_map);
 		vfree(proc->buffer);
 	}
+	binder_alloc_unlock(proc);
 
 	put_task_struct(proc->tsk);
 
@@ -3071,7 +4182,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
 		     active_transactions, buffers, page_count);
 
-	kfree(proc);
+	binder_proc_dec_tmpref(proc);
 }
 
 static void binder_deferred_func(struct work_struct *work)
@@ -3081,7 +4192,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		binder_lock();
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3108,7 +4219,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3132,13 +4243,14 @@ static void print_binder_transaction(struct seq_file *m, const char *prefix,
 				     struct binder_transaction *t)
 {
 	seq_printf(m,
-		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %u:%d r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
 		   t->to_proc ? t->to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
-		   t->code, t->flags, t->priority, t->need_reply);
+		   t->code, t->flags, t->priority.sched_policy,
+		   t->priority.prio, t->need_reply);
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3273,15 +4385,19 @@ static void print_binder_proc(struct seq_file *m,
 	seq_printf(m, "proc %d\n", proc->pid);
 	header_pos = m->count;
 
+	spin_lock(&proc->inner_lock);
+	spin_lock(&proc->todo_lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		print_binder_thread(m, rb_entry(n, struct binder_thread,
 						rb_node), print_all);
+	spin_unlock(&proc->inner_lock);
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
 		struct binder_node *node = rb_entry(n, struct binder_node,
 						    rb_node);
 		if (print_all || node->has_async_transaction)
 			print_binder_node(m, node);
 	}
+	spin_unlock(&proc->todo_lock);
 	if (print_all) {
 		for (n = rb_first(&proc->refs_by_desc);
 		     n != NULL;
@@ -3289,11 +4405,17 @@ static void print_binder_proc(struct seq_file *m,
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
 	}
+	if (!binder_debug_no_lock)
+		binder_alloc_lock(proc);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	if (!binder_debug_no_lock)
+		binder_alloc_unlock(proc);
+	spin_lock(&proc->todo_lock);
 	list_for_each_entry(w, &proc->todo, entry)
 		print_binder_work(m, "  ", "  pending transaction", w);
+	spin_unlock(&proc->todo_lock);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
 		seq_puts(m, "  has delivered dead binder\n");
 		break;
@@ -3361,17 +4483,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3379,11 +4505,13 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
 	}
 }
 
@@ -3396,8 +4524,10 @@ static void print_binder_proc_stats(struct seq_file *m,
 
 	seq_printf(m, "proc %d\n", proc->pid);
 	count = 0;
+	spin_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		count++;
+	spin_unlock(&proc->inner_lock);
 	seq_printf(m, "  threads: %d\n", count);
 	seq_printf(m, "  requested threads: %d+%d/%d\n"
 			"  ready threads %d\n"
@@ -3421,11 +4551,24 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	if (!binder_debug_no_lock)
+		binder_alloc_lock(proc);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	if (!binder_debug_no_lock)
+		binder_alloc_unlock(proc);
 	seq_printf(m, "  buffers: %d\n", count);
+	seq_printf(m, "  buffer cache: cached %d hits %d misses %d\n",
+		   proc->buffer_cache_total, proc->buffer_cache_hits,
+		   proc->buffer_cache_misses);
+	seq_printf(m, "  warm pages: %d reclaimed %d\n",
+		   proc->warm_pages, proc->warm_reclaimed);
+	seq_printf(m, "  alloc lock: acquired %d contended %d\n",
+		   proc->alloc_lock_stats.acquired,
+		   proc->alloc_lock_stats.contended);
 
 	count = 0;
+	spin_lock(&proc->todo_lock);
 	list_for_each_entry(w, &proc->todo, entry) {
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION:
@@ -3435,6 +4578,7 @@ static void print_binder_proc_stats(struct seq_file *m,
 			break;
 		}
 	}
+	spin_unlock(&proc->todo_lock);
 	seq_printf(m, "  pending transactions: %d\n", count);
 
 	print_binder_stats(m, "  ", &proc->stats);
@@ -3449,7 +4593,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock();
 
 	seq_puts(m, "binder state:\n");
 
@@ -3461,7 +4605,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3472,16 +4616,27 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock();
 
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
+	seq_printf(m, "main lock: acquired %d contended %d\n",
+		   binder_main_lock_stats.acquired,
+		   binder_main_lock_stats.contended);
+	seq_printf(m, "alloc lock: contended %d\n",
+		   atomic_read(&binder_alloc_lock_contended));
+	seq_printf(m, "refcount commands without main lock: %d\n",
+		   atomic_read(&binder_ref_fast_count));
+	seq_printf(m, "transactions queued without main lock: %d\n",
+		   atomic_read(&binder_transaction_fast_count));
+	seq_printf(m, "warm pages: %d\n",
+		   atomic_read(&binder_warm_pages_total));
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3492,13 +4647,13 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock();
 
 	seq_puts(m, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3508,11 +4663,82 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock();
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
+	return 0;
+}
+
+/* returns the bucket holding the pct-th percentile sample */
+static int binder_latency_percentile(struct binder_latency_hist *hist,
+				     int pct)
+{
+	u64 target = ((u64)hist->total * pct + 99) / 100;
+	u64 sum = 0;
+	int i;
+
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++) {
+		sum += hist->count[i];
+		if (sum >= target)
+			break;
+	}
+	if (i == BINDER_LATENCY_BUCKETS)
+		i--;
+	return i;
+}
+
+/* the last bucket has no upper bound, so it is labelled by its lower one */
+static void print_binder_latency_bucket(struct seq_file *m, int i)
+{
+	if (i == BINDER_LATENCY_BUCKETS - 1)
+		seq_printf(m, ">=%lluus", 1ULL << (i - 1));
+	else
+		seq_printf(m, "<%lluus", 1ULL << i);
+}
+
+static void print_binder_latency(struct seq_file *m, const char *name,
+				 struct binder_latency_hist *hist)
+{
+	int i;
+
+	if (!hist->total)
+		return;
+	seq_printf(m, "  %s: n %u p50 ", name, hist->total);
+	print_binder_latency_bucket(m, binder_latency_percentile(hist, 50));
+	seq_puts(m, " p99 ");
+	print_binder_latency_bucket(m, binder_latency_percentile(hist, 99));
+	seq_puts(m, "\n    ");
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++) {
+		if (!hist->count[i])
+			continue;
+		seq_puts(m, " ");
+		print_binder_latency_bucket(m, i);
+		seq_printf(m, ":%u", hist->count[i]);
+	}
+	seq_puts(m, "\n");
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int do_lock = !binder_debug_no_lock;
+
+	if (do_lock)
+		binder_lock();
+
+	seq_puts(m, "binder latency:\n");
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (!proc->wakeup_latency.total && !proc->call_latency.total)
+			continue;
+		seq_printf(m, "proc %d\n", proc->pid);
+		print_binder_latency(m, "wakeup", &proc->wakeup_latency);
+		print_binder_latency(m, "call", &proc->call_latency);
+	}
+	if (do_lock)
+		binder_unlock();
 	return 0;
 }
 
@@ -3561,6 +4787,7 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(latency);
 
 static int __init binder_init(void)
 {
@@ -3569,6 +4796,7 @@ static int __init binder_init(void)
 	binder_deferred_workqueue = create_singlethread_workqueue("binder");
 	if (!binder_deferred_workqueue)
 		return -ENOMEM;
+	register_shrinker(&binder_warm_shrinker);
 
 	binder_debugfs_dir_entry_root = debugfs_create_dir("binder", NULL);
 	if (binder_debugfs_dir_entry_root)
@@ -3591,6 +4819,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    NULL,
 				    &binder_transactions_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 		debugfs_create_file("transaction_log",
 				    S_IRUGO,
 				    binder_debugfs_dir_entry_root,
@@ -24,6 +24,12 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/time.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/kthread.h>
+#include <linux/vmalloc.h>
+#include <linux/delay.h>
+#include <linux/mm.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -32,35 +38,53 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. The offsets and the reader list are
+ * protected by the spinlock 'lock'.
+ *
+ * Writers never copy the payload under the lock. A writer reserves space by
+ * advancing w_off and writing the entry header under the lock, copies the
+ * payload unlocked, and then commits by flagging its entry. c_off moves
+ * across the contiguous run of flagged entries, so readers only see data up
+ * to the oldest entry still being copied. A writer that would lap c_off
+ * sleeps on 'wwq' until that entry has been committed.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
+	wait_queue_head_t	wwq;	/* wait queue for lapping writers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	spinlock_t		lock;	/* lock protecting offsets */
+	size_t			w_off;	/* current reserve head offset */
+	size_t			c_off;	/* committed (readable) offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	u64			w_seq;	/* absolute w_off, for mmap readers */
+	u64			c_seq;	/* absolute c_off */
+	u64			head_seq; /* absolute head */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock, except for
+ * the bounce buffer, which is owned by whoever holds 'mutex'.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* serializes read() on this reader */
+	unsigned char		*entry;	/* bounce buffer for one entry */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/* set in an entry's __pad once its payload is in place, cleared by c_off */
+#define LOGGER_ENTRY_COMMITTED	1
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -88,7 +112,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -107,15 +131,39 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * get_entry_flag / set_entry_flag - access the __pad field of the entry
+ * header at 'off', which may wrap around the end of the log.
  *
- * Caller must hold log->mutex.
+ * Caller needs to hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static __u16 get_entry_flag(struct logger_log *log, size_t off)
+{
+	size_t pos = logger_offset(off + offsetof(struct logger_entry, __pad));
+	__u16 val;
+
+	memcpy(&val, log->buffer + pos, 1);
+	memcpy(((char *) &val) + 1, log->buffer + logger_offset(pos + 1), 1);
+
+	return val;
+}
+
+static void set_entry_flag(struct logger_log *log, size_t off, __u16 val)
+{
+	size_t pos = logger_offset(off + offsetof(struct logger_entry, __pad));
+
+	memcpy(log->buffer + pos, &val, 1);
+	memcpy(log->buffer + logger_offset(pos + 1), ((char *) &val) + 1, 1);
+}
+
+/*
+ * do_read_log - copies exactly 'count' bytes of the next entry from 'log'
+ * into the reader's bounce buffer and advances the read head.
+ *
+ * Caller must hold log->lock. The copy out to user-space happens after the
+ * lock is dropped, so a writer lapping the reader cannot tear the entry.
+ */
+static void do_read_log(struct logger_log *log, struct logger_reader *reader,
+			size_t count)
 {
 	size_t len;
 
@@ -125,20 +173,16 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log, whichever comes first.
 	 */
 	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	memcpy(reader->entry, log->buffer + reader->r_off, len);
 
 	/*
 	 * Second, we read any remaining bytes, starting back at the head of
 	 * the log.
 	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		memcpy(reader->entry + len, log->buffer, count - len);
 
 	reader->r_off = logger_offset(reader->r_off + count);
-
-	return count;
 }
 
 /*
@@ -165,9 +209,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = (log->c_off == reader->r_off);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -188,11 +232,13 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(log->c_off == reader->r_off)) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
@@ -200,15 +246,20 @@ start:
 	ret = get_entry_len(log, reader->r_off);
 	if (count < ret) {
 		ret = -EINVAL;
+		spin_unlock(&log->lock);
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	do_read_log(log, reader, ret);
 
-out:
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
+
+	if (copy_to_user(buf, reader->entry, ret))
+		ret = -EFAULT;
 
+out:
+	mutex_unlock(&reader->mutex);
 	return ret;
 }
 
@@ -216,7 +267,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -252,9 +303,12 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * entry at or after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * logger_reserve() never lets the new write head pass c_off, and c_off is an
+ * entry boundary, so readers are never pulled past it.
+ *
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -262,59 +316,148 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (clock_interval(old, new, log->head) && log->head != new) {
+		size_t head = get_next_entry(log, log->head,
+					     logger_offset(new - log->head));
+
+		log->head_seq += logger_offset(head - log->head);
+		log->head = head;
+	}
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+		if (clock_interval(old, new, reader->r_off) &&
+		    reader->r_off != new)
+			reader->r_off = get_next_entry(log, reader->r_off,
+					logger_offset(new - reader->r_off));
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * Returns the offset just past the written bytes.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static size_t do_write_log(struct logger_log *log, size_t off,
+			   const void *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
 
-	log->w_off = logger_offset(log->w_off + count);
-
+	return logger_offset(off + count);
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log_from_user - writes 'count' bytes from the user-space buffer
+ * 'buf' to the log 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * The range must have been reserved with logger_reserve(); no lock is held.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
+/*
+ * logger_reserve - reserves room for an entry with the given header and
+ * writes the header. Returns the offset at which the payload goes.
+ *
+ * If the entry would overwrite a reservation that has not been committed
+ * yet, sleeps until it has been.
+ */
+static size_t logger_reserve(struct logger_log *log,
+			     struct logger_entry *header)
+{
+	size_t len = sizeof(struct logger_entry) + header->len;
+	size_t off;
+
+	header->__pad = 0;
+
+	spin_lock(&log->lock);
+
+	while (unlikely(log->w_seq + len - log->c_seq > log->size)) {
+		DEFINE_WAIT(wait);
+
+		prepare_to_wait(&log->wwq, &wait, TASK_UNINTERRUPTIBLE);
+		spin_unlock(&log->lock);
+		schedule();
+		finish_wait(&log->wwq, &wait);
+		spin_lock(&log->lock);
+	}
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset. We do this now
+	 * because if we partially fail, we can end up with clobbered log
+	 * entries that encroach on readable buffer.
+	 */
+	fix_up_readers(log, len);
+
+	off = do_write_log(log, log->w_off, header,
+			   sizeof(struct logger_entry));
+	log->w_off = logger_offset(off + header->len);
+	log->w_seq += len;
+
+	spin_unlock(&log->lock);
+
+	return off;
+}
+
+/*
+ * logger_commit - finishes a write reserved by logger_reserve(). The entry
+ * is flagged as committed and c_off is moved across every committed entry
+ * that directly follows it, clearing the flags as it goes.
+ *
+ * 'start' is the header offset and 'end' the offset past the payload. If the
+ * payload copy failed and nothing was reserved after it, the entry is dropped.
+ */
+static void logger_commit(struct logger_log *log, size_t start, size_t end,
+			  int failed)
+{
+	int wake = 0, wake_writers;
+
+	spin_lock(&log->lock);
+	if (unlikely(failed) && log->w_off == end) {
+		log->w_seq -= logger_offset(end - start);
+		log->w_off = start;
+	} else
+		set_entry_flag(log, start, LOGGER_ENTRY_COMMITTED);
+
+	while (log->c_off != log->w_off &&
+	       get_entry_flag(log, log->c_off) == LOGGER_ENTRY_COMMITTED) {
+		size_t len = get_entry_len(log, log->c_off);
+
+		set_entry_flag(log, log->c_off, 0);
+		log->c_off = logger_offset(log->c_off + len);
+		log->c_seq += len;
+		wake = 1;
+	}
+	wake_writers = wake && waitqueue_active(&log->wwq);
+	spin_unlock(&log->lock);
+
+	/* wake up any blocked readers */
+	if (wake)
+		wake_up_interruptible(&log->wq);
+	if (wake_writers)
+		wake_up(&log->wwq);
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -324,9 +467,9 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	size_t start, off;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -341,19 +484,10 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	off = logger_reserve(log, &header);
+	start = logger_offset(off - sizeof(struct logger_entry));
 
-	while (nr_segs-- > 0) {
+	while (nr_segs-- > 0 && ret < header.len) {
 		size_t len;
 		ssize_t nr;
 
@@ -361,21 +495,31 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
+			/*
+			 * Other writers may have reserved past us, so the
+			 * entry cannot always be unwound; blank the payload
+			 * so readers never see stale bytes.
+			 */
+			while (ret < header.len) {
+				static const char zero[64];
+				len = min_t(size_t, sizeof(zero),
+					    header.len - ret);
+				off = do_write_log(log, off, zero, len);
+				ret += len;
+			}
+			logger_commit(log, start, off, 1);
 			return nr;
 		}
 
 		iov++;
 		ret += nr;
+		off = logger_offset(off + nr);
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_commit(log, start, logger_offset(start +
+		      sizeof(struct logger_entry) + header.len), 0);
 
 	return ret;
 }
@@ -407,13 +551,20 @@ static int logger_open(struct inode *inode, struct file *file)
 		if (!reader)
 			return -ENOMEM;
 
+		reader->entry = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->entry) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
+		mutex_init(&reader->mutex);
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -432,9 +583,10 @@ static int logger_release(struct inode *ignored, struct file *file)
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
 		struct logger_log *log = reader->log;
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
+		kfree(reader->entry);
 		kfree(reader);
 	}
 
@@ -464,21 +616,86 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	if (log->c_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the whole ring buffer read-only into a reader's address space. The
+ * buffer lives as long as the module, so no reference counting is needed.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long off;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (vma->vm_pgoff || size != log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND;
+
+	for (off = 0; off < size; off += PAGE_SIZE) {
+		void *addr = log->buffer + off;
+		struct page *page;
+
+		if (is_vmalloc_addr(addr))
+			page = vmalloc_to_page(addr);
+		else
+			page = virt_to_page(addr);
+		ret = vm_insert_page(vma, vma->vm_start + off, page);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static long logger_get_mmap_state(struct file *file, struct logger_log *log,
+				  void __user *arg)
+{
+	struct logger_mmap_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	spin_lock(&log->lock);
+	state.w_seq = log->w_seq;
+	state.c_seq = log->c_seq;
+	state.head_seq = log->head_seq;
+	state.size = log->size;
+	if (file->f_mode & FMODE_READ) {
+		struct logger_reader *reader = file->private_data;
+		reader->r_off = log->c_off;
+	}
+	spin_unlock(&log->lock);
+
+	if (copy_to_user(arg, &state, sizeof(state)))
+		return -EFAULT;
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	if (cmd == LOGGER_GET_MMAP_STATE)
+		return logger_get_mmap_state(file, log, (void __user *)arg);
+
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -490,10 +707,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
+		if (log->c_off >= reader->r_off)
+			ret = log->c_off - reader->r_off;
 		else
-			ret = (log->size - reader->r_off) + log->w_off;
+			ret = (log->size - reader->r_off) + log->c_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -501,7 +718,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
+		if (log->c_off != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
 			ret = 0;
@@ -512,13 +729,14 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			reader->r_off = log->c_off;
+		log->head_seq = log->c_seq;
+		log->head = log->c_off;
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -528,6 +746,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -536,11 +755,12 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * must be a power of two, at least PAGE_SIZE, greater than LOGGER_ENTRY_MAX_LEN,
+ * and less than LONG_MAX minus LOGGER_ENTRY_MAX_LEN. The buffer is page
+ * aligned so that it can be mapped by readers.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -550,9 +770,11 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
+	.wwq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wwq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.c_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -576,6 +798,139 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+#ifdef CONFIG_ANDROID_LOGGER_BENCH
+/*
+ * Writer microbenchmark. Writing N to /sys/module/logger/parameters/bench
+ * runs N kernel threads for LOGGER_BENCH_MS against a private log, using the
+ * same reserve/commit path as logger_aio_write(). Reading the parameter
+ * returns the aggregate writes/sec of the last run.
+ */
+#define LOGGER_BENCH_SIZE	(256*1024)
+#define LOGGER_BENCH_PAYLOAD	64
+#define LOGGER_BENCH_MS		1000
+#define LOGGER_BENCH_MAX_WRITERS	64
+
+struct logger_bench_writer {
+	struct logger_log	*log;
+	struct task_struct	*task;
+	unsigned long		writes;
+};
+
+static DEFINE_MUTEX(logger_bench_mutex);
+static unsigned long logger_bench_rate;
+
+static int logger_bench_thread(void *data)
+{
+	struct logger_bench_writer *w = data;
+	struct logger_log *log = w->log;
+	char payload[LOGGER_BENCH_PAYLOAD];
+	struct logger_entry header;
+	struct timespec now;
+	size_t start, off;
+
+	memset(payload, 'b', sizeof(payload));
+	header.pid = current->tgid;
+	header.tid = current->pid;
+	header.len = sizeof(payload);
+
+	while (!kthread_should_stop()) {
+		now = current_kernel_time();
+		header.sec = now.tv_sec;
+		header.nsec = now.tv_nsec;
+
+		off = logger_reserve(log, &header);
+		start = logger_offset(off - sizeof(struct logger_entry));
+		off = do_write_log(log, off, payload, sizeof(payload));
+		logger_commit(log, start, off, 0);
+
+		w->writes++;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static int logger_bench_run(unsigned int nr_writers)
+{
+	struct logger_bench_writer *writers;
+	struct logger_log *log;
+	unsigned long begin, elapsed;
+	u64 total = 0;
+	unsigned int i;
+	int ret = 0;
+
+	log = kzalloc(sizeof(*log), GFP_KERNEL);
+	writers = kcalloc(nr_writers, sizeof(*writers), GFP_KERNEL);
+	if (log)
+		log->buffer = vmalloc(LOGGER_BENCH_SIZE);
+	if (!log || !log->buffer || !writers) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	log->size = LOGGER_BENCH_SIZE;
+	spin_lock_init(&log->lock);
+	init_waitqueue_head(&log->wq);
+	init_waitqueue_head(&log->wwq);
+	INIT_LIST_HEAD(&log->readers);
+
+	for (i = 0; i < nr_writers; i++) {
+		writers[i].log = log;
+		writers[i].task = kthread_create(logger_bench_thread,
+						 &writers[i], "logbench/%u", i);
+		if (IS_ERR(writers[i].task)) {
+			ret = PTR_ERR(writers[i].task);
+			writers[i].task = NULL;
+			break;
+		}
+	}
+	nr_writers = i;
+
+	begin = jiffies;
+	for (i = 0; i < nr_writers; i++)
+		wake_up_process(writers[i].task);
+	if (!ret)
+		msleep(LOGGER_BENCH_MS);
+	for (i = 0; i < nr_writers; i++) {
+		kthread_stop(writers[i].task);
+		total += writers[i].writes;
+	}
+	elapsed = jiffies - begin;
+
+	if (!ret) {
+		logger_bench_rate = div_u64(total * HZ, elapsed ? elapsed : 1);
+		printk(KERN_INFO "logger: bench %u writers: %llu writes in "
+		       "%u ms, %lu writes/sec\n", nr_writers, total,
+		       jiffies_to_msecs(elapsed), logger_bench_rate);
+	}
+
+out:
+	if (log)
+		vfree(log->buffer);
+	kfree(log);
+	kfree(writers);
+	return ret;
+}
+
+static int logger_bench_set(const char *val, struct kernel_param *kp)
+{
+	unsigned long nr;
+	int ret;
+
+	if (strict_strtoul(val, 0, &nr) || !nr ||
+	    nr > LOGGER_BENCH_MAX_WRITERS)
+		return -EINVAL;
+
+	mutex_lock(&logger_bench_mutex);
+	ret = logger_bench_run(nr);
+	mutex_unlock(&logger_bench_mutex);
+
+	return ret;
+}
+
+module_param_call(bench, logger_bench_set, param_get_ulong,
+		  &logger_bench_rate, S_IWUSR | S_IRUGO);
+#endif
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
@@ -46,4 +46,26 @@ struct logger_entry {
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 
+/*
+ * Readers may mmap() a log read-only (offset 0, length LOGGER_GET_LOG_BUF_SIZE)
+ * and parse entries in place. Positions below are absolute byte counts since
+ * boot; the ring index of a position is (pos & (size - 1)).
+ *
+ * Entries in [head_seq, c_seq) are readable. Bytes older than w_seq - size may
+ * already have been overwritten, so after parsing an entry a reader must
+ * re-fetch the state and discard it if its start is below w_seq - size.
+ *
+ * LOGGER_GET_MMAP_STATE also marks everything up to c_seq as consumed by this
+ * reader, so poll() blocks until newer entries are committed.
+ */
+struct logger_mmap_state {
+	__u64		w_seq;		/* bytes reserved by writers */
+	__u64		c_seq;		/* bytes committed and readable */
+	__u64		head_seq;	/* start of the oldest entry */
+	__u32		size;		/* size of the log */
+	__u32		__pad;
+};
+
+#define LOGGER_GET_MMAP_STATE	_IOR(__LOGGERIO, 5, struct logger_mmap_state)
+
 #endif /* _LINUX_LOGGER_H */
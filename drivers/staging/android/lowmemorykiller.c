@@ -12,6 +12,15 @@
  * and kill processes with a oom_adj value of 0 or higher when the free memory
  * drops below 1024 pages.
  *
+ * /dev/mem_notify reports the pressure level ("none", "low", "medium" or
+ * "critical") computed from the same thresholds, each raised by notify_margin
+ * percent so that user-space hears about it before anything gets killed.
+ * Tripping the last (highest adj) threshold is "low", the first is "critical"
+ * and anything in between is "medium". poll() signals a change of level; each
+ * read from offset 0 returns the current level. While the level is above
+ * "none" it is also re-checked every second, so pollers hear about recovery
+ * even when nothing calls the shrinker any more.
+ *
  * The driver considers memory used for caches to be free, but if a large
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
@@ -35,6 +44,14 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
 
 #ifdef CONFIG_SWAP
 #include <linux/fs.h>
@@ -64,12 +81,142 @@ static unsigned long lowmem_deathpending_timeout;
 static int fudgeswap = 512;
 #endif
 
+enum lowmem_pressure_level {
+	LOWMEM_PRESSURE_NONE,
+	LOWMEM_PRESSURE_LOW,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+};
+
+static const char * const lowmem_pressure_names[] = {
+	[LOWMEM_PRESSURE_NONE]		= "none",
+	[LOWMEM_PRESSURE_LOW]		= "low",
+	[LOWMEM_PRESSURE_MEDIUM]	= "medium",
+	[LOWMEM_PRESSURE_CRITICAL]	= "critical",
+};
+
+static int lowmem_notify_margin = 25;
+static int lowmem_pressure;
+static atomic_t lowmem_pressure_seq = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static struct delayed_work lowmem_pressure_work;
+
+#define LOWMEM_PRESSURE_POLL_INTERVAL	HZ
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			printk(x);			\
 	} while (0)
 
+/*
+ * Index of killable thread groups, bucketed by oom_adj, so that victim
+ * selection does not have to walk the whole task list under tasklist_lock.
+ * Entries are added or moved on fork, exec and oom_adj writes, and dropped
+ * when the group leader releases its mm (oom_adj notifier). If an entry
+ * cannot be allocated the index is marked stale and rebuilt from the task
+ * list on the next shrink.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_HASH_BITS	7
+
+struct lowmem_task {
+	struct task_struct	*task;
+	int			oom_adj;
+	struct list_head	bucket;
+	struct hlist_node	hash;
+};
+
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static struct list_head lowmem_buckets[LOWMEM_ADJ_BUCKETS];
+static struct hlist_head lowmem_hash[1 << LOWMEM_HASH_BITS];
+static int lowmem_index_stale;
+
+static struct lowmem_task *lowmem_index_find(struct task_struct *task)
+{
+	struct lowmem_task *lt;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(lt, pos,
+			     &lowmem_hash[hash_ptr(task, LOWMEM_HASH_BITS)], hash)
+		if (lt->task == task)
+			return lt;
+	return NULL;
+}
+
+/* Caller must hold lowmem_index_lock */
+static void lowmem_index_update(struct task_struct *task)
+{
+	struct lowmem_task *lt;
+	int oom_adj;
+
+	/* Pairs with the OOM_ADJ_EXITED removal, which runs after PF_EXITING */
+	if (task->flags & PF_EXITING)
+		return;
+
+	oom_adj = clamp_t(int, task->signal->oom_adj, OOM_DISABLE,
+			  OOM_ADJUST_MAX);
+	lt = lowmem_index_find(task);
+	if (!lt) {
+		lt = kmalloc(sizeof(*lt), GFP_ATOMIC);
+		if (!lt) {
+			lowmem_index_stale = 1;
+			return;
+		}
+		lt->task = task;
+		hlist_add_head(&lt->hash,
+			       &lowmem_hash[hash_ptr(task, LOWMEM_HASH_BITS)]);
+	} else if (lt->oom_adj == oom_adj)
+		return;
+	else
+		list_del(&lt->bucket);
+
+	lt->oom_adj = oom_adj;
+	list_add_tail(&lt->bucket, &lowmem_buckets[oom_adj - OOM_DISABLE]);
+}
+
+/* Caller must hold lowmem_index_lock */
+static void lowmem_index_remove(struct task_struct *task)
+{
+	struct lowmem_task *lt = lowmem_index_find(task);
+
+	if (lt) {
+		hlist_del(&lt->hash);
+		list_del(&lt->bucket);
+		kfree(lt);
+	}
+}
+
+static void lowmem_index_rebuild(void)
+{
+	struct task_struct *p;
+
+	read_lock(&tasklist_lock);
+	spin_lock(&lowmem_index_lock);
+	lowmem_index_stale = 0;
+	for_each_process(p)
+		lowmem_index_update(p);
+	spin_unlock(&lowmem_index_lock);
+	read_unlock(&tasklist_lock);
+}
+
+static void lowmem_index_clear(void)
+{
+	struct lowmem_task *lt, *tmp;
+	int i;
+
+	spin_lock(&lowmem_index_lock);
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++) {
+		list_for_each_entry_safe(lt, tmp, &lowmem_buckets[i], bucket) {
+			hlist_del(&lt->hash);
+			list_del(&lt->bucket);
+			kfree(lt);
+		}
+	}
+	spin_unlock(&lowmem_index_lock);
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -88,6 +235,108 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val,
+		    void *data)
+{
+	struct task_struct *task = data;
+
+	spin_lock(&lowmem_index_lock);
+	if (val == OOM_ADJ_EXITED)
+		lowmem_index_remove(task);
+	else
+		lowmem_index_update(task);
+	spin_unlock(&lowmem_index_lock);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+static int lowmem_array_size(void)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	return array_size;
+}
+
+static void lowmem_get_free(int *other_free, int *other_file)
+{
+	*other_free = global_page_state(NR_FREE_PAGES);
+	*other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+
+#ifdef CONFIG_SWAP
+	if(fudgeswap != 0){
+		struct sysinfo si;
+		si_swapinfo(&si);
+
+		if(si.freeswap > 0){
+			if(fudgeswap > si.freeswap)
+				*other_file += si.freeswap;
+			else
+				*other_file += fudgeswap;
+		}
+	}
+#endif
+}
+
+static void lowmem_update_pressure(int other_free, int other_file)
+{
+	int level = LOWMEM_PRESSURE_NONE;
+	int array_size = lowmem_array_size();
+	int i;
+
+	for (i = 0; i < array_size; i++) {
+		size_t minfree = lowmem_minfree[i] *
+				 (100 + lowmem_notify_margin) / 100;
+
+		if (other_free < minfree && other_file < minfree) {
+			if (i == 0)
+				level = LOWMEM_PRESSURE_CRITICAL;
+			else if (i == array_size - 1)
+				level = LOWMEM_PRESSURE_LOW;
+			else
+				level = LOWMEM_PRESSURE_MEDIUM;
+			break;
+		}
+	}
+
+	spin_lock(&lowmem_pressure_lock);
+	if (level != lowmem_pressure) {
+		lowmem_print(3, "lowmem pressure %s -> %s, ofree %d %d\n",
+			     lowmem_pressure_names[lowmem_pressure],
+			     lowmem_pressure_names[level],
+			     other_free, other_file);
+		lowmem_pressure = level;
+		atomic_inc(&lowmem_pressure_seq);
+		wake_up_interruptible(&lowmem_pressure_wait);
+	}
+	spin_unlock(&lowmem_pressure_lock);
+
+	/*
+	 * Nothing else recomputes the level once reclaim stops, so keep
+	 * checking until we have reported the way back to "none".
+	 */
+	if (level != LOWMEM_PRESSURE_NONE)
+		schedule_delayed_work(&lowmem_pressure_work,
+				      LOWMEM_PRESSURE_POLL_INTERVAL);
+}
+
+static void lowmem_pressure_work_fn(struct work_struct *work)
+{
+	int other_free, other_file;
+
+	lowmem_get_free(&other_free, &other_file);
+	lowmem_update_pressure(other_free, other_file);
+}
+
 static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
@@ -95,13 +344,16 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	int rem = 0;
 	int tasksize;
 	int i;
+	int adj;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES);
-	int other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM);
+	int array_size = lowmem_array_size();
+	int other_free;
+	int other_file;
+
+	lowmem_get_free(&other_free, &other_file);
+	lowmem_update_pressure(other_free, other_file);
 
 	/*
 	 * If we already have a death outstanding, then
@@ -114,24 +366,6 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	    time_before_eq(jiffies, lowmem_deathpending_timeout))
 		return 0;
 
-#ifdef CONFIG_SWAP
-	if(fudgeswap != 0){
-		struct sysinfo si;
-		si_swapinfo(&si);
-
-		if(si.freeswap > 0){
-			if(fudgeswap > si.freeswap)
-				other_file += si.freeswap;
-			else
-				other_file += fudgeswap;
-		}
-	}
-#endif
-
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
@@ -154,40 +388,44 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	}
 	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
+	if (lowmem_index_stale)
+		lowmem_index_rebuild();
+
+	/*
+	 * Take the highest non-empty oom_adj bucket holding a task with an
+	 * mm, and the largest such task within it. Index entries stay valid
+	 * while lowmem_index_lock is held since exiting leaders remove
+	 * themselves under it before their task_struct can be freed.
+	 */
+	spin_lock(&lowmem_index_lock);
+	for (adj = OOM_ADJUST_MAX; adj >= max(min_adj, OOM_DISABLE) &&
+	     !selected; adj--) {
+		struct lowmem_task *lt;
+
+		list_for_each_entry(lt, &lowmem_buckets[adj - OOM_DISABLE],
+				    bucket) {
+			struct mm_struct *mm;
+
+			p = lt->task;
+			task_lock(p);
+			mm = p->mm;
+			if (!mm) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
 			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+			if (tasksize <= 0)
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			if (selected && tasksize <= selected_tasksize)
 				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n", p->pid, p->comm, adj,
+				     tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
@@ -200,7 +438,7 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
+	spin_unlock(&lowmem_index_lock);
 	return rem;
 }
 
@@ -209,17 +447,91 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static int lowmem_notify_open(struct inode *inode, struct file *file)
+{
+	file->private_data = (void *)(long)atomic_read(&lowmem_pressure_seq);
+	return 0;
+}
+
+static ssize_t lowmem_notify_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	char level[16];
+	int other_free, other_file;
+	int len;
+
+	if (*ppos == 0) {
+		lowmem_get_free(&other_free, &other_file);
+		lowmem_update_pressure(other_free, other_file);
+		file->private_data =
+			(void *)(long)atomic_read(&lowmem_pressure_seq);
+	}
+	len = snprintf(level, sizeof(level), "%s\n",
+		       lowmem_pressure_names[lowmem_pressure]);
+	return simple_read_from_buffer(buf, count, ppos, level, len);
+}
+
+static unsigned int lowmem_notify_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_pressure_wait, wait);
+
+	if ((long)file->private_data != atomic_read(&lowmem_pressure_seq))
+		return POLLIN | POLLRDNORM | POLLPRI;
+	return 0;
+}
+
+static const struct file_operations lowmem_notify_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_notify_open,
+	.read = lowmem_notify_read,
+	.poll = lowmem_notify_poll,
+	.llseek = default_llseek,
+};
+
+static struct miscdevice lowmem_notify_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "mem_notify",
+	.fops = &lowmem_notify_fops,
+};
+
 static int __init lowmem_init(void)
 {
+	int i;
+	int ret;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+	for (i = 0; i < ARRAY_SIZE(lowmem_hash); i++)
+		INIT_HLIST_HEAD(&lowmem_hash[i]);
+	INIT_DELAYED_WORK_DEFERRABLE(&lowmem_pressure_work,
+				     lowmem_pressure_work_fn);
+
 	task_free_register(&task_nb);
+	register_oom_adj_notifier(&oom_adj_nb);
+	lowmem_index_rebuild();
 	register_shrinker(&lowmem_shrinker);
+	ret = misc_register(&lowmem_notify_misc);
+	if (ret) {
+		printk(KERN_ERR "lowmemorykiller: failed to register "
+		       "mem_notify device (%d)\n", ret);
+		unregister_shrinker(&lowmem_shrinker);
+		cancel_delayed_work_sync(&lowmem_pressure_work);
+		unregister_oom_adj_notifier(&oom_adj_nb);
+		task_free_unregister(&task_nb);
+		lowmem_index_clear();
+		return ret;
+	}
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	misc_deregister(&lowmem_notify_misc);
 	unregister_shrinker(&lowmem_shrinker);
+	cancel_delayed_work_sync(&lowmem_pressure_work);
+	unregister_oom_adj_notifier(&oom_adj_nb);
 	task_free_unregister(&task_nb);
+	lowmem_index_clear();
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -228,6 +540,8 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(notify_margin, lowmem_notify_margin, int,
+		   S_IRUGO | S_IWUSR);
 
 #ifdef CONFIG_SWAP
 module_param_named(fudgeswap, fudgeswap, int, S_IRUGO | S_IWUSR);
@@ -19,13 +19,15 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/crypto.h>
+#include <linux/err.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -38,14 +40,20 @@ struct zram *devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+/*
+ * Reads of written back pages. Swap-in may be what the system is waiting
+ * on to make progress, so these do not go through the shared events queue.
+ */
+static struct workqueue_struct *zram_wb_wq;
+
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -85,18 +93,39 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * The slot lock serializes all changes to one table entry: writes, swap
+ * slot free notifications (which come in under swap_lock, so this cannot
+ * sleep), reads of uncompressed pages and writeback. Flags other than
+ * ZRAM_ACCESS share its word, so they are only changed with it held.
+ */
+static void zram_slot_lock(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
+static void zram_slot_unlock(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
+/*
+ * Returns 1 if the page consists of a single word repeated, which is then
+ * stored in 'element'. All-zero pages are the common special case.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
@@ -115,22 +144,37 @@ static void zram_set_disksize(struct zram *zram, u64 size_bytes)
 	set_capacity(zram->disk, size_bytes >> SECTOR_SHIFT);
 }
 
+/* Caller holds the slot lock */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
 
+	unsigned long handle = zram->table[index].handle;
 	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
 
-	if (unlikely(!page)) {
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	if (unlikely(!handle)) {
 		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
+		 * No memory is allocated for same filled pages.
+		 * Simply clear same page flag.
 		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
+		if (zram_test_flag(zram, index, ZRAM_SAME)) {
+			zram_clear_flag(zram, index, ZRAM_SAME);
+			if (zram->table[index].element)
+				zram_stat_dec(&zram->stats.pages_same);
+			else
+				zram_stat_dec(&zram->stats.pages_zero);
+			zram->table[index].element = 0;
+		}
+
+		/* Written back pages just give their block back */
+		if (zram_test_flag(zram, index, ZRAM_WB)) {
+			clear_bit(zram->table[index].element, zram->bd_bitmap);
+			zram_clear_flag(zram, index, ZRAM_WB);
+			zram_stat_dec(&zram->stats.pages_wb);
+			zram_stat_dec(&zram->stats.pages_stored);
+			zram->table[index].element = 0;
 		}
 		return;
 	}
@@ -143,11 +187,8 @@ static void zram_free_page(struct zram *zram, size_t index)
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram->table[index].size;
+	zs_free(zram->mem_pool, handle);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -155,43 +196,517 @@ out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
+}
+
+static void zram_bd_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Synchronously read or write one page at 'block' on the backing device.
+ * Must not be called from zram's own make_request (the bio would only be
+ * issued after we return).
+ */
+static int zram_bd_rw(struct zram *zram, int rw, unsigned long block,
+			struct page *page)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = (sector_t)block << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->backing_bdev;
+	bio->bi_end_io = zram_bd_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	if (!ret)
+		zram_stat64_inc(zram, rw == READ ? &zram->stats.bd_reads :
+					&zram->stats.bd_writes);
+	return ret;
+}
+
+static unsigned long zram_bd_alloc_block(struct zram *zram)
+{
+	unsigned long block;
+
+	do {
+		block = find_first_zero_bit(zram->bd_bitmap,
+					zram->nr_bd_pages);
+		if (block >= zram->nr_bd_pages)
+			return block;
+	} while (test_and_set_bit(block, zram->bd_bitmap));
+
+	return block;
+}
+
+static void zram_put_backing_dev(struct zram *zram)
+{
+	if (!zram->backing_bdev)
+		return;
+
+	close_bdev_exclusive(zram->backing_bdev, FMODE_READ | FMODE_WRITE);
+	vfree(zram->bd_bitmap);
+	zram->backing_bdev = NULL;
+	zram->bd_bitmap = NULL;
+	zram->nr_bd_pages = 0;
+	zram->backing_dev_name[0] = '\0';
+}
+
+/*
+ * Set (or with an empty path, clear) the backing device. Only allowed
+ * while the device is not initialized.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret = 0;
+	size_t bitmap_sz;
+	struct block_device *bdev;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		pr_info("Cannot change backing device for initialized "
+			"device\n");
+		ret = -EBUSY;
+		goto out;
+	}
+
+	zram_put_backing_dev(zram);
+	if (!*path)
+		goto out;
+
+	bdev = open_bdev_exclusive(path, FMODE_READ | FMODE_WRITE, zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out;
+	}
+
+	zram->nr_bd_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	bitmap_sz = BITS_TO_LONGS(zram->nr_bd_pages) * sizeof(long);
+	zram->bd_bitmap = vmalloc(bitmap_sz);
+	if (!zram->nr_bd_pages || !zram->bd_bitmap) {
+		ret = zram->bd_bitmap ? -EINVAL : -ENOMEM;
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+		vfree(zram->bd_bitmap);
+		zram->bd_bitmap = NULL;
+		zram->nr_bd_pages = 0;
+		goto out;
+	}
+	memset(zram->bd_bitmap, 0, bitmap_sz);
+
+	zram->backing_bdev = bdev;
+	strlcpy(zram->backing_dev_name, path, sizeof(zram->backing_dev_name));
+	pr_info("Backing device %s, %lu pages\n", path, zram->nr_bd_pages);
+
+out:
+	mutex_unlock(&zram->init_lock);
+	return ret;
+}
+
+/* Returns the number of pages freed */
+unsigned long zram_compact(struct zram *zram)
+{
+	unsigned long freed = 0;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done)
+		freed = zs_compact(zram->mem_pool);
+	mutex_unlock(&zram->init_lock);
+
+	return freed;
+}
+
+/* Mark every page currently held in memory as idle */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done)
+		goto out;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_slot_lock(zram, index);
+		if (zram->table[index].handle)
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_slot_unlock(zram, index);
+	}
+out:
+	mutex_unlock(&zram->init_lock);
+}
+
+/*
+ * Write idle incompressible pages out to the backing device and free
+ * their memory. Returns the number of pages written back, or an error if
+ * none could be.
+ */
+int zram_writeback(struct zram *zram)
+{
+	int ret = 0, nr = 0;
+	size_t index;
+	unsigned long block;
+	struct page *page;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->backing_bdev) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_slot_lock(zram, index);
+		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED) ||
+		    !zram_test_flag(zram, index, ZRAM_IDLE)) {
+			zram_slot_unlock(zram, index);
+			continue;
+		}
+		page = zram->table[index].page;
+		get_page(page);
+		zram_slot_unlock(zram, index);
+
+		block = zram_bd_alloc_block(zram);
+		if (block >= zram->nr_bd_pages) {
+			put_page(page);
+			ret = -ENOSPC;
+			break;
+		}
+
+		ret = zram_bd_rw(zram, WRITE, block, page);
+
+		zram_slot_lock(zram, index);
+		/* Rewritten or freed while we were writing it out? */
+		if (ret || !zram_test_flag(zram, index, ZRAM_UNCOMPRESSED) ||
+		    zram->table[index].page != page ||
+		    !zram_test_flag(zram, index, ZRAM_IDLE)) {
+			zram_slot_unlock(zram, index);
+			clear_bit(block, zram->bd_bitmap);
+			put_page(page);
+			if (ret)
+				break;
+			continue;
+		}
+
+		zram->table[index].element = block;
+		zram->table[index].page = NULL;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_clear_flag(zram, index, ZRAM_IDLE);
+		zram_stat_dec(&zram->stats.pages_expand);
+		zram_stat_inc(&zram->stats.pages_wb);
+		zram_stat64_sub(zram, &zram->stats.compr_size, PAGE_SIZE);
+		zram_slot_unlock(zram, index);
+
+		/* Our reference and the table's */
+		put_page(page);
+		__free_page(page);
+		nr++;
+		cond_resched();
+	}
+
+out:
+	mutex_unlock(&zram->init_lock);
+	return nr ? nr : ret;
+}
+
+static void zram_strm_free(struct zram_comp_strm *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+/*
+ * Streams are only ever allocated from process context that may do I/O
+ * (device init and the max_comp_streams knob), since the crypto API
+ * allocates transforms with GFP_KERNEL.
+ */
+static struct zram_comp_strm *zram_strm_alloc(struct zram *zram)
+{
+	struct zram_comp_strm *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (IS_ERR(zstrm->tfm) || !zstrm->buffer) {
+		zram_strm_free(zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+/*
+ * Allocate streams until 'num' exist. Returns the number now available.
+ * Caller must hold init_lock.
+ */
+static int zram_strm_fill(struct zram *zram, int num)
+{
+	struct zram_comp_strm *zstrm;
+
+	while (zram->avail_strm < num) {
+		zstrm = zram_strm_alloc(zram);
+		if (!zstrm)
+			break;
+
+		spin_lock(&zram->strm_lock);
+		list_add(&zstrm->list, &zram->idle_strm);
+		zram->avail_strm++;
+		spin_unlock(&zram->strm_lock);
+		wake_up(&zram->strm_wait);
+	}
+
+	return zram->avail_strm;
+}
+
+/*
+ * Get an idle compression stream, waiting for another reader or writer to
+ * release one if all max_comp_streams are busy.
+ */
+static struct zram_comp_strm *zram_strm_find(struct zram *zram)
+{
+	struct zram_comp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&zram->strm_lock);
+		if (!list_empty(&zram->idle_strm)) {
+			zstrm = list_first_entry(&zram->idle_strm,
+					struct zram_comp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&zram->strm_lock);
+			return zstrm;
+		}
+		spin_unlock(&zram->strm_lock);
+
+		wait_event(zram->strm_wait, !list_empty(&zram->idle_strm));
+	}
+}
+
+static void zram_strm_release(struct zram *zram, struct zram_comp_strm *zstrm)
+{
+	spin_lock(&zram->strm_lock);
+	if (zram->avail_strm <= zram->max_strm) {
+		list_add(&zstrm->list, &zram->idle_strm);
+		spin_unlock(&zram->strm_lock);
+		wake_up(&zram->strm_wait);
+		return;
+	}
+
+	/* max_comp_streams was lowered; drop the surplus stream */
+	zram->avail_strm--;
+	spin_unlock(&zram->strm_lock);
+	zram_strm_free(zstrm);
+}
+
+static void zram_strm_destroy_idle(struct zram *zram, int keep)
+{
+	struct zram_comp_strm *zstrm;
+	LIST_HEAD(victims);
+
+	spin_lock(&zram->strm_lock);
+	while (zram->avail_strm > keep && !list_empty(&zram->idle_strm)) {
+		zstrm = list_first_entry(&zram->idle_strm,
+				struct zram_comp_strm, list);
+		list_move(&zstrm->list, &victims);
+		zram->avail_strm--;
+	}
+	spin_unlock(&zram->strm_lock);
+
+	while (!list_empty(&victims)) {
+		zstrm = list_first_entry(&victims, struct zram_comp_strm, list);
+		list_del(&zstrm->list);
+		zram_strm_free(zstrm);
+	}
+}
+
+void zram_set_max_comp_streams(struct zram *zram, int num)
+{
+	mutex_lock(&zram->init_lock);
+
+	spin_lock(&zram->strm_lock);
+	zram->max_strm = num;
+	spin_unlock(&zram->strm_lock);
+
+	if (zram->init_done)
+		zram_strm_fill(zram, num);
+	zram_strm_destroy_idle(zram, num);
+
+	mutex_unlock(&zram->init_lock);
+}
+
+int zram_set_compressor(struct zram *zram, const char *name)
+{
+	int ret = 0;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		pr_info("Cannot change compressor for initialized device\n");
+		ret = -EBUSY;
+	} else if (!crypto_has_comp(name, 0, 0)) {
+		ret = -EINVAL;
+	} else
+		strlcpy(zram->compressor, name, sizeof(zram->compressor));
+	mutex_unlock(&zram->init_lock);
+
+	return ret;
+}
+
+/*
+ * Per-algorithm statistics survive device resets so that algorithms can
+ * be compared on the same device. Protected by stat64_lock.
+ */
+static struct zram_alg_stats *zram_alg_stats(struct zram *zram)
+{
+	int i;
+
+	for (i = 0; i < ZRAM_MAX_ALG_STATS; i++) {
+		struct zram_alg_stats *as = &zram->alg_stats[i];
+
+		if (!as->name[0])
+			strlcpy(as->name, zram->compressor, sizeof(as->name));
+		if (!strcmp(as->name, zram->compressor))
+			return as;
+	}
+
+	/* Table full: account to the last slot */
+	return &zram->alg_stats[ZRAM_MAX_ALG_STATS - 1];
 }
 
-static void handle_zero_page(struct page *page)
+static void zram_account_comp(struct zram *zram, size_t clen, ktime_t start)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&zram->stat64_lock);
+	zram->cur_alg->orig_bytes += PAGE_SIZE;
+	zram->cur_alg->compr_bytes += clen;
+	zram->cur_alg->comp_ns += ns;
+	zram->cur_alg->nr_comp++;
+	spin_unlock(&zram->stat64_lock);
+}
+
+static void zram_account_decomp(struct zram *zram, ktime_t start)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&zram->stat64_lock);
+	zram->cur_alg->decomp_ns += ns;
+	zram->cur_alg->nr_decomp++;
+	spin_unlock(&zram->stat64_lock);
+}
+
+static void zram_write_begin(struct zram *zram)
+{
+	spin_lock(&zram->stat64_lock);
+	if (zram->active_writes++ == 0)
+		zram->busy_since = ktime_get();
+	spin_unlock(&zram->stat64_lock);
+}
+
+static void zram_write_end(struct zram *zram, u64 bytes)
+{
+	spin_lock(&zram->stat64_lock);
+	zram->stats.write_bytes += bytes;
+	if (--zram->active_writes == 0)
+		zram->stats.write_busy_ns += ktime_to_ns(
+			ktime_sub(ktime_get(), zram->busy_since));
+	spin_unlock(&zram->stat64_lock);
+}
+
+static void handle_same_page(struct page *page, unsigned long element)
 {
 	void *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
+	if (element == 0)
+		memset(user_mem, 0, PAGE_SIZE);
+	else {
+		unsigned long *p = user_mem;
+		unsigned int pos;
+
+		for (pos = 0; pos != PAGE_SIZE / sizeof(*p); pos++)
+			p[pos] = element;
+	}
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
 }
 
+/* Caller holds the slot lock, which keeps writeback off the page */
 static void handle_uncompressed_page(struct zram *zram,
 				struct page *page, u32 index)
 {
 	unsigned char *user_mem, *cmem;
 
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
 	kunmap_atomic(cmem, KM_USER1);
+}
+
+/* Returns -EAGAIN if the page was freed or rewritten meanwhile */
+static int handle_wb_page(struct zram *zram, struct page *page, u32 index)
+{
+	unsigned long block;
+
+	zram_slot_lock(zram, index);
+	if (!zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_slot_unlock(zram, index);
+		return -EAGAIN;
+	}
+	block = zram->table[index].element;
+	zram_slot_unlock(zram, index);
+
+	if (zram_bd_rw(zram, READ, block, page))
+		return -EIO;
 
 	flush_dcache_page(page);
+	return 0;
+}
+
+/*
+ * Reads that hit written back pages must wait for the backing device,
+ * which cannot be done from within our make_request; they are redone
+ * from a work item on zram_wb_wq.
+ */
+static void zram_defer_read(struct zram *zram, struct bio *bio)
+{
+	spin_lock(&zram->wb_lock);
+	bio_list_add(&zram->wb_bios, bio);
+	spin_unlock(&zram->wb_lock);
+
+	queue_work(zram_wb_wq, &zram->wb_work);
 }
 
-static int zram_read(struct zram *zram, struct bio *bio)
+static int zram_read(struct zram *zram, struct bio *bio, int can_block)
 {
 
 	int i;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_comp_strm *zstrm = NULL;
 
 	if (unlikely(!zram->init_done)) {
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
@@ -199,26 +714,54 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		return 0;
 	}
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
+	/* Deferred bios were already counted */
+	if (!can_block)
+		zram_stat64_inc(zram, &zram->stats.num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
+		unsigned int clen;
+		ktime_t start;
 		struct page *page;
-		struct zobj_header *zheader;
 		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
+retry:
+		zram_slot_lock(zram, index);
+		if (zram_test_flag(zram, index, ZRAM_SAME)) {
+			unsigned long element = zram->table[index].element;
+
+			zram_slot_unlock(zram, index);
+			handle_same_page(page, element);
+			index++;
+			continue;
+		}
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+			zram_slot_unlock(zram, index);
+			if (!can_block) {
+				if (zstrm)
+					zram_strm_release(zram, zstrm);
+				zram_defer_read(zram, bio);
+				return 0;
+			}
+			ret = handle_wb_page(zram, page, index);
+			if (ret == -EAGAIN)
+				goto retry;
+			if (ret) {
+				pr_err("Backing device read failed! page=%u\n",
+					index);
+				zram_stat64_inc(zram, &zram->stats.failed_reads);
+				goto out;
+			}
 			index++;
 			continue;
 		}
 
 		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
+		if (unlikely(!zram->table[index].handle)) {
+			zram_slot_unlock(zram, index);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			/* Do nothing */
@@ -229,26 +772,36 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		/* Page is stored uncompressed since it's incompressible */
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 			handle_uncompressed_page(zram, page, index);
+			zram_slot_unlock(zram, index);
+			flush_dcache_page(page);
 			index++;
 			continue;
 		}
 
+		/* Getting a stream may sleep, so not under the slot lock */
+		if (!zstrm) {
+			zram_slot_unlock(zram, index);
+			zstrm = zram_strm_find(zram);
+			goto retry;
+		}
+
 		user_mem = kmap_atomic(page, KM_USER0);
 		clen = PAGE_SIZE;
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, zram->table[index].handle,
+				     ZS_MM_RO);
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+		start = ktime_get();
+		ret = crypto_comp_decompress(zstrm->tfm, cmem,
+			zram->table[index].size, user_mem, &clen);
 
+		zs_unmap_object(zram->mem_pool, zram->table[index].handle);
 		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		zram_slot_unlock(zram, index);
+		zram_account_decomp(zram, start);
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret || clen != PAGE_SIZE)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
@@ -259,20 +812,41 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		index++;
 	}
 
+	if (zstrm)
+		zram_strm_release(zram, zstrm);
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
 
 out:
+	if (zstrm)
+		zram_strm_release(zram, zstrm);
 	bio_io_error(bio);
 	return 0;
 }
 
+static void zram_wb_read_work(struct work_struct *work)
+{
+	struct bio *bio;
+	struct zram *zram = container_of(work, struct zram, wb_work);
+
+	for (;;) {
+		spin_lock(&zram->wb_lock);
+		bio = bio_list_pop(&zram->wb_bios);
+		spin_unlock(&zram->wb_lock);
+		if (!bio)
+			break;
+
+		zram_read(zram, bio, 1);
+	}
+}
+
 static int zram_write(struct zram *zram, struct bio *bio)
 {
 	int i, ret;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_comp_strm *zstrm;
 
 	if (unlikely(!zram->init_done)) {
 		ret = zram_init_device(zram);
@@ -283,103 +857,110 @@ static int zram_write(struct zram *zram, struct bio *bio)
 	zram_stat64_inc(zram, &zram->stats.num_writes);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
+	zram_write_begin(zram);
+	zstrm = zram_strm_find(zram);
+
 	bio_for_each_segment(bvec, bio, i) {
-		u32 offset;
-		size_t clen;
-		struct zobj_header *zheader;
+		unsigned int clen;
+		unsigned long element, handle;
+		ktime_t start;
 		struct page *page, *page_store;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
-
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
+		src = zstrm->buffer;
 
 		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
+		if (page_same_filled(user_mem, &element)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
+			zram_slot_lock(zram, index);
+			zram_free_page(zram, index);
+			if (element)
+				zram_stat_inc(&zram->stats.pages_same);
+			else
+				zram_stat_inc(&zram->stats.pages_zero);
+			zram->table[index].element = element;
+			zram_set_flag(zram, index, ZRAM_SAME);
+			zram_slot_unlock(zram, index);
 			index++;
 			continue;
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		/*
+		 * Compress into this writer's own stream, with no lock held.
+		 * The output buffer is two pages; a backend that still runs
+		 * out of room just means the page is incompressible.
+		 */
+		clen = 2 * PAGE_SIZE;
+		start = ktime_get();
+		ret = crypto_comp_compress(zstrm->tfm, user_mem, PAGE_SIZE,
+					   src, &clen);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
-			pr_err("Compression failed! err=%d\n", ret);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
-		}
+		if (unlikely(ret))
+			clen = PAGE_SIZE;
+		zram_account_comp(zram, clen, start);
 
 		/*
 		 * Page is incompressible. Store it as-is (uncompressed)
 		 * since we do not want to return too many disk write
 		 * errors which has side effect of hanging the system.
+		 *
+		 * The new object is allocated and filled with no lock held;
+		 * it only becomes visible once it is put in the table.
 		 */
 		if (unlikely(clen > max_zpage_size)) {
 			clen = PAGE_SIZE;
+			handle = 0;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
 					&zram->stats.failed_writes);
-				goto out;
+				goto out_strm;
 			}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
 			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
-		}
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, src, clen);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(src, KM_USER0);
+		} else {
+			page_store = NULL;
+			handle = zs_malloc(zram->mem_pool, clen,
+					   GFP_NOIO | __GFP_HIGHMEM);
+			if (!handle) {
+				pr_info("Error allocating memory for "
+					"compressed page: %u, size=%u\n",
+					index, clen);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_writes);
+				goto out_strm;
+			}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+			cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+			memcpy(cmem, src, clen);
+			zs_unmap_object(zram->mem_pool, handle);
 		}
 
-memstore:
-		zram->table[index].offset = offset;
+		zram_slot_lock(zram, index);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_free_page(zram, index);
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
+		if (unlikely(page_store)) {
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_stat_inc(&zram->stats.pages_expand);
+			zram->table[index].page = page_store;
+		} else {
+			zram->table[index].handle = handle;
+			zram->table[index].size = clen;
 		}
-#endif
-
-		memcpy(cmem, src, clen);
-
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
 
 		/* Update stats */
 		zram_stat64_add(zram, &zram->stats.compr_size, clen);
@@ -387,14 +968,21 @@ memstore:
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
 
-		mutex_unlock(&zram->lock);
+		zram_slot_unlock(zram, index);
+
 		index++;
 	}
 
+	zram_strm_release(zram, zstrm);
+	zram_write_end(zram, bio->bi_size);
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
 
+out_strm:
+	zram_strm_release(zram, zstrm);
+	zram_write_end(zram, 0);
 out:
 	bio_io_error(bio);
 	return 0;
@@ -433,7 +1021,7 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 
 	switch (bio_data_dir(bio)) {
 	case READ:
-		ret = zram_read(zram, bio);
+		ret = zram_read(zram, bio, 0);
 		break;
 
 	case WRITE:
@@ -448,39 +1036,41 @@ void zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
+	/* Let deferred backing device reads finish first */
+	flush_work(&zram->wb_work);
+
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free the compression streams; no writer can hold one here */
+	zram_strm_destroy_idle(zram, 0);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		struct page *page;
-		u16 offset;
+		unsigned long handle;
 
 		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
-			continue;
+		handle = zram->table[index].handle;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
 			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+		else if (handle)
+			zs_free(zram->mem_pool, handle);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+	/* Written back blocks are all free again; the device stays set */
+	if (zram->bd_bitmap)
+		memset(zram->bd_bitmap, 0,
+			BITS_TO_LONGS(zram->nr_bd_pages) * sizeof(long));
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -500,19 +1090,16 @@ int zram_init_device(struct zram *zram)
 		return 0;
 	}
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
+	if (!zram_strm_fill(zram, zram->max_strm)) {
+		pr_err("Error allocating %s compression stream!\n",
+			zram->compressor);
 		ret = -ENOMEM;
 		goto fail;
 	}
 
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
+	spin_lock(&zram->stat64_lock);
+	zram->cur_alg = zram_alg_stats(zram);
+	spin_unlock(&zram->stat64_lock);
 
 	num_pages = zram->disksize >> PAGE_SHIFT;
 	zram->table = vmalloc(num_pages * sizeof(*zram->table));
@@ -528,7 +1115,7 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -555,7 +1142,9 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_slot_lock(zram, index);
 	zram_free_page(zram, index);
+	zram_slot_unlock(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -568,9 +1157,16 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->strm_lock);
+	INIT_LIST_HEAD(&zram->idle_strm);
+	init_waitqueue_head(&zram->strm_wait);
+	spin_lock_init(&zram->wb_lock);
+	bio_list_init(&zram->wb_bios);
+	INIT_WORK(&zram->wb_work, zram_wb_read_work);
+	zram->max_strm = num_online_cpus();
+	strlcpy(zram->compressor, default_compressor, sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -668,11 +1264,23 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	ret = zs_init();
+	if (ret) {
+		pr_warning("Unable to initialize memory allocator\n");
+		goto out;
+	}
+
+	zram_wb_wq = create_workqueue("zram_wb");
+	if (!zram_wb_wq) {
+		ret = -ENOMEM;
+		goto free_zs;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
 	/* Allocate the device array and initialize each one */
@@ -697,6 +1305,10 @@ free_devices:
 	kfree(devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+destroy_wq:
+	destroy_workqueue(zram_wb_wq);
+free_zs:
+	zs_exit();
 out:
 	return ret;
 }
@@ -712,9 +1324,12 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		zram_put_backing_dev(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
+	destroy_workqueue(zram_wb_wq);
+	zs_exit();
 
 	kfree(devices);
 	pr_debug("Cleanup done!\n");
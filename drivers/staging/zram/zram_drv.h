@@ -17,8 +17,13 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/crypto.h>
+#include <linux/bio.h>
+#include <linux/workqueue.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,23 +31,14 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = CONFIG_ZRAM_DEFAULT_PERCENTAGE;
 
+/* Compression backend used unless set through sysfs 'comp_algorithm' */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -50,9 +46,9 @@ static const unsigned default_disksize_perc_ram = CONFIG_ZRAM_DEFAULT_PERCENTAGE
 static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
- * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ * NOTE: max_zpage_size must be less than PAGE_SIZE minus the word
+ * zs_malloc() keeps in front of each object, otherwise zs_malloc()
+ * would always return failure.
  */
 
 /*-- End of configurable params */
@@ -67,20 +63,36 @@ enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is one word repeated; table[].element holds the word */
+	ZRAM_SAME,
+
+	/* Page lives on the backing device at block table[].element */
+	ZRAM_WB,
+
+	/* Page not accessed since last marked idle (writeback candidate) */
+	ZRAM_IDLE,
+
+	/* Bit spinlock protecting the table entry; see zram_slot_lock() */
+	ZRAM_ACCESS,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
-/* Allocated for each disk page */
+/*
+ * Allocated for each disk page. Changes to an entry, including its flags,
+ * are made with the entry's ZRAM_ACCESS bit lock held.
+ */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		unsigned long handle;	/* zsmalloc handle of object */
+		struct page *page;	/* ZRAM_UNCOMPRESSED page */
+	};
+	unsigned long element;	/* ZRAM_SAME word or ZRAM_WB block */
+	unsigned long flags;	/* zram_pageflags */
+	u16 size;		/* compressed object size */
 	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
 } __attribute__((aligned(4)));
 
 struct zram_stats {
@@ -91,20 +103,76 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_same;	/* no. of other same-value filled pages */
+	atomic_t pages_wb;	/* no. of pages on the backing device */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+	u64 write_bytes;	/* bytes written successfully */
+	u64 write_busy_ns;	/* time with at least one write in flight */
+};
+
+/* Compression and decompression totals for one backend */
+struct zram_alg_stats {
+	char name[CRYPTO_MAX_ALG_NAME];
+	u64 orig_bytes;		/* bytes fed to the compressor */
+	u64 compr_bytes;	/* bytes it produced */
+	u64 comp_ns;
+	u64 nr_comp;
+	u64 decomp_ns;
+	u64 nr_decomp;
+};
+
+#define ZRAM_MAX_ALG_STATS	4
+
+/*
+ * A compression stream: a crypto compression transform (which carries the
+ * backend's working memory) and an output buffer, used by one compressor
+ * or decompressor invocation at a time.
+ */
+struct zram_comp_strm {
+	struct crypto_comp *tfm;
+	void *buffer;		/* 2 pages: compressed output may expand */
+	struct list_head list;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	/*
+	 * Pool of compression streams. Writers compress in parallel, each
+	 * with its own stream; at most max_strm streams are allocated.
+	 */
+	spinlock_t strm_lock;
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;
+	int max_strm;
+	/* Crypto API compression backend, fixed while init_done */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+	/* Per-backend stats, kept across resets; stat64_lock */
+	struct zram_alg_stats alg_stats[ZRAM_MAX_ALG_STATS];
+	struct zram_alg_stats *cur_alg;
+	/*
+	 * Optional backing device that idle incompressible pages are
+	 * written back to; one bit per PAGE_SIZE block in bd_bitmap.
+	 * Configured only while the device is not initialized.
+	 */
+	struct block_device *backing_bdev;
+	char backing_dev_name[64];
+	unsigned long *bd_bitmap;
+	unsigned long nr_bd_pages;
+	/* Reads of written back pages, deferred to zram_wb_wq */
+	spinlock_t wb_lock;
+	struct bio_list wb_bios;
+	struct work_struct wb_work;
+	/* Write throughput accounting, protected by stat64_lock */
+	int active_writes;
+	ktime_t busy_since;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -127,5 +195,11 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern void zram_set_max_comp_streams(struct zram *zram, int num);
+extern int zram_set_compressor(struct zram *zram, const char *name);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram);
+extern unsigned long zram_compact(struct zram *zram);
+extern int zram_writeback(struct zram *zram);
 
 #endif
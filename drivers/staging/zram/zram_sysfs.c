@@ -14,6 +14,7 @@
 
 #include <linux/device.h>
 #include <linux/genhd.h>
+#include <linux/math64.h>
 
 #include "zram_drv.h"
 
@@ -154,7 +155,15 @@ static ssize_t zero_pages_show(struct device *dev,
 {
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%u\n", zram->stats.pages_zero);
+	return sprintf(buf, "%d\n", atomic_read(&zram->stats.pages_zero));
+}
+
+static ssize_t same_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", atomic_read(&zram->stats.pages_same));
 }
 
 static ssize_t orig_data_size_show(struct device *dev,
@@ -163,7 +172,7 @@ static ssize_t orig_data_size_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		(u64)(zram->stats.pages_stored) << PAGE_SHIFT);
+		(u64)atomic_read(&zram->stats.pages_stored) << PAGE_SHIFT);
 }
 
 static ssize_t compr_data_size_show(struct device *dev,
@@ -182,13 +191,249 @@ static ssize_t mem_used_total_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	if (zram->init_done) {
-		val = xv_get_total_size_bytes(zram->mem_pool) +
-			((u64)(zram->stats.pages_expand) << PAGE_SHIFT);
+		val = zs_get_total_size_bytes(zram->mem_pool) +
+			((u64)atomic_read(&zram->stats.pages_expand) <<
+				PAGE_SHIFT);
 	}
 
 	return sprintf(buf, "%llu\n", val);
 }
 
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	zram_compact(zram);
+	return len;
+}
+
+static ssize_t num_compacted_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	unsigned long val = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done)
+		val = zs_get_compacted(zram->mem_pool);
+	mutex_unlock(&zram->init_lock);
+
+	return sprintf(buf, "%lu\n", val);
+}
+
+static ssize_t frag_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i;
+	ssize_t sz;
+	struct zs_class_stats cs;
+	struct zram *zram = dev_to_zram(dev);
+
+	sz = sprintf(buf, "class_size pages_per_zspage zspages "
+		     "objs_allocated objs_inuse\n");
+
+	mutex_lock(&zram->init_lock);
+	for (i = 0; zram->init_done &&
+		    !zs_get_class_stats(zram->mem_pool, i, &cs); i++) {
+		if (!cs.zspages)
+			continue;
+		/* Keep room for the longest possible line */
+		if (sz > PAGE_SIZE - 80)
+			break;
+		sz += sprintf(buf + sz, "%u %u %lu %lu %lu\n", cs.size,
+			cs.pages_per_zspage, cs.zspages,
+			cs.objs_allocated, cs.objs_inuse);
+	}
+	mutex_unlock(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t max_comp_streams_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->max_strm);
+}
+
+static ssize_t max_comp_streams_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long num;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &num);
+	if (ret)
+		return ret;
+
+	if (!num || num > num_possible_cpus() * 2)
+		return -EINVAL;
+
+	zram_set_max_comp_streams(zram, num);
+
+	return len;
+}
+
+static ssize_t write_mbps_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u64 bytes, busy_ns;
+	struct zram *zram = dev_to_zram(dev);
+
+	spin_lock(&zram->stat64_lock);
+	bytes = zram->stats.write_bytes;
+	busy_ns = zram->stats.write_busy_ns;
+	spin_unlock(&zram->stat64_lock);
+
+	if (!busy_ns)
+		return sprintf(buf, "0\n");
+
+	/* bytes per nanosecond * 1000 == 10^6 bytes per second */
+	return sprintf(buf, "%llu\n", div64_u64(bytes * 1000, busy_ns));
+}
+
+/* Backends offered in comp_algorithm; any crypto "compress" alg works */
+static const char * const zram_comp_names[] = { "lzo", "deflate" };
+
+static ssize_t comp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i, found = 0;
+	ssize_t sz = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	for (i = 0; i < ARRAY_SIZE(zram_comp_names); i++) {
+		const char *name = zram_comp_names[i];
+
+		if (!strcmp(name, zram->compressor)) {
+			sz += sprintf(buf + sz, "[%s] ", name);
+			found = 1;
+		} else if (crypto_has_comp(name, 0, 0))
+			sz += sprintf(buf + sz, "%s ", name);
+	}
+	if (!found)
+		sz += sprintf(buf + sz, "[%s] ", zram->compressor);
+
+	buf[sz - 1] = '\n';
+	return sz;
+}
+
+static ssize_t comp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	char name[CRYPTO_MAX_ALG_NAME];
+	struct zram *zram = dev_to_zram(dev);
+
+	strlcpy(name, buf, sizeof(name));
+	ret = zram_set_compressor(zram, strstrip(name));
+	if (ret)
+		return ret;
+
+	return len;
+}
+
+static ssize_t comp_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i;
+	ssize_t sz;
+	struct zram *zram = dev_to_zram(dev);
+
+	sz = sprintf(buf, "algorithm orig_bytes compr_bytes ratio_pct "
+		     "comp_ns_per_page decomp_ns_per_page\n");
+
+	spin_lock(&zram->stat64_lock);
+	for (i = 0; i < ZRAM_MAX_ALG_STATS; i++) {
+		struct zram_alg_stats *as = &zram->alg_stats[i];
+
+		if (!as->name[0])
+			break;
+		sz += sprintf(buf + sz, "%s %llu %llu %llu %llu %llu\n",
+			as->name, as->orig_bytes, as->compr_bytes,
+			as->orig_bytes ?
+				div64_u64(as->compr_bytes * 100,
+					  as->orig_bytes) : 0,
+			as->nr_comp ? div64_u64(as->comp_ns, as->nr_comp) : 0,
+			as->nr_decomp ?
+				div64_u64(as->decomp_ns, as->nr_decomp) : 0);
+	}
+	spin_unlock(&zram->stat64_lock);
+
+	return sz;
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%s\n", zram->backing_bdev ?
+			zram->backing_dev_name : "none");
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	char *path;
+	char name[sizeof(((struct zram *)0)->backing_dev_name)];
+	struct zram *zram = dev_to_zram(dev);
+
+	strlcpy(name, buf, sizeof(name));
+	path = strstrip(name);
+	if (!strcmp(path, "none"))
+		*path = '\0';
+
+	ret = zram_set_backing_dev(zram, path);
+	if (ret)
+		return ret;
+
+	return len;
+}
+
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	if (!sysfs_streq(buf, "all"))
+		return -EINVAL;
+
+	zram_mark_idle(zram);
+	return len;
+}
+
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (!sysfs_streq(buf, "idle"))
+		return -EINVAL;
+
+	ret = zram_writeback(zram);
+	if (ret < 0)
+		return ret;
+
+	return len;
+}
+
+static ssize_t bd_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d %llu %llu\n",
+		atomic_read(&zram->stats.pages_wb),
+		zram_stat64_read(zram, &zram->stats.bd_reads),
+		zram_stat64_read(zram, &zram->stats.bd_writes));
+}
+
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR,
 		disksize_show, disksize_store);
 static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
@@ -198,9 +443,24 @@ static DEVICE_ATTR(num_writes, S_IRUGO, num_writes_show, NULL);
 static DEVICE_ATTR(invalid_io, S_IRUGO, invalid_io_show, NULL);
 static DEVICE_ATTR(notify_free, S_IRUGO, notify_free_show, NULL);
 static DEVICE_ATTR(zero_pages, S_IRUGO, zero_pages_show, NULL);
+static DEVICE_ATTR(same_pages, S_IRUGO, same_pages_show, NULL);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(compr_data_size, S_IRUGO, compr_data_size_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(num_compacted, S_IRUGO, num_compacted_show, NULL);
+static DEVICE_ATTR(frag_stats, S_IRUGO, frag_stats_show, NULL);
+static DEVICE_ATTR(max_comp_streams, S_IRUGO | S_IWUSR,
+		max_comp_streams_show, max_comp_streams_store);
+static DEVICE_ATTR(write_mbps, S_IRUGO, write_mbps_show, NULL);
+static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
+		comp_algorithm_show, comp_algorithm_store);
+static DEVICE_ATTR(comp_stats, S_IRUGO, comp_stats_show, NULL);
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+static DEVICE_ATTR(bd_stat, S_IRUGO, bd_stat_show, NULL);
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
@@ -211,9 +471,21 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_invalid_io.attr,
 	&dev_attr_notify_free.attr,
 	&dev_attr_zero_pages.attr,
+	&dev_attr_same_pages.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_num_compacted.attr,
+	&dev_attr_frag_stats.attr,
+	&dev_attr_max_comp_streams.attr,
+	&dev_attr_write_mbps.attr,
+	&dev_attr_comp_algorithm.attr,
+	&dev_attr_comp_stats.attr,
+	&dev_attr_backing_dev.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_stat.attr,
 	NULL,
 };
 
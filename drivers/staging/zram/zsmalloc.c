@@ -0,0 +1,666 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are grouped into size classes ZS_SIZE_CLASS_DELTA bytes
+ * apart. Each class carves its objects out of zspages: groups of up to
+ * ZS_MAX_PAGES_PER_ZSPAGE pages, sized so that the objects waste as
+ * little of them as possible, with objects allowed to cross page
+ * boundaries. Callers get an opaque handle and access the object with
+ * zs_map_object()/zs_unmap_object().
+ *
+ * Handles are indirect so objects can be moved: zs_compact() (also run
+ * from a shrinker under memory pressure) drains sparsely used zspages
+ * into the fuller ones of the same class and frees them.
+ */
+
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/bit_spinlock.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static struct kmem_cache *zs_handle_cachep;
+static DEFINE_PER_CPU(struct zs_map_area, zs_map_area);
+
+/* All pools, for the shrinker */
+static LIST_HEAD(zs_pools);
+static DECLARE_RWSEM(zs_pools_sem);
+
+static unsigned int get_size_class_index(size_t size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/*
+ * Pick the zspage size (in pages) that leaves the smallest fraction
+ * unused at the tail for objects of the given size.
+ */
+static unsigned int get_pages_per_zspage(unsigned int class_size)
+{
+	unsigned int i, best = 1, max_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int waste = zspage_size % class_size;
+		unsigned int usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+					struct zspage *zspage)
+{
+	unsigned int inuse = zspage->inuse;
+	unsigned int max = class->objs_per_zspage;
+
+	if (inuse == 0)
+		return ZS_EMPTY;
+	if (inuse == max)
+		return ZS_FULL;
+	if (inuse * 4 <= max * ZS_ALMOST_FULL_QUARTERS)
+		return ZS_ALMOST_EMPTY;
+	return ZS_ALMOST_FULL;
+}
+
+/*
+ * Move zspage to the list matching its current occupancy. Empty
+ * zspages are taken off the lists; the caller frees them.
+ */
+static enum fullness_group fix_fullness_group(struct size_class *class,
+					struct zspage *zspage)
+{
+	enum fullness_group newfg;
+
+	newfg = get_fullness_group(class, zspage);
+	if (newfg == zspage->fullness)
+		return newfg;
+
+	list_del_init(&zspage->list);
+	if (newfg != ZS_EMPTY)
+		list_add(&zspage->list, &class->fullness_list[newfg]);
+	zspage->fullness = newfg;
+
+	return newfg;
+}
+
+/* A zspage with a free slot, preferring the fuller ones */
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	struct list_head *head;
+
+	head = &class->fullness_list[ZS_ALMOST_FULL];
+	if (list_empty(head))
+		head = &class->fullness_list[ZS_ALMOST_EMPTY];
+	if (list_empty(head))
+		return NULL;
+
+	return list_first_entry(head, struct zspage, list);
+}
+
+/*
+ * Map the first word of object idx. It never straddles a page since
+ * class sizes and PAGE_SIZE are both multiples of the word size.
+ */
+static unsigned long *obj_head_map(struct size_class *class,
+				struct zspage *zspage, unsigned int idx)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+	char *addr;
+
+	addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER1);
+	return (unsigned long *)(addr + (off & ~PAGE_MASK));
+}
+
+static void obj_head_unmap(unsigned long *head)
+{
+	kunmap_atomic(head, KM_USER1);
+}
+
+/*
+ * Copy bytes [start, class->size) of object idx to (!write) or from
+ * (write) buf + start.
+ */
+static void obj_copy(struct size_class *class, struct zspage *zspage,
+			unsigned int idx, char *buf, size_t start, int write)
+{
+	unsigned long off = (unsigned long)idx * class->size + start;
+	struct page **page = &zspage->pages[off >> PAGE_SHIFT];
+	size_t len = class->size - start;
+	char *addr;
+
+	buf += start;
+	off &= ~PAGE_MASK;
+	while (len) {
+		size_t n = min_t(size_t, len, PAGE_SIZE - off);
+
+		addr = kmap_atomic(*page, KM_USER1);
+		if (write)
+			memcpy(addr + off, buf, n);
+		else
+			memcpy(buf, addr + off, n);
+		kunmap_atomic(addr, KM_USER1);
+
+		buf += n;
+		len -= n;
+		off = 0;
+		page++;
+	}
+}
+
+/* Take a free slot off zspage's free list; the caller fills its head */
+static unsigned int obj_alloc_slot(struct size_class *class,
+				struct zspage *zspage)
+{
+	unsigned int idx = zspage->freeobj;
+	unsigned long *head;
+
+	head = obj_head_map(class, zspage, idx);
+	zspage->freeobj = *head >> OBJ_TAG_BITS;
+	obj_head_unmap(head);
+
+	zspage->inuse++;
+	class->objs_inuse++;
+	return idx;
+}
+
+static void obj_free_slot(struct size_class *class, struct zspage *zspage,
+			unsigned int idx)
+{
+	unsigned long *head;
+
+	head = obj_head_map(class, zspage, idx);
+	*head = (unsigned long)zspage->freeobj << OBJ_TAG_BITS;
+	obj_head_unmap(head);
+
+	zspage->freeobj = idx;
+	zspage->inuse--;
+	class->objs_inuse--;
+}
+
+static void free_zspage(struct size_class *class, struct zspage *zspage)
+{
+	unsigned int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+}
+
+static struct zspage *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	unsigned int i;
+	unsigned long off;
+	struct zspage *zspage;
+	char *addr = NULL;
+	unsigned long cur = ~0UL;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i])
+			goto fail;
+	}
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class = class;
+	zspage->fullness = ZS_EMPTY;
+
+	/* Thread the free list through all objects, in order */
+	for (i = 0; i < class->objs_per_zspage; i++) {
+		off = (unsigned long)i * class->size;
+		if ((off >> PAGE_SHIFT) != cur) {
+			if (addr)
+				kunmap_atomic(addr, KM_USER1);
+			cur = off >> PAGE_SHIFT;
+			addr = kmap_atomic(zspage->pages[cur], KM_USER1);
+		}
+		*(unsigned long *)(addr + (off & ~PAGE_MASK)) =
+				(unsigned long)(i + 1) << OBJ_TAG_BITS;
+	}
+	kunmap_atomic(addr, KM_USER1);
+
+	return zspage;
+
+fail:
+	while (i--)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+	return NULL;
+}
+
+/**
+ * zs_malloc - allocate an object from the pool
+ * @pool: pool to allocate from
+ * @size: size of the object
+ * @flags: gfp flags for any new pages; may include __GFP_HIGHMEM
+ *
+ * Returns a handle to the object, or 0 on failure. The object is
+ * accessed through zs_map_object().
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	struct zs_handle *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned long *head;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return 0;
+
+	handle = kmem_cache_alloc(zs_handle_cachep, flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+	handle->flags = 0;
+
+	class = pool->size_class[get_size_class_index(size + ZS_HANDLE_SIZE)];
+	handle->class = class;
+
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(class, flags);
+		if (!zspage) {
+			kmem_cache_free(zs_handle_cachep, handle);
+			return 0;
+		}
+		atomic_long_add(class->pages_per_zspage,
+				&pool->pages_allocated);
+
+		spin_lock(&class->lock);
+		class->zspages++;
+	}
+
+	handle->zspage = zspage;
+	handle->idx = obj_alloc_slot(class, zspage);
+	head = obj_head_map(class, zspage, handle->idx);
+	*head = (unsigned long)handle | OBJ_ALLOCATED_TAG;
+	obj_head_unmap(head);
+
+	fix_fullness_group(class, zspage);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+
+void zs_free(struct zs_pool *pool, unsigned long h)
+{
+	struct zs_handle *handle = (struct zs_handle *)h;
+	struct size_class *class = handle->class;
+	struct zspage *zspage;
+	enum fullness_group fg;
+
+	spin_lock(&class->lock);
+	zspage = handle->zspage;
+	obj_free_slot(class, zspage, handle->idx);
+	fg = fix_fullness_group(class, zspage);
+	if (fg == ZS_EMPTY)
+		class->zspages--;
+	spin_unlock(&class->lock);
+
+	if (fg == ZS_EMPTY) {
+		atomic_long_sub(class->pages_per_zspage,
+				&pool->pages_allocated);
+		free_zspage(class, zspage);
+	}
+
+	kmem_cache_free(zs_handle_cachep, handle);
+}
+
+/**
+ * zs_map_object - get a pointer to an object's data
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ * @mm: how the object is going to be accessed
+ *
+ * Pins the object against compaction and disables preemption until
+ * zs_unmap_object(); only one object can be mapped per CPU at a time.
+ * Uses the KM_USER1 kmap slot.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long h,
+			enum zs_mapmode mm)
+{
+	struct zs_handle *handle = (struct zs_handle *)h;
+	struct size_class *class = handle->class;
+	struct zs_map_area *area;
+	unsigned long off;
+	struct page *page;
+
+	bit_spin_lock(HANDLE_PIN_BIT, &handle->flags);
+
+	off = (unsigned long)handle->idx * class->size;
+	page = handle->zspage->pages[off >> PAGE_SHIFT];
+	off &= ~PAGE_MASK;
+
+	area = &get_cpu_var(zs_map_area);
+	area->vm_mm = mm;
+	if (off + class->size <= PAGE_SIZE) {
+		area->vm_addr = kmap_atomic(page, KM_USER1);
+		return area->vm_addr + off + ZS_HANDLE_SIZE;
+	}
+
+	/* Straddles two pages: work on a copy */
+	area->vm_addr = NULL;
+	if (mm != ZS_MM_WO)
+		obj_copy(class, handle->zspage, handle->idx, area->vm_buf,
+			ZS_HANDLE_SIZE, 0);
+	return area->vm_buf + ZS_HANDLE_SIZE;
+}
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long h)
+{
+	struct zs_handle *handle = (struct zs_handle *)h;
+	struct zs_map_area *area;
+
+	area = &__get_cpu_var(zs_map_area);
+	if (area->vm_addr)
+		kunmap_atomic(area->vm_addr, KM_USER1);
+	else if (area->vm_mm != ZS_MM_RO)
+		obj_copy(handle->class, handle->zspage, handle->idx,
+			area->vm_buf, ZS_HANDLE_SIZE, 1);
+	put_cpu_var(zs_map_area);
+
+	bit_spin_unlock(HANDLE_PIN_BIT, &handle->flags);
+}
+
+/* Number of zspages the class could do without if it were packed */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_wasted;
+
+	if (list_empty(&class->fullness_list[ZS_ALMOST_EMPTY]))
+		return 0;
+
+	obj_wasted = class->zspages * class->objs_per_zspage -
+			class->objs_inuse;
+	return obj_wasted / class->objs_per_zspage;
+}
+
+/*
+ * Move every object out of src, which is off the fullness lists, into
+ * other zspages of the class. Stops early if an object is mapped.
+ * Called with the class lock held and preemption thus disabled.
+ */
+static void zs_migrate_zspage(struct size_class *class, struct zspage *src)
+{
+	unsigned int idx, new_idx;
+	struct zs_handle *handle;
+	struct zspage *dst;
+	unsigned long *head;
+	char *buf = __get_cpu_var(zs_map_area).vm_buf;
+
+	for (idx = 0; idx < class->objs_per_zspage && src->inuse; idx++) {
+		head = obj_head_map(class, src, idx);
+		handle = (struct zs_handle *)(*head & ~OBJ_ALLOCATED_TAG);
+		if (!(*head & OBJ_ALLOCATED_TAG))
+			handle = NULL;
+		obj_head_unmap(head);
+
+		if (!handle)
+			continue;
+		if (!bit_spin_trylock(HANDLE_PIN_BIT, &handle->flags))
+			break;
+
+		/* There is room elsewhere, see zs_can_compact() */
+		dst = find_get_zspage(class);
+		new_idx = obj_alloc_slot(class, dst);
+		obj_copy(class, src, idx, buf, 0, 0);
+		obj_copy(class, dst, new_idx, buf, 0, 1);
+		obj_free_slot(class, src, idx);
+		fix_fullness_group(class, dst);
+
+		handle->zspage = dst;
+		handle->idx = new_idx;
+		bit_spin_unlock(HANDLE_PIN_BIT, &handle->flags);
+	}
+}
+
+static unsigned long zs_compact_class(struct zs_pool *pool,
+				struct size_class *class)
+{
+	unsigned long freed = 0;
+	struct list_head *almost_empty;
+	struct zspage *src;
+
+	almost_empty = &class->fullness_list[ZS_ALMOST_EMPTY];
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class)) {
+		/* The least recently added sparse zspage */
+		src = list_entry(almost_empty->prev, struct zspage, list);
+		list_del_init(&src->list);
+		src->fullness = ZS_EMPTY;
+
+		zs_migrate_zspage(class, src);
+
+		if (fix_fullness_group(class, src) != ZS_EMPTY)
+			break;
+
+		class->zspages--;
+		spin_unlock(&class->lock);
+
+		atomic_long_sub(class->pages_per_zspage,
+				&pool->pages_allocated);
+		free_zspage(class, src);
+		freed += class->pages_per_zspage;
+		cond_resched();
+
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - release sparsely used zspages
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--)
+		freed += zs_compact_class(pool, pool->size_class[i]);
+
+	atomic_long_add(freed, &pool->pages_compacted);
+	return freed;
+}
+
+static unsigned long zs_compactable_pages(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+	struct size_class *class;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		class = pool->size_class[i];
+		spin_lock(&class->lock);
+		pages += zs_can_compact(class) * class->pages_per_zspage;
+		spin_unlock(&class->lock);
+	}
+
+	return pages;
+}
+
+static int zs_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct zs_pool *pool;
+	unsigned long pages = 0;
+
+	if (!down_read_trylock(&zs_pools_sem))
+		return nr_to_scan ? -1 : 0;
+
+	list_for_each_entry(pool, &zs_pools, list) {
+		if (nr_to_scan)
+			zs_compact(pool);
+		pages += zs_compactable_pages(pool);
+	}
+	up_read(&zs_pools_sem);
+
+	return min_t(unsigned long, pages, INT_MAX);
+}
+
+static struct shrinker zs_shrinker = {
+	.shrink = zs_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+
+/* Pages released by compaction over the life of the pool */
+unsigned long zs_get_compacted(struct zs_pool *pool)
+{
+	return atomic_long_read(&pool->pages_compacted);
+}
+
+/* Returns -EINVAL once index runs past the last size class */
+int zs_get_class_stats(struct zs_pool *pool, int index,
+			struct zs_class_stats *stats)
+{
+	struct size_class *class;
+
+	if (index < 0 || index >= ZS_SIZE_CLASSES)
+		return -EINVAL;
+
+	class = pool->size_class[index];
+	spin_lock(&class->lock);
+	stats->size = class->size;
+	stats->pages_per_zspage = class->pages_per_zspage;
+	stats->zspages = class->zspages;
+	stats->objs_allocated = class->zspages * class->objs_per_zspage;
+	stats->objs_inuse = class->objs_inuse;
+	spin_unlock(&class->lock);
+
+	return 0;
+}
+
+struct zs_pool *zs_create_pool(void)
+{
+	int i, j;
+	struct zs_pool *pool;
+	struct size_class *class;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		class = kzalloc(sizeof(*class), GFP_KERNEL);
+		if (!class)
+			goto fail;
+
+		spin_lock_init(&class->lock);
+		for (j = 0; j < _ZS_NR_FULLNESS_GROUPS; j++)
+			INIT_LIST_HEAD(&class->fullness_list[j]);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+						PAGE_SIZE / class->size;
+		pool->size_class[i] = class;
+	}
+
+	atomic_long_set(&pool->pages_allocated, 0);
+	atomic_long_set(&pool->pages_compacted, 0);
+
+	down_write(&zs_pools_sem);
+	list_add(&pool->list, &zs_pools);
+	up_write(&zs_pools_sem);
+
+	return pool;
+
+fail:
+	while (i--)
+		kfree(pool->size_class[i]);
+	kfree(pool);
+	return NULL;
+}
+
+/* All objects must have been freed */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+
+	down_write(&zs_pools_sem);
+	list_del(&pool->list);
+	up_write(&zs_pools_sem);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		WARN_ON(pool->size_class[i]->zspages);
+		kfree(pool->size_class[i]);
+	}
+	kfree(pool);
+}
+
+static void zs_free_map_areas(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(zs_map_area, cpu).vm_buf);
+		per_cpu(zs_map_area, cpu).vm_buf = NULL;
+	}
+}
+
+int zs_init(void)
+{
+	int cpu;
+
+	zs_handle_cachep = kmem_cache_create("zs_handle",
+				sizeof(struct zs_handle), 0, 0, NULL);
+	if (!zs_handle_cachep)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		per_cpu(zs_map_area, cpu).vm_buf =
+				kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!per_cpu(zs_map_area, cpu).vm_buf) {
+			zs_free_map_areas();
+			kmem_cache_destroy(zs_handle_cachep);
+			return -ENOMEM;
+		}
+	}
+
+	register_shrinker(&zs_shrinker);
+	return 0;
+}
+
+void zs_exit(void)
+{
+	unregister_shrinker(&zs_shrinker);
+	zs_free_map_areas();
+	kmem_cache_destroy(zs_handle_cachep);
+}
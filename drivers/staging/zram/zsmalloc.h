@@ -0,0 +1,58 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_H_
+#define _ZS_MALLOC_H_
+
+#include <linux/types.h>
+
+/*
+ * How an object is going to be accessed between zs_map_object() and
+ * zs_unmap_object(). Only matters for objects that straddle two pages,
+ * which are accessed through a per-cpu copy.
+ */
+enum zs_mapmode {
+	ZS_MM_RW,	/* copy in at map time and back out at unmap */
+	ZS_MM_RO,	/* no copy out at unmap */
+	ZS_MM_WO,	/* no copy in at map */
+};
+
+/* Occupancy of one size class, see zs_get_class_stats() */
+struct zs_class_stats {
+	unsigned int size;		/* object size incl. back-reference */
+	unsigned int pages_per_zspage;
+	unsigned long zspages;		/* zspages allocated */
+	unsigned long objs_allocated;	/* object slots in those zspages */
+	unsigned long objs_inuse;	/* slots holding an object */
+};
+
+struct zs_pool;
+
+int zs_init(void);
+void zs_exit(void);
+
+struct zs_pool *zs_create_pool(void);
+void zs_destroy_pool(struct zs_pool *pool);
+
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags);
+void zs_free(struct zs_pool *pool, unsigned long handle);
+
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm);
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle);
+
+unsigned long zs_compact(struct zs_pool *pool);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+unsigned long zs_get_compacted(struct zs_pool *pool);
+int zs_get_class_stats(struct zs_pool *pool, int index,
+			struct zs_class_stats *stats);
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <asm/atomic.h>
+
+/* User configurable params */
+
+/*
+ * A zspage is a group of up to this many (not necessarily contiguous)
+ * pages that objects of one size class are packed into, crossing page
+ * boundaries where needed.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* Size classes are separated by ZS_SIZE_CLASS_DELTA bytes */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * A zspage with at most this many quarters of its objects in use is
+ * considered almost empty, i.e. a source for compaction.
+ */
+#define ZS_ALMOST_FULL_QUARTERS	3
+
+/* End of user params */
+
+/*
+ * Every object starts with a back-reference to its handle, tagged in
+ * the low bit. Free objects hold the index of the next free object
+ * instead, with the tag clear.
+ */
+#define ZS_HANDLE_SIZE		sizeof(unsigned long)
+#define OBJ_ALLOCATED_TAG	1UL
+#define OBJ_TAG_BITS		1
+
+/* Bit in zs_handle.flags held while the object is mapped or moved */
+#define HANDLE_PIN_BIT		0
+
+enum fullness_group {
+	ZS_EMPTY,
+	ZS_ALMOST_EMPTY,
+	ZS_ALMOST_FULL,
+	ZS_FULL,
+	_ZS_NR_FULLNESS_GROUPS,
+};
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;		/* in class->fullness_list */
+	struct size_class *class;
+	unsigned int inuse;		/* objects allocated */
+	unsigned int freeobj;		/* first free object index */
+	enum fullness_group fullness;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+/*
+ * What zs_malloc() hands out. Objects only move between zspages of the
+ * same class, so 'class' never changes; 'zspage' and 'idx' do, under
+ * the class lock and with HANDLE_PIN_BIT held.
+ */
+struct zs_handle {
+	unsigned long flags;
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned int idx;
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+	unsigned int size;
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+
+	/* Stats, protected by lock */
+	unsigned long zspages;
+	unsigned long objs_inuse;
+};
+
+struct zs_pool {
+	struct size_class *size_class[ZS_SIZE_CLASSES];
+	struct list_head list;		/* in zs_pools, for the shrinker */
+
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+};
+
+/* Per-cpu state between zs_map_object() and zs_unmap_object() */
+struct zs_map_area {
+	char *vm_buf;		/* copy of an object straddling two pages */
+	char *vm_addr;		/* kmap address if it did not straddle */
+	enum zs_mapmode vm_mm;
+};
+
+#endif
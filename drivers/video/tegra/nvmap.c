@@ -49,6 +49,9 @@
 #include <linux/seq_file.h>
 #include <linux/oom.h>
 #include <linux/syscalls.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
+#include <linux/workqueue.h>
 #include <asm/tlbflush.h>
 #include <mach/iovmm.h>
 #include "nvcommon.h"
@@ -107,6 +110,8 @@ static int nvmap_ioctl_pinop(struct file *filp,
 
 static int nvmap_ioctl_cache_maint(struct file *filp, void __user *arg);
 
+static int nvmap_ioctl_cache_maint_list(struct file *filp, void __user *arg);
+
 static int nvmap_map_into_caller_ptr(struct file *filp, void __user *arg);
 
 static int nvmap_ioctl_rw_handle(struct file *filp, int is_read,
@@ -153,8 +158,26 @@ static DEFINE_MUTEX(nvmap_pin_lock);
 static DECLARE_WAIT_QUEUE_HEAD(nvmap_pin_wait);
 static struct rb_root nvmap_handles = RB_ROOT;
 
+/* handles are also hashed by address, so that validating a handle from
+ * user space is an RCU walk rather than a trip through nvmap_handle_lock.
+ * insertion and removal still happen under nvmap_handle_lock */
+#define NVMAP_HANDLE_HASH_BITS 8
+static struct hlist_head nvmap_handle_hash[1 << NVMAP_HANDLE_HASH_BITS];
+
 static struct tegra_iovmm_client *nvmap_vm_client = NULL;
 
+/* background carveout compaction, kicked when carveout blocks are freed.
+ * passes run at most every NVMAP_BG_COMPACT_INTERVAL and copy at most
+ * NVMAP_BG_COMPACT_BYTES each */
+#define NVMAP_BG_COMPACT_DELAY	HZ
+#define NVMAP_BG_COMPACT_INTERVAL	(5 * HZ)
+#define NVMAP_BG_COMPACT_BATCH	4
+#define NVMAP_BG_COMPACT_BYTES	(1 << 20)
+static void nvmap_bg_compact(struct work_struct *work);
+static DECLARE_DELAYED_WORK(nvmap_bg_compact_work, nvmap_bg_compact);
+static void nvmap_bg_compact_kick(void);
+static unsigned long nvmap_bg_compact_last = INITIAL_JIFFIES;
+
 #ifdef CONFIG_NVMAP_CARVEOUT_KILLER
 static struct list_head clients_list = LIST_HEAD_INIT(clients_list);
 static DEFINE_SPINLOCK(clients_lock);
@@ -192,17 +215,20 @@ static unsigned int _nvmap_heap_policy (unsigned int heaps, int numpages)
 	return 0;
 };
 
-/* first-fit linear allocator carveout heap manager */
+/* best-fit carveout heap manager: blocks are kept in address order, and
+ * free blocks are additionally indexed by (size, base) in an rbtree */
 struct nvmap_mem_block {
 	struct nvmap_handle *h; /* backlink to handle for compaction */
 	unsigned long	base;
 	size_t		size;
 	size_t		align; /* alignment for compaction */
 	int             mapcount; /* how often mapped */
+	unsigned int	mapgen; /* bumped on every map, see nvmap_block_map */
 	short		next; /* next absolute (address-order) block */
 	short		prev; /* previous absolute (address-order) block */
 	short		next_free;
 	short		prev_free;
+	struct rb_node	free_node; /* in co->free_tree while free */
 
 	/* debugfs realted */
 	ktime_t		time;
@@ -223,6 +249,7 @@ struct nvmap_carveout {
 	spinlock_t		lock;
 	const char		*name;
 	struct nvmap_mem_block	*blocks;
+	struct rb_root		free_tree;
 };
 
 enum {
@@ -252,6 +279,14 @@ static inline pgprot_t _nvmap_flag_to_pgprot(unsigned long flag, pgprot_t base)
 	return base;
 }
 
+/* must be called with the carveout lock held */
+static size_t nvmap_largest_free(struct nvmap_carveout *co)
+{
+	struct rb_node *n = rb_last(&co->free_tree);
+
+	return n ? rb_entry(n, struct nvmap_mem_block, free_node)->size : 0;
+}
+
 static unsigned long _nvmap_carveout_blockstat(struct nvmap_carveout *co,
 	int stat)
 {
@@ -268,6 +303,12 @@ static unsigned long _nvmap_carveout_blockstat(struct nvmap_carveout *co,
 		return val;
 	}
 
+	if (stat==CARVEOUT_STAT_LARGEST_FREE) {
+		val = nvmap_largest_free(co);
+		spin_unlock(&co->lock);
+		return val;
+	}
+
 	if (stat==CARVEOUT_STAT_TOTAL_SIZE ||
 	    stat==CARVEOUT_STAT_NUM_BLOCKS ||
 	    stat==CARVEOUT_STAT_LARGEST_BLOCK)
@@ -297,10 +338,6 @@ static unsigned long _nvmap_carveout_blockstat(struct nvmap_carveout *co,
 			val ++;
 			idx = co->blocks[idx].next_free;
 			break;
-		case CARVEOUT_STAT_LARGEST_FREE:
-			val = max_t(unsigned long, val, co->blocks[idx].size);
-			idx = co->blocks[idx].next_free;
-			break;
 	    }
 	}
 
@@ -311,6 +348,26 @@ static unsigned long _nvmap_carveout_blockstat(struct nvmap_carveout *co,
 #define co_is_free(_co, _idx) \
 	((_co)->free_index==(_idx) || ((_co)->blocks[(_idx)].prev_free!=-1))
 
+static void nvmap_free_tree_insert(struct nvmap_carveout *co, int idx)
+{
+	struct nvmap_mem_block *b = &co->blocks[idx];
+	struct rb_node **p = &co->free_tree.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		struct nvmap_mem_block *e;
+		parent = *p;
+		e = rb_entry(parent, struct nvmap_mem_block, free_node);
+		if (b->size < e->size ||
+		    (b->size == e->size && b->base < e->base))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&b->free_node, parent, p);
+	rb_insert_color(&b->free_node, &co->free_tree);
+}
+
 static int _nvmap_init_carveout(struct nvmap_carveout *co,
 	const char *name, unsigned long base_address, size_t len)
 {
@@ -349,6 +406,8 @@ static int _nvmap_init_carveout(struct nvmap_carveout *co,
 	co->block_index = 0;
 	co->spare_index = 1;
 	co->free_index = 0;
+	co->free_tree = RB_ROOT;
+	nvmap_free_tree_insert(co, 0);
 	return 0;
 
 fail:
@@ -373,6 +432,15 @@ static int nvmap_get_spare(struct nvmap_carveout *co) {
 
 #define BLOCK(_co, _idx) ((_idx)==-1 ? NULL : &(_co)->blocks[(_idx)])
 
+/* takes a CPU mapping of a carveout block. mapgen lets background
+ * compaction notice a map that came and went while it was copying the
+ * block. must be called with the carveout lock held */
+static inline void nvmap_block_map(struct nvmap_mem_block *b)
+{
+	b->mapcount++;
+	b->mapgen++;
+}
+
 static void nvmap_zap_free(struct nvmap_carveout *co, int idx)
 {
 	struct nvmap_mem_block *block;
@@ -388,6 +456,49 @@ static void nvmap_zap_free(struct nvmap_carveout *co, int idx)
 
 	block->prev_free = -1;
 	block->next_free = -1;
+	rb_erase(&block->free_node, &co->free_tree);
+}
+
+static void nvmap_insert_free(struct nvmap_carveout *co, int idx)
+{
+	struct nvmap_mem_block *block = BLOCK(co, idx);
+
+	block->prev_free = -1;
+	block->next_free = co->free_index;
+	if (co->free_index != -1)
+		co->blocks[co->free_index].prev_free = idx;
+	co->free_index = idx;
+	nvmap_free_tree_insert(co, idx);
+}
+
+/* returns the smallest free block that can hold size bytes at the
+ * requested alignment. only blocks with less than align-1 bytes of slack
+ * can fail to fit, so the walk up the tree is short */
+static int nvmap_free_tree_fit(struct nvmap_carveout *co,
+	size_t align, size_t size)
+{
+	struct rb_node *n = co->free_tree.rb_node;
+	struct rb_node *best = NULL;
+
+	while (n) {
+		struct nvmap_mem_block *b;
+		b = rb_entry(n, struct nvmap_mem_block, free_node);
+		if (b->size >= size) {
+			best = n;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+
+	for (n = best; n; n = rb_next(n)) {
+		struct nvmap_mem_block *b;
+		size_t ljust;
+		b = rb_entry(n, struct nvmap_mem_block, free_node);
+		ljust = (b->base + align - 1) & ~(align-1);
+		if (b->base + b->size >= ljust + size)
+			return b - co->blocks;
+	}
+	return -1;
 }
 
 static int nvmap_split_block(struct nvmap_carveout *co,
@@ -395,34 +506,32 @@ static int nvmap_split_block(struct nvmap_carveout *co,
 {
 	struct nvmap_mem_block *block = BLOCK(co, idx);
 
+	/* not being able to split is fatal if block->base has to be
+	 * realigned; check before touching the free list */
+	if (block->base < start && co->spare_index == -1)
+		return -ENOMEM;
+
+	/* the block's key in the free tree is about to change */
+	nvmap_zap_free(co, idx);
+
 	if (block->base < start) {
 		int spare_idx = nvmap_get_spare(co);
 		struct nvmap_mem_block *spare = BLOCK(co, spare_idx);
-		if (spare) {
-			spare->h = NULL;
-			spare->size = start - block->base;
-			spare->align = 1;
-			spare->mapcount = 0;
-			spare->base = block->base;
-			block->size -= (start - block->base);
-			block->base = start;
-			spare->next = idx;
-			spare->prev = block->prev;
-			block->prev = spare_idx;
-			if (spare->prev != -1)
-				co->blocks[spare->prev].next = spare_idx;
-			else
-				co->block_index = spare_idx;
-			spare->prev_free = -1;
-			spare->next_free = co->free_index;
-			if (co->free_index != -1)
-				co->blocks[co->free_index].prev_free = spare_idx;
-			co->free_index = spare_idx;
-		} else {
-			/* not being able to split is fatal here, because we
-			 * need to realign block->base */
-			return -ENOMEM;
-		}
+		spare->h = NULL;
+		spare->size = start - block->base;
+		spare->align = 1;
+		spare->mapcount = 0;
+		spare->base = block->base;
+		block->size -= (start - block->base);
+		block->base = start;
+		spare->next = idx;
+		spare->prev = block->prev;
+		block->prev = spare_idx;
+		if (spare->prev != -1)
+			co->blocks[spare->prev].next = spare_idx;
+		else
+			co->block_index = spare_idx;
+		nvmap_insert_free(co, spare_idx);
 	}
 
 	if (block->size > size) {
@@ -440,19 +549,13 @@ static int nvmap_split_block(struct nvmap_carveout *co,
 			block->next = spare_idx;
 			if (spare->next != -1)
 				co->blocks[spare->next].prev = spare_idx;
-			spare->prev_free = -1;
-			spare->next_free = co->free_index;
-			if (co->free_index != -1)
-				co->blocks[co->free_index].prev_free = spare_idx;
-			co->free_index = spare_idx;
+			nvmap_insert_free(co, spare_idx);
 		}
 	}
 
 	block->align = align;
 	block->mapcount = 0;
 
-	nvmap_zap_free(co, idx);
-
 	return 0;
 }
 
@@ -520,7 +623,7 @@ static void nvmap_carveout_free(struct nvmap_carveout *co, int idx, bool lock)
 		nvmap_insert_block(spare, co, zap);
 	}
 
-	nvmap_insert_block(free, co, idx);
+	nvmap_insert_free(co, idx);
 	if (lock) spin_unlock(&co->lock);
 }
 
@@ -535,9 +638,20 @@ static int nvmap_carveout_alloc_locked(struct nvmap_carveout_node *n,
 {
 	int idx;
 
+	if (idx_last == -1) {
+		idx = nvmap_free_tree_fit(co, align, size);
+		if (idx != -1) {
+			size_t ljust = (co->blocks[idx].base + align - 1) &
+				~(align-1);
+			if (nvmap_split_block(co, idx, ljust, size, align))
+				idx = -1;
+		}
+		goto out;
+	}
+
 	/* if idx_last is passed in as not -1, we'd want bottom_up
 	 * allocation */
-	idx = (idx_last != -1) ? co->block_index : co->free_index;
+	idx = co->block_index;
 
 	while (idx != -1) {
 		size_t ljust;
@@ -562,9 +676,11 @@ static int nvmap_carveout_alloc_locked(struct nvmap_carveout_node *n,
 			return -1;
 		}
 
-		idx = (idx_last != -1) ? b->next : b->next_free;
+		idx = b->next;
 	}
 
+out:
+
 #if NVMAP_DEBUG_FS
 	if (idx != -1)  {
 		nvmap_add_debug_fs_node(n, co, idx);
@@ -580,6 +696,8 @@ static int nvmap_carveout_alloc_locked(struct nvmap_carveout_node *n,
 
 struct nvmap_handle {
 	struct rb_node node;
+	struct hlist_node hash_node; /* in nvmap_handle_hash, for lookup */
+	struct rcu_head rcu;
 	atomic_t ref;
 	atomic_t pin;
 	unsigned long flags;
@@ -591,7 +709,7 @@ struct nvmap_handle {
 		struct {
 			struct page **pages;
 			struct tegra_iovmm_area *area;
-			struct list_head mru_list;
+			struct list_head lru_list;
 			bool contig;
 			bool dirty; /* IOVMM area allocated since last pin */
 		} pgalloc;
@@ -941,25 +1059,26 @@ static struct device *__nvmap_heap_parent_dev(void);
 #define _nvmap_heap_parent_dev __nvmap_heap_parent_dev()
 
 /* unpinned I/O VMM areas may be reclaimed by nvmap to make room for
- * new surfaces. unpinned surfaces are stored in segregated linked-lists
- * sorted in most-recently-unpinned order (i.e., head insertion, head
- * removal */
+ * new surfaces. unpinned surfaces are stored in least-recently-unpinned
+ * order (i.e., tail insertion, head removal) on one list per IOVMM buddy
+ * order, so that a pin only looks at areas which can satisfy it */
 #ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
-static DEFINE_SPINLOCK(nvmap_mru_vma_lock);
-static const size_t nvmap_mru_cutoff[] = {
-	262144, 393216, 786432, 1048576, 1572864
-};
+static DEFINE_SPINLOCK(nvmap_lru_vma_lock);
+static struct list_head nvmap_lru_vma_lists[TEGRA_IOVMM_MAX_ORDER];
+static unsigned long nvmap_lru_reused;
+static unsigned long nvmap_lru_evicted;
 
-static struct list_head nvmap_mru_vma_lists[ARRAY_SIZE(nvmap_mru_cutoff)];
+/* number of least-recently-unpinned handles examined when looking for one
+ * which does not belong to the pinning client */
+#define NVMAP_LRU_SCAN	8
 
-static inline struct list_head *_nvmap_list(size_t size)
+static inline struct list_head *_nvmap_lru_list(size_t size)
 {
-	unsigned int i;
+	unsigned int order = get_order(size);
 
-	for (i=0; i<ARRAY_SIZE(nvmap_mru_cutoff); i++)
-		if (size <= nvmap_mru_cutoff[i]) return &nvmap_mru_vma_lists[i];
-
-	return &nvmap_mru_vma_lists[ARRAY_SIZE(nvmap_mru_cutoff)-1];
+	if (order >= TEGRA_IOVMM_MAX_ORDER)
+		order = TEGRA_IOVMM_MAX_ORDER-1;
+	return &nvmap_lru_vma_lists[order];
 }
 #endif
 
@@ -1019,26 +1138,26 @@ static struct nvmap_handle *_nvmap_validate_get(unsigned long handle, bool su)
 	struct nvmap_handle *b = NULL;
 
 #ifdef CONFIG_DEVNVMAP_PARANOID
-	struct rb_node *n;
+	struct hlist_node *n;
+	struct hlist_head *head;
 
-	spin_lock(&nvmap_handle_lock);
-
-	n = nvmap_handles.rb_node;
+	head = &nvmap_handle_hash[hash_ptr((void *)handle,
+		NVMAP_HANDLE_HASH_BITS)];
 
-	while (n) {
-		b = rb_entry(n, struct nvmap_handle, node);
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(b, n, head, hash_node) {
 		if ((unsigned long)b == handle) {
-			if (su || b->global || b->owner==current->group_leader)
-				b = _nvmap_handle_get(b);
-			else
+			/* a handle whose last reference is gone is being
+			 * freed; don't resurrect it */
+			if (!(su || b->global ||
+			      b->owner==current->group_leader) ||
+			    !atomic_inc_not_zero(&b->ref))
 				b = NULL;
-			spin_unlock(&nvmap_handle_lock);
+			rcu_read_unlock();
 			return b;
 		}
-		if (handle > (unsigned long)b) n = n->rb_right;
-		else n = n->rb_left;
 	}
-	spin_unlock(&nvmap_handle_lock);
+	rcu_read_unlock();
 	return NULL;
 #else
 	if (!handle) return NULL;
@@ -1047,25 +1166,77 @@ static struct nvmap_handle *_nvmap_validate_get(unsigned long handle, bool su)
 #endif
 }
 
-/*  nvmap_mru_vma_lock should be acquired by the caller before calling this */
-static inline void _nvmap_insert_mru_vma(struct nvmap_handle *h)
+/*  nvmap_lru_vma_lock should be acquired by the caller before calling this */
+static inline void _nvmap_insert_lru_vma(struct nvmap_handle *h)
 {
 #ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
-	list_add(&h->pgalloc.mru_list, _nvmap_list(h->pgalloc.area->iovm_length));
+	list_add_tail(&h->pgalloc.lru_list,
+		_nvmap_lru_list(h->pgalloc.area->iovm_length));
 #endif
 }
 
-static void _nvmap_remove_mru_vma(struct nvmap_handle *h)
+static void _nvmap_remove_lru_vma(struct nvmap_handle *h)
 {
 #ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
-	spin_lock(&nvmap_mru_vma_lock);
-	if (!list_empty(&h->pgalloc.mru_list))
-		list_del(&h->pgalloc.mru_list);
-	spin_unlock(&nvmap_mru_vma_lock);
-	INIT_LIST_HEAD(&h->pgalloc.mru_list);
+	spin_lock(&nvmap_lru_vma_lock);
+	if (!list_empty(&h->pgalloc.lru_list))
+		list_del(&h->pgalloc.lru_list);
+	spin_unlock(&nvmap_lru_vma_lock);
+	INIT_LIST_HEAD(&h->pgalloc.lru_list);
 #endif
 }
 
+#ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
+/* returns the least recently unpinned handle on lru whose area is at least
+ * size bytes. handles owned by other clients are preferred, so that the
+ * pinning client's own working set (e.g., the other surfaces of the frame
+ * it is submitting) is reclaimed last. called with nvmap_lru_vma_lock
+ * held */
+static struct nvmap_handle *_nvmap_lru_victim(struct list_head *lru,
+	size_t size)
+{
+	struct nvmap_handle *h, *fallback = NULL;
+	unsigned int scanned = 0;
+
+	list_for_each_entry(h, lru, pgalloc.lru_list) {
+		if (scanned++ == NVMAP_LRU_SCAN)
+			break;
+		if (h->pgalloc.area->iovm_length < size)
+			continue;
+		if (h->owner != current->group_leader)
+			return h;
+		if (!fallback)
+			fallback = h;
+	}
+	return fallback;
+}
+
+/* frees the IOVMM areas of handles on lru until an area for h can be
+ * created. called and returns with nvmap_lru_vma_lock held */
+static struct tegra_iovmm_area *_nvmap_lru_evict(struct nvmap_handle *h,
+	struct list_head *lru)
+{
+	struct nvmap_handle *evict;
+	struct tegra_iovmm_area *vm = NULL;
+
+	while (!vm && (evict = _nvmap_lru_victim(lru, 0))) {
+		BUG_ON(atomic_add_return(0, &evict->pin)!=0);
+		BUG_ON(!evict->pgalloc.area);
+		list_del(&evict->pgalloc.lru_list);
+		INIT_LIST_HEAD(&evict->pgalloc.lru_list);
+		nvmap_lru_evicted++;
+		spin_unlock(&nvmap_lru_vma_lock);
+		tegra_iovmm_free_vm(evict->pgalloc.area);
+		evict->pgalloc.area = NULL;
+		vm = tegra_iovmm_create_vm(nvmap_vm_client,
+			NULL, h->size,
+			_nvmap_flag_to_pgprot(h->flags, pgprot_kernel));
+		spin_lock(&nvmap_lru_vma_lock);
+	}
+	return vm;
+}
+#endif
+
 static struct tegra_iovmm_area *_nvmap_get_vm(struct nvmap_handle *h)
 {
 #ifndef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
@@ -1074,17 +1245,17 @@ static struct tegra_iovmm_area *_nvmap_get_vm(struct nvmap_handle *h)
 	BUG_ON((h->size | h->pgalloc.area->iovm_length) & ~PAGE_MASK);
 	return h->pgalloc.area;
 #else
-	struct list_head *mru;
-	struct nvmap_handle *evict = NULL;
+	struct list_head *lru;
+	struct nvmap_handle *evict;
 	struct tegra_iovmm_area *vm = NULL;
-	unsigned int i, idx;
+	unsigned int i, order;
 
 	if (h->pgalloc.area) {
-		spin_lock(&nvmap_mru_vma_lock);
-		BUG_ON(list_empty(&h->pgalloc.mru_list));
-		list_del(&h->pgalloc.mru_list);
-		INIT_LIST_HEAD(&h->pgalloc.mru_list);
-		spin_unlock(&nvmap_mru_vma_lock);
+		spin_lock(&nvmap_lru_vma_lock);
+		BUG_ON(list_empty(&h->pgalloc.lru_list));
+		list_del(&h->pgalloc.lru_list);
+		INIT_LIST_HEAD(&h->pgalloc.lru_list);
+		spin_unlock(&nvmap_lru_vma_lock);
 		return h->pgalloc.area;
 	}
 
@@ -1092,52 +1263,34 @@ static struct tegra_iovmm_area *_nvmap_get_vm(struct nvmap_handle *h)
 		_nvmap_flag_to_pgprot(h->flags, pgprot_kernel));
 
 	if (vm) {
-		INIT_LIST_HEAD(&h->pgalloc.mru_list);
+		INIT_LIST_HEAD(&h->pgalloc.lru_list);
 		return vm;
 	}
-	/* attempt to re-use the most recently unpinned IOVMM area in the
-	 * same size bin as the current handle. If that fails, iteratively
-	 * evict handles (starting from the current bin) until an allocation
-	 * succeeds or no more areas can be evicted */
-
-	spin_lock(&nvmap_mru_vma_lock);
-	mru = _nvmap_list(h->size);
-	if (!list_empty(mru))
-		evict = list_first_entry(mru, struct nvmap_handle,
-			pgalloc.mru_list);
-	if (evict && evict->pgalloc.area->iovm_length >= h->size) {
-		list_del(&evict->pgalloc.mru_list);
+	/* attempt to re-use the least recently unpinned IOVMM area of the
+	 * same order as the current handle, since it can be taken over
+	 * as-is. failing that, evict areas of a larger order, any one of
+	 * which frees enough aligned space for the allocation; only then
+	 * evict smaller areas so that their space can be coalesced */
+
+	spin_lock(&nvmap_lru_vma_lock);
+	lru = _nvmap_lru_list(h->size);
+	evict = _nvmap_lru_victim(lru, h->size);
+	if (evict) {
+		list_del(&evict->pgalloc.lru_list);
 		vm = evict->pgalloc.area;
 		evict->pgalloc.area = NULL;
-		INIT_LIST_HEAD(&evict->pgalloc.mru_list);
-		spin_unlock(&nvmap_mru_vma_lock);
+		INIT_LIST_HEAD(&evict->pgalloc.lru_list);
+		nvmap_lru_reused++;
+		spin_unlock(&nvmap_lru_vma_lock);
 		return vm;
 	}
 
-	idx = mru - nvmap_mru_vma_lists;
-
-	for (i=0; i<ARRAY_SIZE(nvmap_mru_vma_lists) && !vm; i++, idx++) {
-		if (idx >= ARRAY_SIZE(nvmap_mru_vma_lists))
-			idx -= ARRAY_SIZE(nvmap_mru_vma_lists);
-		mru = &nvmap_mru_vma_lists[idx];
-		while (!list_empty(mru) && !vm) {
-			evict = list_first_entry(mru, struct nvmap_handle,
-				pgalloc.mru_list);
-
-			BUG_ON(atomic_add_return(0, &evict->pin)!=0);
-			BUG_ON(!evict->pgalloc.area);
-			list_del(&evict->pgalloc.mru_list);
-			INIT_LIST_HEAD(&evict->pgalloc.mru_list);
-			spin_unlock(&nvmap_mru_vma_lock);
-			tegra_iovmm_free_vm(evict->pgalloc.area);
-			evict->pgalloc.area = NULL;
-			vm = tegra_iovmm_create_vm(nvmap_vm_client,
-				NULL, h->size,
-				_nvmap_flag_to_pgprot(h->flags, pgprot_kernel));
-			spin_lock(&nvmap_mru_vma_lock);
-		}
-	}
-	spin_unlock(&nvmap_mru_vma_lock);
+	order = lru - nvmap_lru_vma_lists;
+	for (i=order+1; i<TEGRA_IOVMM_MAX_ORDER && !vm; i++)
+		vm = _nvmap_lru_evict(h, &nvmap_lru_vma_lists[i]);
+	for (i=order+1; i>0 && !vm; i--)
+		vm = _nvmap_lru_evict(h, &nvmap_lru_vma_lists[i-1]);
+	spin_unlock(&nvmap_lru_vma_lock);
 	return vm;
 #endif
 }
@@ -1145,32 +1298,53 @@ static struct tegra_iovmm_area *_nvmap_get_vm(struct nvmap_handle *h)
 int nvmap_get_unpinned_iovmm_memory(int *total_unpinned_mem,
 	int *largest_unpinned_mem)
 {
+#ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
 	unsigned int i;
-	struct list_head *mru;
-	struct list_head *temp;
 	struct nvmap_handle *h;
+#endif
 	*total_unpinned_mem = 0;
 	*largest_unpinned_mem = 0;
 
-	spin_lock(&nvmap_mru_vma_lock);
-	for (i = 0; i<ARRAY_SIZE(nvmap_mru_vma_lists); i++) {
-		mru = &nvmap_mru_vma_lists[i];
-		list_for_each(temp, mru) {
-			h = list_entry(temp, struct nvmap_handle, pgalloc.mru_list);
+#ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
+	spin_lock(&nvmap_lru_vma_lock);
+	for (i = 0; i<ARRAY_SIZE(nvmap_lru_vma_lists); i++) {
+		list_for_each_entry(h, &nvmap_lru_vma_lists[i],
+				pgalloc.lru_list) {
 			(*total_unpinned_mem) += h->size;
 			if ( (*largest_unpinned_mem) < h->size )
 				*largest_unpinned_mem = h->size;
 		}
 	}
+	spin_unlock(&nvmap_lru_vma_lock);
+#endif
 	(*total_unpinned_mem) = (*total_unpinned_mem) >> 10;
 	(*largest_unpinned_mem) = (*largest_unpinned_mem) >> 10;
-	spin_unlock(&nvmap_mru_vma_lock);
+	return 0;
+}
+
+int nvmap_get_iovmm_reclaim_stats(unsigned long *reused,
+	unsigned long *evicted)
+{
+#ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
+	spin_lock(&nvmap_lru_vma_lock);
+	*reused = nvmap_lru_reused;
+	*evicted = nvmap_lru_evicted;
+	spin_unlock(&nvmap_lru_vma_lock);
+#else
+	*reused = 0;
+	*evicted = 0;
+#endif
 	return 0;
 }
 
 static int _nvmap_do_cache_maint(struct nvmap_handle *h,
 	unsigned long start, unsigned long end, unsigned long op, bool get);
 
+static void _nvmap_handle_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct nvmap_handle, rcu));
+}
+
 void _nvmap_handle_free(struct nvmap_handle *h)
 {
 	int e;
@@ -1188,6 +1362,7 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 	BUG_ON(atomic_read(&h->pin)!=0);
 
 	rb_erase(&h->node, &nvmap_handles);
+	hlist_del_rcu(&h->hash_node);
 
 	spin_unlock(&nvmap_handle_lock);
 
@@ -1222,6 +1397,7 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 			h->size);
 		nvmap_carveout_free(h->carveout.co_heap, h->carveout.block_idx, false);
 		spin_unlock(&co->lock);
+		nvmap_bg_compact_kick();
 		NVMAP_TRACE(NVMAP_TRACE_LFB,
 				"nvmap: lfb after freeing %lu\n",
 				_nvmap_carveout_blockstat(co,
@@ -1245,7 +1421,7 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 				(h->alloc && h->heap_pgalloc) ? "page-alloc" :
 				(h->alloc) ? "carveout" : "unallocated",
 				h->size);
-		_nvmap_remove_mru_vma(h);
+		_nvmap_remove_lru_vma(h);
 		if (h->pgalloc.area) tegra_iovmm_free_vm(h->pgalloc.area);
 		for (i=0; i<h->size>>PAGE_SHIFT; i++) {
 			ClearPageReserved(h->pgalloc.pages[i]);
@@ -1257,11 +1433,114 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 			kfree(h->pgalloc.pages);
 	}
 	h->poison = 0xa5a5a5a5;
-	kfree(h);
+	call_rcu(&h->rcu, _nvmap_handle_free_rcu);
 }
 
 #define nvmap_gfp (GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
 
+/* pool of zeroed pages with no lines left in L1 or L2, so handing one out
+ * needs no cache maintenance whatever the handle's cacheability; it is
+ * refilled from a work item and drained by the shrinker. only single
+ * pages are pooled, contiguous allocations bypass it */
+static struct {
+	spinlock_t lock;
+	struct list_head pages;
+	unsigned int count;
+} nvmap_page_pool = {
+	.lock = __SPIN_LOCK_UNLOCKED(nvmap_page_pool.lock),
+	.pages = LIST_HEAD_INIT(nvmap_page_pool.pages),
+};
+
+static unsigned int nvmap_page_pool_size = 512;
+module_param_named(page_pool_size, nvmap_page_pool_size, uint, 0600);
+
+static void nvmap_page_pool_refill(struct work_struct *work);
+static DECLARE_WORK(nvmap_page_pool_work, nvmap_page_pool_refill);
+
+static void nvmap_flush_page(struct page *page, bool zero)
+{
+	void *km = kmap(page);
+	if (km) {
+		if (zero) memset(km, 0, PAGE_SIZE);
+		__cpuc_flush_dcache_area(km, PAGE_SIZE);
+	}
+	outer_flush_range(page_to_phys(page), page_to_phys(page)+PAGE_SIZE);
+	kunmap(page);
+}
+
+static void nvmap_page_pool_refill(struct work_struct *work)
+{
+	struct page *page;
+
+	while (nvmap_page_pool.count < nvmap_page_pool_size) {
+		/* don't push the system into reclaim just to fill the pool */
+		page = alloc_page(nvmap_gfp | __GFP_NORETRY);
+		if (!page) break;
+		nvmap_flush_page(page, true);
+
+		spin_lock(&nvmap_page_pool.lock);
+		if (nvmap_page_pool.count < nvmap_page_pool_size) {
+			list_add_tail(&page->lru, &nvmap_page_pool.pages);
+			nvmap_page_pool.count++;
+			page = NULL;
+		}
+		spin_unlock(&nvmap_page_pool.lock);
+		if (page) {
+			__free_page(page);
+			break;
+		}
+	}
+}
+
+/* takes up to nr clean pages from the pool, returns how many it got */
+static unsigned int nvmap_page_pool_alloc(struct page **pages, unsigned int nr)
+{
+	unsigned int i = 0;
+
+	spin_lock(&nvmap_page_pool.lock);
+	while (i<nr && !list_empty(&nvmap_page_pool.pages)) {
+		pages[i] = list_first_entry(&nvmap_page_pool.pages,
+			struct page, lru);
+		list_del(&pages[i]->lru);
+		i++;
+	}
+	nvmap_page_pool.count -= i;
+	spin_unlock(&nvmap_page_pool.lock);
+
+	if (nvmap_page_pool.count < nvmap_page_pool_size/2)
+		schedule_work(&nvmap_page_pool_work);
+
+	return i;
+}
+
+static int nvmap_page_pool_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct page *page, *tmp;
+	LIST_HEAD(victims);
+
+	if (!nr_to_scan)
+		return nvmap_page_pool.count;
+
+	spin_lock(&nvmap_page_pool.lock);
+	while (nr_to_scan-- && !list_empty(&nvmap_page_pool.pages)) {
+		list_move(nvmap_page_pool.pages.next, &victims);
+		nvmap_page_pool.count--;
+	}
+	spin_unlock(&nvmap_page_pool.lock);
+
+	list_for_each_entry_safe(page, tmp, &victims, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+
+	return nvmap_page_pool.count;
+}
+
+static struct shrinker nvmap_page_pool_shrinker = {
+	.shrink = nvmap_page_pool_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
 /* map the backing pages for a heap_pgalloc handle into its IOVMM area */
 static void _nvmap_handle_iovmm_map(struct nvmap_handle *h)
 {
@@ -1285,6 +1564,7 @@ static void _nvmap_handle_iovmm_map(struct nvmap_handle *h)
 static int nvmap_pagealloc(struct nvmap_handle *h, bool contiguous)
 {
 	unsigned int i = 0, cnt = (h->size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	unsigned int pooled = 0;
 	struct page **pages;
 
 	if (cnt*sizeof(*pages)>=PAGE_SIZE)
@@ -1305,7 +1585,8 @@ static int nvmap_pagealloc(struct nvmap_handle *h, bool contiguous)
 		for (; i<(1<<order); i++)
 			__free_page(nth_page(compound_page, i));
 	} else {
-		for (i=0; i<cnt; i++) {
+		pooled = nvmap_page_pool_alloc(pages, cnt);
+		for (i=pooled; i<cnt; i++) {
 			pages[i] = alloc_page(nvmap_gfp);
 			if (!pages[i]) {
 			    pr_err("failed to allocate %u pages after %u entries\n",
@@ -1326,20 +1607,16 @@ static int nvmap_pagealloc(struct nvmap_handle *h, bool contiguous)
 	}
 #endif
 
+	/* pooled pages are already clean */
 	for (i=0; i<cnt; i++) {
-		void *km;
 		SetPageReserved(pages[i]);
-		km = kmap(pages[i]);
-		if (km) __cpuc_flush_dcache_area(km, PAGE_SIZE);
-		outer_flush_range(page_to_phys(pages[i]),
-			page_to_phys(pages[i])+PAGE_SIZE);
-		kunmap(pages[i]);
+		if (i >= pooled) nvmap_flush_page(pages[i], false);
 	}
 
 	h->size = cnt<<PAGE_SHIFT;
 	h->pgalloc.pages = pages;
 	h->pgalloc.contig = contiguous;
-	INIT_LIST_HEAD(&h->pgalloc.mru_list);
+	INIT_LIST_HEAD(&h->pgalloc.lru_list);
 	return 0;
 
 fail:
@@ -1379,6 +1656,8 @@ static struct nvmap_handle *_nvmap_handle_create(
 	}
 	rb_link_node(&h->node, parent, p);
 	rb_insert_color(&h->node, &nvmap_handles);
+	hlist_add_head_rcu(&h->hash_node,
+		&nvmap_handle_hash[hash_ptr(h, NVMAP_HANDLE_HASH_BITS)]);
 	spin_unlock(&nvmap_handle_lock);
 	if (owner) get_task_struct(owner);
 	return h;
@@ -1586,6 +1865,10 @@ static long nvmap_ioctl(struct file *filp,
 		err = nvmap_ioctl_cache_maint(filp, uarg);
 		break;
 
+	case NVMEM_IOC_CACHE_LIST:
+		err = nvmap_ioctl_cache_maint_list(filp, uarg);
+		break;
+
 	default:
 		return -ENOTTY;
 	}
@@ -1618,7 +1901,11 @@ struct nvmap_handle_ref *_nvmap_ref_lookup_locked(
 
 /* must be called inside nvmap_pin_lock, to ensure that an entire stream
  * of pins will complete without competition from a second stream. returns
- * 0 if the pin was successful, -ENOMEM on failure */
+ * 0 if the pin was successful, -ENOMEM on failure.
+ *
+ * the first pin is only published once the IOVMM area is allocated and
+ * mapped and the carveout pinned state is set, since _nvmap_handle_pin_nolock hands out further
+ * pins as soon as it sees a non-zero pin count */
 static int _nvmap_handle_pin_locked(struct nvmap_handle *h)
 {
 	struct tegra_iovmm_area *area;
@@ -1627,29 +1914,56 @@ static int _nvmap_handle_pin_locked(struct nvmap_handle *h)
 	h = _nvmap_handle_get(h);
 	if (!h) return -ENOMEM;
 
-	if (atomic_inc_return(&h->pin)==1) {
-		if (h->heap_pgalloc && !h->pgalloc.contig) {
-			area = _nvmap_get_vm(h);
-			if (!area) {
-				/* no race here, inside the pin mutex */
-				atomic_dec(&h->pin);
-				_nvmap_handle_put(h);
-				return -ENOMEM;
-			}
-			if (area != h->pgalloc.area)
-				h->pgalloc.dirty = true;
-			h->pgalloc.area = area;
-		}
-		if (h->alloc && !h->heap_pgalloc) {
-			spin_lock(&h->carveout.co_heap->lock);
-			BLOCK(h->carveout.co_heap, h->carveout.block_idx)->align
-				|= NVMAP_BLOCK_ALIGN_PINNED;
-			spin_unlock(&h->carveout.co_heap->lock);
+	if (atomic_inc_not_zero(&h->pin))
+		return 0;
+
+	if (h->heap_pgalloc && !h->pgalloc.contig) {
+		area = _nvmap_get_vm(h);
+		if (!area) {
+			/* the pin was never published, so nobody else
+			 * can be holding it */
+			_nvmap_handle_put(h);
+			return -ENOMEM;
 		}
+		if (area != h->pgalloc.area)
+			h->pgalloc.dirty = true;
+		h->pgalloc.area = area;
+		if (h->pgalloc.dirty)
+			_nvmap_handle_iovmm_map(h);
+	}
+	if (h->alloc && !h->heap_pgalloc) {
+		spin_lock(&h->carveout.co_heap->lock);
+		BLOCK(h->carveout.co_heap, h->carveout.block_idx)->align
+			|= NVMAP_BLOCK_ALIGN_PINNED;
+		spin_unlock(&h->carveout.co_heap->lock);
 	}
+
+	/* pairs with the barrier implied by atomic_inc_not_zero in
+	 * _nvmap_handle_pin_nolock */
+	smp_wmb();
+	atomic_inc(&h->pin);
 	return 0;
 }
 
+/* takes another pin on a handle that is already pinned. that needs no IOVMM
+ * space and leaves the carveout block's pinned state alone, so unlike
+ * _nvmap_handle_pin_locked it doesn't need nvmap_pin_lock. returns false
+ * if the handle isn't pinned, in which case the caller must take the slow
+ * path */
+static bool _nvmap_handle_pin_nolock(struct nvmap_handle *h)
+{
+	BUG_ON(!h->alloc);
+
+	h = _nvmap_handle_get(h);
+	if (!h) return false;
+
+	if (atomic_inc_not_zero(&h->pin))
+		return true;
+
+	_nvmap_handle_put(h);
+	return false;
+}
+
 /* doesn't need to be called inside nvmap_pin_lock, since this will only
  * expand the available VM area */
 static int _nvmap_handle_unpin(struct nvmap_handle *h)
@@ -1671,7 +1985,7 @@ static int _nvmap_handle_unpin(struct nvmap_handle *h)
 
 	BUG_ON(!h->alloc);
 #ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
-	spin_lock(&nvmap_mru_vma_lock);
+	spin_lock(&nvmap_lru_vma_lock);
 #endif
 	if (!atomic_dec_return(&h->pin)) {
 		if (h->heap_pgalloc && h->pgalloc.area) {
@@ -1681,7 +1995,7 @@ static int _nvmap_handle_unpin(struct nvmap_handle *h)
 				tegra_iovmm_zap_vm(h->pgalloc.area);
 				h->pgalloc.dirty = true;
 			}
-			_nvmap_insert_mru_vma(h);
+			_nvmap_insert_lru_vma(h);
 			ret=1;
 		}
 		if (h->alloc && !h->heap_pgalloc) {
@@ -1693,7 +2007,7 @@ static int _nvmap_handle_unpin(struct nvmap_handle *h)
 	}
 
 #ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
-	spin_unlock(&nvmap_mru_vma_lock);
+	spin_unlock(&nvmap_lru_vma_lock);
 #endif
 	_nvmap_handle_put(h);
 	return ret;
@@ -1714,22 +2028,26 @@ static int _nvmap_handle_pin_fast(unsigned int nr, struct nvmap_handle **h)
 		return -EINVAL;
 	}
 
-	mutex_lock(&nvmap_pin_lock);
-	for (i=0; i<nr && !ret; i++) {
-		ret = wait_event_interruptible(nvmap_pin_wait,
-			!_nvmap_handle_pin_locked(h[i]));
+	/* handles which are already pinned (the per-frame common case)
+	 * are pinned without the mutex; only the first handle that needs
+	 * IOVMM space sends the rest of the list down the slow path */
+	for (i=0; i<nr && _nvmap_handle_pin_nolock(h[i]); i++)
+		;
+
+	if (i<nr) {
+		mutex_lock(&nvmap_pin_lock);
+		for (; i<nr && !ret; i++) {
+			ret = wait_event_interruptible(nvmap_pin_wait,
+				!_nvmap_handle_pin_locked(h[i]));
+		}
+		mutex_unlock(&nvmap_pin_lock);
 	}
-	mutex_unlock(&nvmap_pin_lock);
 
 	if (ret) {
 		int do_wake = 0;
 		while (i--) do_wake |= _nvmap_handle_unpin(h[i]);
 		if (do_wake) wake_up(&nvmap_pin_wait);
 		return -EINTR;
-	} else {
-		for (i=0; i<nr; i++)
-			if (h[i]->heap_pgalloc && h[i]->pgalloc.dirty)
-				_nvmap_handle_iovmm_map(h[i]);
 	}
 
 	return 0;
@@ -1835,12 +2153,18 @@ static int _nvmap_do_pin(struct nvmap_file_priv *priv,
 
 	if (ret) return ret;
 
-	mutex_lock(&nvmap_pin_lock);
-	for (i=0; i<nr && !ret; i++) {
-		ret = wait_event_interruptible(nvmap_pin_wait,
-			!_nvmap_handle_pin_locked(h[i]));
+	/* see _nvmap_handle_pin_fast */
+	for (i=0; i<nr && _nvmap_handle_pin_nolock(h[i]); i++)
+		;
+
+	if (i<nr) {
+		mutex_lock(&nvmap_pin_lock);
+		for (; i<nr && !ret; i++) {
+			ret = wait_event_interruptible(nvmap_pin_wait,
+				!_nvmap_handle_pin_locked(h[i]));
+		}
+		mutex_unlock(&nvmap_pin_lock);
 	}
-	mutex_unlock(&nvmap_pin_lock);
 
 	if (ret) {
 		int do_wake = 0;
@@ -1853,11 +2177,6 @@ static int _nvmap_do_pin(struct nvmap_file_priv *priv,
 		spin_unlock(&priv->ref_lock);
 		if (do_wake) wake_up(&nvmap_pin_wait);
 		return -EINTR;
-	} else {
-		for (i=0; i<nr; i++) {
-			if (h[i]->heap_pgalloc && h[i]->pgalloc.dirty)
-				_nvmap_handle_iovmm_map(h[i]);
-		}
 	}
 
 	return 0;
@@ -2266,6 +2585,7 @@ static int _nvmap_carveout_relocate( struct nvmap_carveout_node *n,
 
 	if (!b_s->h ||
 	    (b_s->align & NVMAP_BLOCK_ALIGN_PINNED) ||
+	    atomic_read(&b_s->h->pin) ||
 	    b_s->mapcount)
 	{
 		spin_unlock(&nvmap_handle_lock);
@@ -2401,7 +2721,7 @@ static bool _nvmap_carveout_do_compact(struct nvmap_handle *h,
 			spin_lock(&co->lock);
 			idx = co->block_index;
 			while (idx!=-1 && nrelocate <= NVMAP_NRELOCATE_LIMIT) {
-				if (BLOCK(co, co->free_index)->size >= h->size) {
+				if (nvmap_largest_free(co) >= h->size) {
 					compaction_success = true;
 					if (compact_minimal) {
 						break;
@@ -2505,6 +2825,228 @@ static bool _nvmap_carveout_do_compact(struct nvmap_handle *h,
 	return compaction_success;
 }
 
+/* the free space is fragmented if less than half of it is in the largest
+ * free block. must be called with the carveout lock held */
+static bool _nvmap_carveout_fragmented(struct nvmap_carveout *co)
+{
+	unsigned long free_size = 0;
+	short idx;
+
+	for (idx = co->free_index; idx != -1; idx = co->blocks[idx].next_free)
+		free_size += co->blocks[idx].size;
+
+	return nvmap_largest_free(co) < free_size / 2;
+}
+
+/* copies size bytes of carveout memory from src_base to dst_base a page at
+ * a time through the two scratch ptes. the ranges must not overlap */
+static void _nvmap_carveout_copy(unsigned long dst_base,
+	unsigned long src_base, unsigned long size, void *addr_d,
+	void *addr_s, pgprot_t prot)
+{
+	unsigned long offset = 0;
+
+	while (offset < size) {
+		unsigned long phys_d, phys_s;
+		unsigned long count;
+
+		phys_d = dst_base + offset;
+		phys_s = src_base + offset;
+
+		count = min_t(size_t,
+			      size-offset,
+			      min_t(size_t,
+				    PAGE_SIZE-(phys_d&~PAGE_MASK),
+				    PAGE_SIZE-(phys_s&~PAGE_MASK)));
+
+		_nvmap_set_pte_at((unsigned long)addr_d,
+				__phys_to_pfn(phys_d), prot);
+		_nvmap_set_pte_at((unsigned long)addr_s,
+				__phys_to_pfn(phys_s), prot);
+		memcpy(addr_d + (phys_d & ~PAGE_MASK),
+		       addr_s + (phys_s & ~PAGE_MASK), count);
+		offset += count;
+		cond_resched();
+	}
+}
+
+/* moves the block at idx into a free block at or below idx_last without
+ * holding any spinlock during the copy: the destination is reserved (it
+ * is allocated but has no handle, so nothing else touches it), the data
+ * is copied, and the handle is switched over under the carveout lock only
+ * if the source was not pinned or mapped in the meantime. a handle
+ * reference keeps the source from being freed; nvmap_pin_lock, which the
+ * caller holds, keeps it from being pinned or relocated by anyone else.
+ *
+ * the block must hold an unpinned, unmapped handle. called with co->lock
+ * held; may drop it and returns with it held, so block indices other than
+ * the returned one are stale afterwards. returns the new block index or a
+ * negative error */
+static int _nvmap_carveout_bg_relocate(struct nvmap_carveout_node *n,
+	struct nvmap_carveout *co, int idx, int idx_last, void *addr_d,
+	void *addr_s, pgprot_t prot)
+{
+	struct nvmap_mem_block *b_s = BLOCK(co, idx);
+	struct nvmap_handle *h = b_s->h;
+	unsigned long src_base, dst_base, size;
+	unsigned int mapgen;
+	int idx_d;
+
+	src_base = b_s->base;
+	size = b_s->size;
+	mapgen = b_s->mapgen;
+
+	idx_d = nvmap_carveout_alloc_locked(n, co, b_s->align, size, idx_last);
+	if (idx_d == -1) {
+		nvmap_context.relocate_fail_mem_count++;
+		return -ENOMEM;
+	}
+	dst_base = co->blocks[idx_d].base;
+
+	/* same check as _nvmap_handle_free, so the handle is either kept
+	 * alive by us or already on its way out */
+	spin_lock(&nvmap_handle_lock);
+	if (atomic_read(&h->pin) || atomic_read(&h->ref) <= 0) {
+		spin_unlock(&nvmap_handle_lock);
+		nvmap_carveout_free(co, idx_d, false);
+		nvmap_context.relocate_fail_pin_count++;
+		return -EINVAL;
+	}
+	atomic_inc(&h->ref);
+	spin_unlock(&nvmap_handle_lock);
+	spin_unlock(&co->lock);
+
+	_nvmap_carveout_copy(dst_base, src_base, size, addr_d, addr_s, prot);
+
+	spin_lock(&co->lock);
+	b_s = BLOCK(co, idx);
+	if (h->carveout.block_idx != idx ||
+	    (b_s->align & NVMAP_BLOCK_ALIGN_PINNED) ||
+	    atomic_read(&h->pin) ||
+	    b_s->mapcount || b_s->mapgen != mapgen) {
+		nvmap_carveout_free(co, idx_d, false);
+		nvmap_context.relocate_fail_pin_count++;
+		idx_d = -EBUSY;
+	} else {
+		h->carveout.block_idx = idx_d;
+		h->carveout.base = dst_base;
+		co->blocks[idx_d].h = h;
+		nvmap_carveout_free(co, idx, false);
+		nvmap_context.compact_kbytes_count += size >> 10;
+	}
+	spin_unlock(&co->lock);
+
+	_nvmap_handle_put(h);
+
+	spin_lock(&co->lock);
+	return idx_d;
+}
+
+/* makes up to NVMAP_BG_COMPACT_BATCH attempts to move an unpinned,
+ * unmapped block that fits into the free block below it further down,
+ * copying no more than *budget bytes. returns the number of blocks moved */
+static int _nvmap_carveout_compact_step(struct nvmap_carveout_node *n,
+	void *addr_d, void *addr_s, pgprot_t prot, unsigned long *budget)
+{
+	struct nvmap_carveout *co = &n->carveout;
+	int moved = 0, tries = 0;
+	int idx;
+
+	spin_lock(&co->lock);
+	if (!_nvmap_carveout_fragmented(co)) {
+		spin_unlock(&co->lock);
+		return 0;
+	}
+
+	idx = co->block_index;
+	while (idx != -1 && tries < NVMAP_BG_COMPACT_BATCH) {
+		int idx_next = co->blocks[idx].next;
+		struct nvmap_mem_block *b = BLOCK(co, idx_next);
+
+		if (co_is_free(co, idx) && b && !co_is_free(co, idx_next) &&
+		    b->h && !(b->align & NVMAP_BLOCK_ALIGN_PINNED) &&
+		    !atomic_read(&b->h->pin) && !b->mapcount &&
+		    b->size <= co->blocks[idx].size && b->size <= *budget) {
+			size_t size = b->size;
+
+			tries++;
+			if (_nvmap_carveout_bg_relocate(n, co, idx_next, idx,
+					addr_d, addr_s, prot) >= 0) {
+				*budget -= size;
+				moved++;
+			}
+			/* the block list may have changed; start over */
+			if (!_nvmap_carveout_fragmented(co))
+				break;
+			idx = co->block_index;
+			continue;
+		}
+		idx = co->blocks[idx].next;
+	}
+	spin_unlock(&co->lock);
+
+	return moved;
+}
+
+/* schedules a background compaction pass, no sooner than
+ * NVMAP_BG_COMPACT_INTERVAL after the previous one */
+static void nvmap_bg_compact_kick(void)
+{
+	unsigned long next = nvmap_bg_compact_last + NVMAP_BG_COMPACT_INTERVAL;
+	unsigned long delay = NVMAP_BG_COMPACT_DELAY;
+
+	if (time_before(jiffies + delay, next))
+		delay = next - jiffies;
+
+	schedule_delayed_work(&nvmap_bg_compact_work, delay);
+}
+
+static void nvmap_bg_compact(struct work_struct *work)
+{
+	struct nvmap_carveout_node *n;
+	pgprot_t prot = _nvmap_flag_to_pgprot(NVMEM_HANDLE_WRITE_COMBINE,
+			pgprot_kernel);
+	void *addr_d = NULL;
+	void *addr_s = NULL;
+	unsigned long budget = NVMAP_BG_COMPACT_BYTES;
+	int moved = 0;
+
+	if (nvmap_map_pte(__phys_to_pfn(0), prot, &addr_d))
+		goto out;
+	if (nvmap_map_pte(__phys_to_pfn(0), prot, &addr_s))
+		goto out;
+
+	down_read(&nvmap_context.list_sem);
+	/* somebody is pinning or compacting for an allocation; don't get
+	 * in their way, try again later */
+	if (!mutex_trylock(&nvmap_pin_lock)) {
+		up_read(&nvmap_context.list_sem);
+		schedule_delayed_work(&nvmap_bg_compact_work,
+			NVMAP_BG_COMPACT_DELAY);
+		goto out;
+	}
+
+	list_for_each_entry(n, &nvmap_context.heaps, heap_list) {
+		moved += _nvmap_carveout_compact_step(n, addr_d, addr_s, prot,
+			&budget);
+		if (!budget)
+			break;
+	}
+
+	mutex_unlock(&nvmap_pin_lock);
+	up_read(&nvmap_context.list_sem);
+
+	nvmap_bg_compact_last = jiffies;
+
+	/* keep going, one budget per interval, while there is work to do */
+	if (moved)
+		nvmap_bg_compact_kick();
+
+out:
+	if (addr_d) nvmap_unmap_pte(addr_d);
+	if (addr_s) nvmap_unmap_pte(addr_s);
+}
+
 static void _nvmap_carveout_do_alloc(struct nvmap_handle *h,
 	unsigned int heap_type, size_t align, bool disable_co_killer)
 {
@@ -3023,7 +3565,7 @@ static int nvmap_map_into_caller_ptr(struct file *filp, void __user *arg)
 
 	if (h->alloc && !h->heap_pgalloc) {
 		spin_lock(&h->carveout.co_heap->lock);
-		BLOCK(h->carveout.co_heap, h->carveout.block_idx)->mapcount++;
+		nvmap_block_map(BLOCK(h->carveout.co_heap, h->carveout.block_idx));
 		spin_unlock(&h->carveout.co_heap->lock);
 	}
 
@@ -3075,6 +3617,9 @@ static int nvmap_mmap(struct file *filp, struct vm_area_struct *vma)
 extern void v7_flush_kern_cache_all(void *);
 extern void v7_clean_kern_cache_all(void *);
 #define FLUSH_CLEAN_BY_SET_WAY_THRESHOLD (3 * PAGE_SIZE)
+/* maintaining the whole L2 by set/way costs about as much as walking a
+ * range the size of the L2 line by line */
+#define OUTER_CLEAN_ALL_THRESHOLD SZ_1M
 
 /* perform cache maintenance on a handle; caller's handle must be pre-
  * validated. */
@@ -3126,11 +3671,20 @@ static int _nvmap_do_cache_maint(struct nvmap_handle *h,
 		}
 	}
 
+	/* must follow the inner maintenance, which may push lines out to
+	 * L2. with both levels done there is no need to walk the handle */
+	if (outer_maint && (end - start) >= OUTER_CLEAN_ALL_THRESHOLD) {
+		if (op == NVMEM_CACHE_OP_WB && outer_clean_all())
+			outer_maint = NULL;
+		else if (op == NVMEM_CACHE_OP_WB_INV && outer_flush_all())
+			outer_maint = NULL;
+	}
+
 	prot = _nvmap_flag_to_pgprot(h->flags, pgprot_kernel);
 
 	if (h->alloc && !h->heap_pgalloc) {
 		spin_lock(&h->carveout.co_heap->lock);
-		BLOCK(h->carveout.co_heap, h->carveout.block_idx)->mapcount++;
+		nvmap_block_map(BLOCK(h->carveout.co_heap, h->carveout.block_idx));
 		spin_unlock(&h->carveout.co_heap->lock);
 	}
 
@@ -3214,6 +3768,53 @@ static int nvmap_ioctl_cache_maint(struct file *filp, void __user *arg)
 	return _nvmap_do_cache_maint(vpriv->h, start, end, op.op, true);
 }
 
+/* performs an array of cache operations, each on a range of a handle, so
+ * that a whole frame's worth of maintenance costs one syscall. stops at
+ * the first failing entry */
+static int nvmap_ioctl_cache_maint_list(struct file *filp, void __user *arg)
+{
+	struct nvmem_cache_op_list	op;
+	struct nvmem_cache_op_entry	entry;
+	struct nvmem_cache_op_entry __user *uentry;
+	struct nvmap_handle		*h;
+	unsigned int			i;
+	int				err = 0;
+
+	if (copy_from_user(&op, arg, sizeof(op)))
+		return -EFAULT;
+
+	if (!op.ops || !op.count || op.count > NVMEM_CACHE_LIST_MAX)
+		return -EINVAL;
+
+	uentry = (struct nvmem_cache_op_entry __user *)op.ops;
+	if (!access_ok(VERIFY_READ, uentry, op.count * sizeof(entry)))
+		return -EFAULT;
+
+	for (i=0; i<op.count && !err; i++) {
+		if (__copy_from_user(&entry, &uentry[i], sizeof(entry)))
+			return -EFAULT;
+
+		if (!entry.handle || entry.op<NVMEM_CACHE_OP_WB ||
+		    entry.op>NVMEM_CACHE_OP_WB_INV)
+			return -EINVAL;
+
+		h = _nvmap_validate_get(entry.handle,
+			(filp->f_op == &knvmap_fops));
+		if (!h) return -EINVAL;
+
+		if (!h->alloc || entry.offset > h->size ||
+		    entry.len > h->size - entry.offset)
+			err = -EINVAL;
+		else
+			err = _nvmap_do_cache_maint(h, entry.offset,
+				entry.offset + entry.len, entry.op, false);
+
+		_nvmap_handle_put(h);
+	}
+
+	return err;
+}
+
 /* copies a single element from the pre-get()'ed handle h, returns
  * the number of bytes copied, and the address in the nvmap mapping range
  * which was used (to eliminate re-allocation when copying multiple
@@ -3306,7 +3907,7 @@ static ssize_t _nvmap_do_rw_handle(struct nvmap_handle *h, int is_read,
 
 	if (h->alloc && !h->heap_pgalloc) {
 		spin_lock(&h->carveout.co_heap->lock);
-		BLOCK(h->carveout.co_heap, h->carveout.block_idx)->mapcount++;
+		nvmap_block_map(BLOCK(h->carveout.co_heap, h->carveout.block_idx));
 		spin_unlock(&h->carveout.co_heap->lock);
 	}
 
@@ -3522,6 +4123,9 @@ static int __init nvmap_dev_init(void)
 	if (nvmap_procfs_root) {
 		nvmap_procfs_proc = proc_mkdir("proc", nvmap_procfs_root);
 	}
+
+	register_shrinker(&nvmap_page_pool_shrinker);
+	schedule_work(&nvmap_page_pool_work);
 	return 0;
 }
 fs_initcall(nvmap_dev_init);
@@ -3561,8 +4165,8 @@ static int __init nvmap_core_init(void)
 	INIT_LIST_HEAD(&nvmap_context.heaps);
 
 #ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
-	for (i=0; i<ARRAY_SIZE(nvmap_mru_cutoff); i++)
-		INIT_LIST_HEAD(&nvmap_mru_vma_lists[i]);
+	for (i=0; i<ARRAY_SIZE(nvmap_lru_vma_lists); i++)
+		INIT_LIST_HEAD(&nvmap_lru_vma_lists[i]);
 #endif
 
 	i = 0;
@@ -3920,7 +4524,7 @@ NvError NvRmMemMap(NvRmMemHandle hMem, NvU32 Offset, NvU32 Size,
 	} else {
 		if (h->alloc && !h->heap_pgalloc) {
 			spin_lock(&h->carveout.co_heap->lock);
-			BLOCK(h->carveout.co_heap, h->carveout.block_idx)->mapcount++;
+			nvmap_block_map(BLOCK(h->carveout.co_heap, h->carveout.block_idx));
 			spin_unlock(&h->carveout.co_heap->lock);
 		}
 
@@ -4319,7 +4923,7 @@ struct nvmap_handle *nvmap_alloc(
 
 		if (h->alloc && !h->heap_pgalloc) {
 			spin_lock(&h->carveout.co_heap->lock);
-			BLOCK(h->carveout.co_heap, h->carveout.block_idx)->mapcount++;
+			nvmap_block_map(BLOCK(h->carveout.co_heap, h->carveout.block_idx));
 			spin_unlock(&h->carveout.co_heap->lock);
 		}
 
@@ -4452,10 +5056,6 @@ int nvmap_pin_array(struct file *filp,
 		struct page *page = NULL;
 		u32* patch_addr;
 
-		/* commit iovmm mapping */
-		if (h_pin->heap_pgalloc && h_pin->pgalloc.dirty)
-			_nvmap_handle_iovmm_map(h_pin);
-
 		/* patch */
 		if (h_patch->kern_map) {
 			patch_addr = (u32*)((unsigned long)h_patch->kern_map +
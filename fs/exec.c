@@ -56,6 +56,7 @@
 #include <linux/fsnotify.h>
 #include <linux/fs_struct.h>
 #include <linux/pipe_fs_i.h>
+#include <linux/oom.h>
 
 #include <asm/uaccess.h>
 #include <asm/mmu_context.h>
@@ -894,6 +895,8 @@ static int de_thread(struct task_struct *tsk)
 		leader->exit_state = EXIT_DEAD;
 		write_unlock_irq(&tasklist_lock);
 
+		oom_adj_notify(tsk, OOM_ADJ_CHANGED);
+
 		release_task(leader);
 	}
 
@@ -1091,6 +1091,7 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 	task->signal->oom_adj = oom_adjust;
 
 	unlock_task_sighand(task, &flags);
+	oom_adj_notify(task->group_leader, OOM_ADJ_CHANGED);
 	put_task_struct(task);
 
 	return count;
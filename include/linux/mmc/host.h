@@ -12,6 +12,7 @@
 
 #include <linux/leds.h>
 #include <linux/sched.h>
+#include <linux/ktime.h>
 
 #include <linux/mmc/core.h>
 
@@ -82,6 +83,18 @@ struct mmc_host_ops {
 	int (*enable)(struct mmc_host *host);
 	int (*disable)(struct mmc_host *host, int lazy);
 	void	(*request)(struct mmc_host *host, struct mmc_request *req);
+	/*
+	 * Optional: 'pre_req' prepares a request (e.g. maps it for DMA)
+	 * while the previous one may still be running, and 'post_req'
+	 * undoes that once the request has completed, possibly while the
+	 * next one is already running. 'err' is non-zero if the request
+	 * was prepared but never issued. 'is_first_req' is set when no
+	 * request is in flight.
+	 */
+	void	(*pre_req)(struct mmc_host *host, struct mmc_request *req,
+			   bool is_first_req);
+	void	(*post_req)(struct mmc_host *host, struct mmc_request *req,
+			    int err);
 	/*
 	 * Avoid calling these three functions too often or in a "fast path",
 	 * since underlaying controller might implement them in an expensive
@@ -115,6 +128,35 @@ struct mmc_host_ops {
 struct mmc_card;
 struct device;
 
+/* What a latency sample measures, see mmc_latency_add() */
+enum mmc_lat_type {
+	MMC_LAT_READ,		/* read request, start to completion */
+	MMC_LAT_WRITE,		/* write request, start to completion */
+	MMC_LAT_CMD,		/* request without data */
+	MMC_LAT_BUSY,		/* CMD13 polling until the card is ready */
+	MMC_LAT_PREP,		/* host pre_req (e.g. DMA mapping) */
+	MMC_LAT_NR,
+};
+
+/* Bucket n > 0 counts samples of [2^(n-1), 2^n) us, the last one is open */
+#define MMC_LAT_BUCKETS		22
+#define MMC_LAT_RETRY_BUCKETS	6
+
+struct mmc_lat_hist {
+	unsigned long		count[MMC_LAT_BUCKETS];
+	u64			total_us;
+	unsigned long		max_us;
+};
+
+struct mmc_latency_stats {
+	struct mmc_lat_hist	hist[MMC_LAT_NR];
+	unsigned long		retries[MMC_LAT_RETRY_BUCKETS];
+
+	/* The request currently on the bus */
+	ktime_t			start;
+	unsigned int		cur_retries;
+};
+
 struct mmc_host {
 	struct device		*parent;
 	struct device		class_dev;
@@ -186,6 +228,7 @@ struct mmc_host {
 	struct delayed_work	disable;	/* disabling work */
 
 	struct mmc_card		*card;		/* device attached to this host */
+	struct mmc_async_req	*areq;		/* active async request */
 
 	wait_queue_head_t	wq;
 	struct task_struct	*claimer;	/* task that has host claimed */
@@ -212,6 +255,10 @@ struct mmc_host {
 
 	struct dentry		*debugfs_root;
 
+#ifdef CONFIG_MMC_LATENCY_STATS
+	struct mmc_latency_stats lat_stats;
+#endif
+
 #ifdef CONFIG_MMC_EMBEDDED_SDIO
 	struct {
 		struct sdio_cis			*cis;
@@ -268,6 +315,25 @@ extern void mmc_power_restore_host(struct mmc_host *host);
 extern void mmc_detect_change(struct mmc_host *, unsigned long delay);
 extern void mmc_request_done(struct mmc_host *, struct mmc_request *);
 
+#ifdef CONFIG_MMC_LATENCY_STATS
+extern void mmc_latency_add(struct mmc_host *, enum mmc_lat_type, ktime_t);
+
+static inline ktime_t mmc_latency_start(void)
+{
+	return ktime_get();
+}
+#else
+static inline void mmc_latency_add(struct mmc_host *host,
+				   enum mmc_lat_type type, ktime_t start)
+{
+}
+
+static inline ktime_t mmc_latency_start(void)
+{
+	return ktime_set(0, 0);
+}
+#endif
+
 static inline void mmc_signal_sdio_irq(struct mmc_host *host)
 {
 	host->ops->enable_sdio_irq(host, 0);
@@ -252,6 +252,7 @@ struct _mmc_csd {
  * EXT_CSD fields
  */
 
+#define EXT_CSD_DATA_SECTOR_SIZE 61	/* R */
 #define EXT_CSD_BUS_WIDTH	183	/* R/W */
 #define EXT_CSD_HS_TIMING	185	/* R/W */
 #define EXT_CSD_POWER_CLASS	187	/* R/W */
@@ -266,6 +267,8 @@ struct _mmc_csd {
 #define EXT_CSD_S_A_TIMEOUT	217
 #define EXT_CSD_REL_WR_SEC_C    222	/* RO */
 #define EXT_CSD_BOOT_SIZE_MULTI 226
+#define EXT_CSD_MAX_PACKED_WRITES 500	/* RO */
+#define EXT_CSD_MAX_PACKED_READS 501	/* RO */
 /*
  * EXT_CSD field definitions
  */
@@ -282,6 +285,22 @@ struct _mmc_csd {
 #define EXT_CSD_BUS_WIDTH_4	1	/* Card is in 4 bit mode */
 #define EXT_CSD_BUS_WIDTH_8	2	/* Card is in 8 bit mode */
 
+#define EXT_CSD_DATA_SECTOR_SIZE_512	0	/* Native sector size */
+
+/*
+ * Packed commands (eMMC 4.5). The first block of a packed transfer is a
+ * header made of 32-bit little-endian words: word 0 describes the pack,
+ * words 2n and 2n + 1 hold the CMD23 and CMD18/CMD25 arguments of entry
+ * n (counting from 1).
+ */
+#define MMC_CMD23_ARG_REL_WR	(1 << 31)	/* Reliable write */
+#define MMC_CMD23_ARG_PACKED	(1 << 30)	/* Packed command */
+
+#define MMC_PACKED_CMD_VER	0x01
+#define MMC_PACKED_CMD_WR	0x02
+#define MMC_PACKED_HDR_WORDS	128		/* 512 byte header */
+#define MMC_PACKED_MAX_ENTRIES	(MMC_PACKED_HDR_WORDS / 2 - 1)
+
 /*
  * MMC_SWITCH access modes
  */
@@ -114,6 +114,20 @@ struct nvmem_cache_op {
 	__s32 op;
 };
 
+struct nvmem_cache_op_entry {
+	__u32 handle;
+	__u32 offset;		/* offset into hmem */
+	__u32 len;
+	__s32 op;
+};
+
+#define NVMEM_CACHE_LIST_MAX	1024
+
+struct nvmem_cache_op_list {
+	unsigned long ops;	/* array of struct nvmem_cache_op_entry */
+	__u32 count;		/* number of entries in ops */
+};
+
 #define NVMEM_IOC_MAGIC 'N'
 
 /* Creates a new memory handle. On input, the argument is the size of the new
@@ -153,7 +167,10 @@ struct nvmem_cache_op {
  * reference to the same handle */
 #define NVMEM_IOC_GET_ID  _IOWR(NVMEM_IOC_MAGIC, 13, struct nvmem_create_handle)
 
-#define NVMEM_IOC_MAXNR (_IOC_NR(NVMEM_IOC_GET_ID))
+/* Performs cache maintenance on a list of handle ranges in one call */
+#define NVMEM_IOC_CACHE_LIST _IOW (NVMEM_IOC_MAGIC, 14, struct nvmem_cache_op_list)
+
+#define NVMEM_IOC_MAXNR (_IOC_NR(NVMEM_IOC_CACHE_LIST))
 
 #if defined(__KERNEL__)
 
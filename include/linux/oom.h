@@ -13,6 +13,7 @@
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -30,6 +31,19 @@ extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask, int order);
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
 
+/*
+ * Events passed to oom_adj notifiers. The task is always a thread group
+ * leader; for OOM_ADJ_CHANGED its signal->oom_adj holds the new value.
+ */
+enum oom_adj_event {
+	OOM_ADJ_CHANGED,	/* new thread group, exec or oom_adj write */
+	OOM_ADJ_EXITED,		/* group leader has released its mm */
+};
+
+extern int register_oom_adj_notifier(struct notifier_block *nb);
+extern int unregister_oom_adj_notifier(struct notifier_block *nb);
+extern void oom_adj_notify(struct task_struct *p, enum oom_adj_event event);
+
 extern bool oom_killer_disabled;
 
 static inline void oom_killer_disable(void)
@@ -16,14 +16,45 @@
 #ifndef __uid_stat_h
 #define __uid_stat_h
 
+#include <linux/types.h>
+
 /* Contains definitions for resource tracking per uid. */
 
+/*
+ * One record of /proc/uid_stat/stats, which returns an array of these
+ * in uid creation order. Reads must be a whole number of records.
+ */
+struct uid_stat_record {
+	__u32 uid;
+	__u32 tcp_snd;
+	__u32 tcp_rcv;
+	__u32 pad;
+	__u64 io_read_bytes;
+	__u64 io_write_bytes;
+	__u64 io_read_ops;
+	__u64 io_write_ops;
+	__u64 cpu_user_us;
+	__u64 cpu_sys_us;
+	__u64 wakeups;
+};
+
+#ifdef __KERNEL__
+struct task_struct;
+
 #ifdef CONFIG_UID_STAT
 int update_tcp_snd(uid_t uid, int size);
 int update_tcp_rcv(uid_t uid, int size);
+void uid_stat_blk_io(int rw, unsigned int bytes);
+void uid_stat_cpu_time(struct task_struct *p, unsigned long usecs, int user);
+void uid_stat_wakeup(struct task_struct *p);
 #else
 #define update_tcp_snd(uid, size) do {} while (0);
 #define update_tcp_rcv(uid, size) do {} while (0);
+static inline void uid_stat_blk_io(int rw, unsigned int bytes) { }
+static inline void uid_stat_cpu_time(struct task_struct *p,
+				     unsigned long usecs, int user) { }
+static inline void uid_stat_wakeup(struct task_struct *p) { }
 #endif
+#endif /* __KERNEL__ */
 
 #endif /* _LINUX_UID_STAT_H */
@@ -48,6 +48,7 @@
 #include <linux/fs_struct.h>
 #include <linux/init_task.h>
 #include <linux/perf_event.h>
+#include <linux/oom.h>
 #include <trace/events/sched.h>
 
 #include <asm/uaccess.h>
@@ -980,6 +981,8 @@ NORET_TYPE void do_exit(long code)
 	taskstats_exit(tsk, group_dead);
 
 	exit_mm(tsk);
+	if (thread_group_leader(tsk))
+		oom_adj_notify(tsk, OOM_ADJ_EXITED);
 
 	if (group_dead)
 		acct_process();
@@ -71,6 +71,7 @@
 #include <linux/debugfs.h>
 #include <linux/ctype.h>
 #include <linux/ftrace.h>
+#include <linux/uid_stat.h>
 
 #include <asm/tlb.h>
 #include <asm/irq_regs.h>
@@ -2585,6 +2586,7 @@ out_activate:
 		schedstat_inc(p, se.nr_wakeups_remote);
 	activate_task(rq, p, 1);
 	success = 1;
+	uid_stat_wakeup(p);
 
 	/*
 	 * Only attribute actual wakeups done by this task.
@@ -5303,6 +5305,7 @@ void account_user_time(struct task_struct *p, cputime_t cputime,
 		cpustat->user = cputime64_add(cpustat->user, tmp);
 
 	cpuacct_update_stats(p, CPUACCT_STAT_USER, cputime);
+	uid_stat_cpu_time(p, jiffies_to_usecs(cputime_to_jiffies(cputime)), 1);
 	/* Account for user time used */
 	acct_update_integrals(p);
 }
@@ -5365,6 +5368,7 @@ void account_system_time(struct task_struct *p, int hardirq_offset,
 		cpustat->system = cputime64_add(cpustat->system, tmp);
 
 	cpuacct_update_stats(p, CPUACCT_STAT_SYSTEM, cputime);
+	uid_stat_cpu_time(p, jiffies_to_usecs(cputime_to_jiffies(cputime)), 0);
 
 	/* Account for system time used */
 	acct_update_integrals(p);